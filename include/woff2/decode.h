@@ -11,13 +11,151 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <woff2/dictionary.h>
 #include <woff2/output.h>
+#include <woff2/stats.h>
 
 namespace woff2 {
 
+/**
+ * Memory kept from one decode to the next. Decodes that are given the same
+ * context reuse its buffers instead of allocating new ones, so that once they
+ * have grown to fit the fonts being decoded, decoding mostly stops allocating.
+ *
+ * A context may only be used by one decode at a time.
+ */
+class DecodeContext {
+ public:
+  DecodeContext();
+  ~DecodeContext();
+
+  DecodeContext(const DecodeContext&) = delete;
+  DecodeContext& operator=(const DecodeContext&) = delete;
+
+  // Frees all memory held by the context.
+  void Clear();
+
+  // Defined, and only used, by the decoder.
+  struct Buffers;
+
+ private:
+  friend Buffers* GetBuffers(DecodeContext* context);
+
+  std::unique_ptr<Buffers> buffers_;
+};
+
+struct WOFF2DecodeParams {
+  WOFF2DecodeParams()
+      : num_threads(1), context(NULL), stats(NULL), dictionary(NULL),
+        sequential_output(false), memory_limit(0) {}
+
+  // Number of threads the fonts of a collection may be reconstructed on.
+  // Tables shared between fonts are still reconstructed only once, and the
+  // output is the same for any value.
+  int num_threads;
+
+  // If set, the decode reuses the memory of this context.
+  DecodeContext* context;
+
+  // If set, receives timings and other statistics about the decode.
+  WOFF2Stats* stats;
+
+  // The dictionary of files compressed with one; see WOFF2Dictionary. Files
+  // compressed without are decoded as usual.
+  const WOFF2Dictionary* dictionary;
+
+  // If set, the output is only ever appended to, so that it can be passed on
+  // as it is written, as WOFF2CallbackOut does. The headers hold the offsets,
+  // lengths and checksums of the tables, which are only known once the tables
+  // are rebuilt, so the tables are rebuilt twice: once without output to find
+  // them out, and once to write the font in order. A single font is
+  // decompressed for each pass, so that little of it is held in memory.
+  bool sequential_output;
+
+  // If not 0, the most memory the decode may take, in bytes, or it fails
+  // with WOFF2Failure::kMemoryLimit. This covers what the library allocates
+  // for the decode: Brotli's state, the decompressed data that is held, and
+  // the buffers tables are rebuilt in, not the output or the few bytes of
+  // bookkeeping per table. A file whose directory needs more is rejected
+  // before anything is decompressed. Memory a context keeps from earlier
+  // decodes only counts as far as this one uses it. WOFF2Stats::OnPeakMemory
+  // tells how much a decode took.
+  size_t memory_limit;
+};
+
+/**
+ * The header, table directory and collection directory of a WOFF2 file, as
+ * read by ReadWOFF2Directory.
+ */
+struct Woff2Directory {
+  struct Table {
+    uint32_t tag;
+    // The flags byte of the entry, holding the transform version and the
+    // index of a known tag.
+    uint8_t flags;
+    bool transformed;
+    // Length of the table in the decoded font.
+    uint32_t orig_length;
+    // Offset and length of the table, transformed if it is, in the
+    // decompressed data stream.
+    uint32_t stream_offset;
+    uint32_t stream_length;
+    // Where the entry starts in the file.
+    size_t entry_offset;
+  };
+
+  struct CollectionFont {
+    uint32_t flavor;
+    // Indices into tables, in the order of the collection directory.
+    std::vector<uint16_t> table_indices;
+  };
+
+  uint32_t flavor;
+  uint32_t length;
+  uint16_t num_tables;
+  // The id of the dictionary the file was compressed with, or 0.
+  uint16_t reserved;
+  uint32_t total_sfnt_size;
+  uint32_t total_compressed_size;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint32_t meta_offset;
+  uint32_t meta_length;
+  uint32_t meta_orig_length;
+  uint32_t priv_offset;
+  uint32_t priv_length;
+
+  std::vector<Table> tables;
+
+  // Version of the collection directory, or 0 if the file is not a collection.
+  uint32_t collection_version;
+  std::vector<CollectionFont> fonts;
+
+  // Where the compressed data starts, just after the directories.
+  size_t compressed_offset;
+  // Length of the decompressed data stream.
+  uint32_t stream_length;
+};
+
+// Reads the directories of a WOFF2 file into *directory, checking them the
+// way a decode would but without decompressing anything. Returns false if
+// they are invalid.
+bool ReadWOFF2Directory(const uint8_t *data, size_t length,
+                        Woff2Directory* directory);
+
 // Compute the size of the final uncompressed font, or 0 on error.
 size_t ComputeWOFF2FinalSize(const uint8_t *data, size_t length);
 
+// Computes the size of the decoded font from the table directory: the sfnt
+// or collection headers and every table, padded as the decoder writes them.
+// Unlike ComputeWOFF2FinalSize() it doesn't trust totalSfntSize, and is exact
+// unless 'glyf' was transformed by an encoder that lays out glyphs unlike
+// this library. Returns 0 on error.
+size_t ComputeWOFF2DecodedSize(const uint8_t *data, size_t length);
+
 // Decompresses the font into the target buffer. The result_length should
 // be the same as determined by ComputeFinalSize(). Returns true on successful
 // decompression.
@@ -30,6 +168,167 @@ bool ConvertWOFF2ToTTF(uint8_t *result, size_t result_length,
 // Please prefer this API.
 bool ConvertWOFF2ToTTF(const uint8_t *data, size_t length,
                        WOFF2Out* out);
+bool ConvertWOFF2ToTTF(const uint8_t *data, size_t length,
+                       WOFF2Out* out, const WOFF2DecodeParams& params);
+
+// A WOFF2 file of a batch.
+struct WOFF2Input {
+  const uint8_t* data;
+  size_t length;
+};
+
+// Decompresses inputs[i] into outs[i] for each of the count files, e.g. the
+// fonts of a page, on up to params.num_threads threads. Every thread reuses
+// one context, and with it the Brotli and reconstruction memory, for all the
+// fonts it decodes; params.context is the one of the calling thread. The
+// largest files are started first, and a thread takes the next file as soon
+// as it is done with one, so the batch takes little longer than its largest
+// file. Fonts are decoded on one thread each, and params.stats is not used.
+// Sets results[i], if results is set, to whether file i was decoded. Returns
+// true if all were.
+bool ConvertWOFF2ToTTFBatch(const WOFF2Input* inputs, WOFF2Out* const* outs,
+                            size_t count, const WOFF2DecodeParams& params,
+                            bool* results = NULL);
+
+// What ValidateWOFF2() found wrong with a file.
+struct WOFF2Validation {
+  WOFF2Validation() : valid(false), failure(WOFF2Failure::kInvalidHeader),
+                      tag(0) {}
+
+  bool valid;
+  // If not valid: why, and the table that is invalid, or 0, as
+  // WOFF2Stats::OnFailure() would be told by a decode.
+  WOFF2Failure failure;
+  uint32_t tag;
+};
+
+// Checks that the file decodes, e.g. before accepting an upload, without
+// writing the font anywhere. Every check of a decode is made, and the tables
+// are rebuilt as for ConvertWOFF2ToTTF(), but not stored or checksummed.
+// Of the params, stats and sequential_output are not used. Sets *result, if
+// result is set, and returns whether the file is valid.
+bool ValidateWOFF2(const uint8_t *data, size_t length,
+                   const WOFF2DecodeParams& params = WOFF2DecodeParams(),
+                   WOFF2Validation* result = NULL);
+
+/**
+ * Reads single glyphs out of a WOFF2 font without decoding all of it. Only the
+ * font data stream up to the end of 'glyf' and 'loca' is decompressed, and a
+ * quick scan of the transformed 'glyf' notes where the data of each glyph
+ * starts in its substreams, so that any glyph can then be rebuilt on its own.
+ *
+ * For a disk cache, the decompressed stream and an index of those positions
+ * can be saved, and a later reader opened from them instead, with neither
+ * the decompression nor the scan.
+ *
+ * A reader may only be used by one thread at a time.
+ */
+class Woff2GlyphReader {
+ public:
+  Woff2GlyphReader();
+  ~Woff2GlyphReader();
+
+  Woff2GlyphReader(const Woff2GlyphReader&) = delete;
+  Woff2GlyphReader& operator=(const Woff2GlyphReader&) = delete;
+
+  // Prepares to read the glyphs of font font_index of data, which for a
+  // single font is 0. data is not needed afterwards; dictionary, only needed
+  // for files compressed with one, is not either. Returns false if the font is
+  // invalid or has no 'glyf' table.
+  bool Open(const uint8_t *data, size_t length, size_t font_index = 0,
+            const WOFF2Dictionary* dictionary = NULL);
+
+  // Prepares to read the glyphs of a font from the stream and the index that
+  // an earlier reader had for it, as stream_data() and SaveIndex() gave them.
+  // Both are only checked to be consistent, and stream is read in place, so
+  // it may be mapped from a file but must stay there while the reader is
+  // open. Returns false if they don't match.
+  bool OpenCached(const uint8_t *stream, size_t stream_length,
+                  const uint8_t *index, size_t index_length);
+
+  // Number of glyphs of the open font, or 0.
+  uint16_t num_glyphs() const;
+
+  // The part of the decompressed font data stream that the reader reads
+  // glyphs from, or NULL if none is open.
+  const uint8_t* stream_data() const;
+  size_t stream_length() const;
+
+  // Sets *index to an index for OpenCached() with stream_data(): where the
+  // data of each glyph starts in the substreams of 'glyf', and the decoded
+  // 'loca'. The first call for a font rebuilds every glyph once to size it.
+  // Returns false if no font is open, or a glyph is invalid.
+  bool SaveIndex(std::string* index);
+
+  // Sets *offset to the offset of glyph glyph_id in the decoded 'glyf' table;
+  // for glyph_id num_glyphs(), to the length of the table. Returns false if
+  // there is no such glyph, or a glyph is invalid.
+  bool GlyphOffset(uint32_t glyph_id, uint32_t* offset);
+
+  // Sets *glyph to the data of glyph glyph_id as it is in the decoded 'glyf'
+  // table, without padding; empty glyphs are empty. Returns false if there is
+  // no such glyph, or it is invalid.
+  bool ReadGlyph(uint16_t glyph_id, std::string* glyph);
+
+  // Sets *glyphs to the count glyphs from first_glyph as they are in the
+  // decoded 'glyf' table, padding included, i.e. from GlyphOffset(first_glyph)
+  // to GlyphOffset(first_glyph + count). Returns false if there are no such
+  // glyphs, or one is invalid.
+  bool ReadGlyphs(uint16_t first_glyph, uint32_t count, std::string* glyphs);
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+/**
+ * Decodes a WOFF2 file as it arrives, e.g. from the network, without blocking
+ * for the rest of it. Feed() hands over the next bytes of the file, and is
+ * quick: it reads the header once it is all there and decompresses what it
+ * can. Drain() then reconstructs the tables whose data has been decompressed
+ * and writes them to out, which must be the same for every call. A single
+ * font is written table by table, with its headers first and the checksums
+ * filled in behind; the tables of a collection are only reconstructed once
+ * all of its data has arrived.
+ *
+ * The decoded data stream is held until the decode is done. Of the params,
+ * num_threads and sequential_output are not used.
+ *
+ * A decoder may only be used by one thread at a time.
+ */
+class Woff2Decoder {
+ public:
+  enum class Status {
+    // Drain() has nothing to write until more of the file is fed.
+    kNeedsMoreInput,
+    // Drain() has tables to write.
+    kHasOutput,
+    // The whole font has been written.
+    kDone,
+    // The file is invalid, or could not be written; the decoder stops.
+    kError,
+  };
+
+  explicit Woff2Decoder(const WOFF2DecodeParams& params = WOFF2DecodeParams());
+  ~Woff2Decoder();
+
+  Woff2Decoder(const Woff2Decoder&) = delete;
+  Woff2Decoder& operator=(const Woff2Decoder&) = delete;
+
+  // Takes the next length bytes of the file, which are not needed afterwards.
+  // Feeding more than the header says the file holds is an error.
+  Status Feed(const uint8_t *data, size_t length);
+
+  // Writes what can be written to out. Returns kDone once the font is
+  // complete, and kNeedsMoreInput or kError otherwise.
+  Status Drain(WOFF2Out* out);
+
+  Status status() const;
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
 
 } // namespace woff2
 
@@ -0,0 +1,75 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Cache of decoded fonts, for servers that decode the same files often. */
+
+#ifndef WOFF2_WOFF2_DECODE_CACHE_H_
+#define WOFF2_WOFF2_DECODE_CACHE_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <memory>
+#include <woff2/decode.h>
+#include <woff2/output.h>
+
+namespace woff2 {
+
+/**
+ * Keeps the results of recent decodes, so that decoding the same WOFF2 file
+ * again costs a copy instead of a decode. Files are found by a hash of their
+ * content and then compared in full, so a cache never hands out the wrong
+ * font. The least recently used entries are dropped to stay within a budget
+ * of bytes, which counts the kept WOFF2 files as well as what is kept for
+ * them.
+ *
+ * Any number of threads may decode through the same cache at once.
+ */
+class DecodeCache {
+ public:
+  // What the cache keeps for each file.
+  enum class Mode {
+    // The decoded font: a hit is a plain copy.
+    kFont,
+    // The decompressed font data stream, typically a little smaller: a hit
+    // still rebuilds the tables, but skips Brotli.
+    kStream,
+  };
+
+  explicit DecodeCache(size_t max_bytes, Mode mode = Mode::kFont);
+  ~DecodeCache();
+
+  DecodeCache(const DecodeCache&) = delete;
+  DecodeCache& operator=(const DecodeCache&) = delete;
+
+  // Like the ConvertWOFF2ToTTF of the same arguments, answered from the cache
+  // when it can be. Fonts that fail to decode are not cached. params.stats,
+  // if set, is also told whether the cache was hit.
+  bool ConvertWOFF2ToTTF(const uint8_t *data, size_t length, WOFF2Out* out);
+  bool ConvertWOFF2ToTTF(const uint8_t *data, size_t length, WOFF2Out* out,
+                         const WOFF2DecodeParams& params);
+
+  // Totals since the cache was created.
+  struct Counters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // What the cache holds now.
+    size_t entries;
+    size_t bytes;
+  };
+  Counters GetCounters() const;
+
+  // Drops every entry; the counters are kept.
+  void Clear();
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+} // namespace woff2
+
+#endif  // WOFF2_WOFF2_DECODE_CACHE_H_
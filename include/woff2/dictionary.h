@@ -0,0 +1,64 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Shared Brotli dictionaries for the fonts of a family. */
+
+#ifndef WOFF2_WOFF2_DICTIONARY_H_
+#define WOFF2_WOFF2_DICTIONARY_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <string>
+#include <woff2/output.h>
+
+namespace woff2 {
+
+/**
+ * Data that the compressed font data stream of a WOFF2 file may refer back
+ * to, as if it came just before the stream. Made from fonts that have much in
+ * common, such as the weights of a family (see BuildWOFF2Dictionary), it lets
+ * each of them be compressed to a fraction of what it takes on its own.
+ *
+ * This is not part of WOFF2: a file compressed with a dictionary can only be
+ * decoded by this library, given the same dictionary. Such files carry the id
+ * of their dictionary in the reserved field of the WOFF2 header, which is
+ * otherwise 0.
+ *
+ * The encoder starts Brotli on the dictionary data, and the decoder on its
+ * primer, which is that data as the encoder compresses it: the dictionary is
+ * tied to the Brotli settings it was made with, which replace those of the
+ * encode.
+ *
+ * This has a cost on every file: an encode compresses the dictionary data
+ * before the font, and a decode decompresses the primer before the stream,
+ * as Brotli 1.0 can neither load a prepared dictionary nor copy a primed
+ * state. That takes about as long as the dictionary is large, warm context or
+ * not, so dictionaries are best kept small. A decode context only compares
+ * the primer with the data the first time it is given a dictionary.
+ */
+struct WOFF2Dictionary {
+  std::string data;
+  int brotli_quality;
+  int brotli_window;
+  std::string primer;
+  // Identifies the dictionary in the files compressed with it. Never 0.
+  uint16_t id;
+};
+
+// The id of a dictionary with this primer.
+uint16_t ComputeWOFF2DictionaryId(const std::string& primer);
+
+// Reads a dictionary written by WriteWOFF2Dictionary. Returns false if it is
+// malformed.
+bool ReadWOFF2Dictionary(const uint8_t *data, size_t length,
+                         WOFF2Dictionary* dictionary);
+
+// Writes dictionary to out. Returns false if out does not take it.
+bool WriteWOFF2Dictionary(const WOFF2Dictionary& dictionary, WOFF2Out* out);
+
+} // namespace woff2
+
+#endif  // WOFF2_WOFF2_DICTIONARY_H_
@@ -11,19 +11,100 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <memory>
 #include <string>
+#include <vector>
+#include <woff2/dictionary.h>
+#include <woff2/output.h>
+#include <woff2/stats.h>
 
 namespace woff2 {
 
+/**
+ * Memory kept from one encode to the next. Encodes that are given the same
+ * context reuse its table buffers, glyf transform streams and compression
+ * buffers instead of allocating new ones.
+ *
+ * A context may only be used by one encode at a time.
+ */
+class EncodeContext {
+ public:
+  EncodeContext();
+  ~EncodeContext();
+
+  EncodeContext(const EncodeContext&) = delete;
+  EncodeContext& operator=(const EncodeContext&) = delete;
+
+  // Frees all memory held by the context.
+  void Clear();
+
+  // Defined, and only used, by the encoder.
+  struct Buffers;
+
+ private:
+  friend Buffers* GetBuffers(EncodeContext* context);
+
+  std::unique_ptr<Buffers> buffers_;
+};
+
 struct WOFF2Params {
   WOFF2Params() : extended_metadata(""), brotli_quality(11),
-                  allow_transforms(true) {}
+                  brotli_window(22), allow_transforms(true), num_threads(1),
+                  context(NULL), stats(NULL), dictionary(NULL),
+                  previous_woff2(NULL), previous_woff2_length(0),
+                  glyph_subset(NULL), time_budget(0) {}
 
   std::string extended_metadata;
   int brotli_quality;
+  // Base 2 logarithm of the Brotli sliding window, in [10, 24]. Smaller
+  // windows compress large fonts faster at the cost of a larger output.
+  int brotli_window;
   bool allow_transforms;
+  // Number of threads used to normalize and transform the fonts. The output
+  // does not depend on it.
+  int num_threads;
+  // If set, the encode reuses the memory of this context.
+  EncodeContext* context;
+  // If set, receives timings and other statistics about the encode.
+  WOFF2Stats* stats;
+  // If set, the font data is compressed with this dictionary, and with its
+  // Brotli settings rather than brotli_quality and brotli_window. The result
+  // is not a valid WOFF2 file; see WOFF2Dictionary.
+  const WOFF2Dictionary* dictionary;
+  // If set, an earlier encode of this font, as a WOFF2 file. Fonts whose
+  // 'glyf' and 'loca' normalize to what it holds reuse its transformed
+  // 'glyf', which doesn't depend on the Brotli settings. With a dictionary,
+  // whose settings the font data is always compressed with, the compressed
+  // data is reused as well if the font data as a whole is the same; without,
+  // the file can't tell whether it was made with brotli_quality and
+  // brotli_window, so the font data is compressed again. A file that can't
+  // be decoded is ignored.
+  const uint8_t* previous_woff2;
+  size_t previous_woff2_length;
+  // If set, only the glyphs with these ids keep their 'glyf' outlines, along
+  // with glyph 0 and the components of the composite glyphs among them. The
+  // other glyphs are left empty as they are encoded. Glyph ids don't change,
+  // so the other tables are kept as they are. For a collection, the ids apply
+  // to each of its fonts.
+  const std::vector<uint16_t>* glyph_subset;
+  // If positive, the number of seconds Brotli may take to compress the font
+  // data and the metadata. Instead of brotli_quality, the font data gets the
+  // highest quality expected to fit, as ChooseBrotliQuality() picks it, and
+  // the metadata the highest that fits in what is left; each gets the
+  // smallest window of at most brotli_window bits that holds it. The choice
+  // depends only on the sizes, so the output does too. A fast first encode
+  // can then be replaced with one at the default quality later. With a
+  // dictionary, the font data is compressed with the settings of the
+  // dictionary whatever the budget, and priming the encoder with it isn't
+  // counted, so only the metadata keeps to the budget.
+  double time_budget;
 };
 
+// Returns the highest Brotli quality that is expected to compress length bytes
+// of font data within seconds on one core, or 0 if none is. The estimate
+// comes from a fixed table of speeds, measured on a typical desktop core.
+int ChooseBrotliQuality(size_t length, double seconds);
+
 // Returns an upper bound on the size of the compressed file.
 size_t MaxWOFF2CompressedSize(const uint8_t* data, size_t length);
 size_t MaxWOFF2CompressedSize(const uint8_t *data, size_t length,
@@ -38,6 +119,22 @@ bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
                        uint8_t *result, size_t *result_length,
                        const WOFF2Params& params);
 
+// Compresses the font into out, which need not be sized in advance: the
+// compressed data is written there as Brotli produces it, without an
+// intermediate buffer. Returns true on successful compression.
+bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
+                       WOFF2Out* out);
+bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
+                       WOFF2Out* out, const WOFF2Params& params);
+
+// Builds a dictionary of at most max_size bytes out of what the fonts, which
+// are the contents of TTF, OTF or TTC files, have in common, for compressing
+// them and fonts like them with the given Brotli settings. Returns false if a
+// font can't be read, or there is nothing to put in the dictionary.
+bool BuildWOFF2Dictionary(const std::vector<std::string>& fonts,
+                          size_t max_size, int brotli_quality,
+                          int brotli_window, WOFF2Dictionary* dictionary);
+
 } // namespace woff2
 
 #endif  // WOFF2_WOFF2_ENC_H_
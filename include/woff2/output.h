@@ -4,15 +4,19 @@
    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
 */
 
-/* Output buffer for WOFF2 decompression. */
+/* Output buffers for WOFF2 compression and decompression. */
 
 #ifndef WOFF2_WOFF2_OUT_H_
 #define WOFF2_WOFF2_OUT_H_
 
+#include <stdint.h>
+
 #include <algorithm>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace woff2 {
 
@@ -20,7 +24,7 @@ namespace woff2 {
 const size_t kDefaultMaxSize = 30 * 1024 * 1024;
 
 /**
- * Output interface for the woff2 decoding.
+ * Output interface for the woff2 decoding and encoding.
  *
  * Writes to arbitrary offsets are supported to facilitate updating offset
  * table and checksums after tables are ready. Reading the current size is
@@ -41,6 +45,21 @@ class WOFF2Out {
   virtual bool Write(const void *buf, size_t offset, size_t n) = 0;
 
   virtual size_t Size() = 0;
+
+  // Virtuals added since 1.0.2 come after the ones above, so that the
+  // vtable starts as it did.
+
+  // Append n bytes of data from buf, like Write(), and add the OpenType
+  // checksum of those bytes to *checksum. Outputs that own their memory
+  // override this to compute the checksum while copying.
+  // Return true if all written, false otherwise.
+  virtual bool WriteWithChecksum(const void *buf, size_t n,
+                                 uint32_t *checksum);
+
+  // Tell the output that about size bytes are to be written to it in all, so
+  // that it can make room for them at once. Only a hint: the size may be
+  // wrong, and writes past it must work as before. Does nothing by default.
+  virtual void SizeHint(size_t /* size */) {}
 };
 
 /**
@@ -56,6 +75,8 @@ class WOFF2StringOut : public WOFF2Out {
   bool Write(const void *buf, size_t n) override;
   bool Write(const void *buf, size_t offset, size_t n) override;
   size_t Size() override { return offset_; }
+  // Reserves the memory, up to the max size.
+  void SizeHint(size_t size) override;
   size_t MaxSize() { return max_size_; }
   void SetMaxSize(size_t max_size);
  private:
@@ -74,6 +95,8 @@ class WOFF2MemoryOut : public WOFF2Out {
 
   bool Write(const void *buf, size_t n) override;
   bool Write(const void *buf, size_t offset, size_t n) override;
+  bool WriteWithChecksum(const void *buf, size_t n,
+                         uint32_t *checksum) override;
   size_t Size() override { return offset_; }
  private:
   uint8_t* buf_;
@@ -81,6 +104,85 @@ class WOFF2MemoryOut : public WOFF2Out {
   size_t offset_;
 };
 
+/**
+ * Output written straight into a memory mapped file, avoiding copies of the
+ * decoded font. The file is created at the given size, which may be an
+ * estimate (e.g. from ComputeWOFF2FinalSize): it grows as needed up to
+ * kDefaultMaxSize and is cut to Size() bytes when closed. Its disk space is
+ * allocated as it grows, so that a full disk fails a write. On Windows, which
+ * has no mmap, the data is kept in memory and written out by Close().
+ *
+ * The data goes to a new file next to filename, which only replaces filename
+ * when closed. An output that is destroyed without being closed removes it,
+ * and leaves filename as it was.
+ */
+class WOFF2MmapFileOut : public WOFF2Out {
+ public:
+  // Create the file that is to become filename and map size bytes of it.
+  WOFF2MmapFileOut(const std::string& filename, size_t size);
+  ~WOFF2MmapFileOut() override;
+
+  WOFF2MmapFileOut(const WOFF2MmapFileOut&) = delete;
+  WOFF2MmapFileOut& operator=(const WOFF2MmapFileOut&) = delete;
+
+  // Whether the file could be created; if not, all writes fail.
+  bool IsOpen() const { return fd_ >= 0; }
+
+  bool Write(const void *buf, size_t n) override;
+  bool Write(const void *buf, size_t offset, size_t n) override;
+  bool WriteWithChecksum(const void *buf, size_t n,
+                         uint32_t *checksum) override;
+  size_t Size() override { return offset_; }
+  // Grows the file to size bytes at once, up to the max size.
+  void SizeHint(size_t size) override;
+  size_t MaxSize() { return max_size_; }
+  void SetMaxSize(size_t max_size);
+
+  // Unmap the file, cut it to Size() bytes and rename it to filename. Return
+  // true if the file was written successfully; if not, it is removed.
+  bool Close();
+ private:
+  bool Map(size_t size);
+  bool Unmap();
+  bool Reserve(size_t offset, size_t n);
+
+  std::string filename_;
+  std::string temp_filename_;
+  int fd_;
+  uint8_t* buf_;
+  size_t buf_size_;
+  size_t max_size_;
+  size_t offset_;
+};
+
+/**
+ * Output that passes the data on to a callback in the order it is written,
+ * e.g. to send a font over the network while it is being decoded. Small
+ * writes are held back until there are chunk_size bytes. Data that has been
+ * passed on can't be changed, so writes before the end fail: decode to it
+ * with WOFF2DecodeParams::sequential_output set.
+ */
+class WOFF2CallbackOut : public WOFF2Out {
+ public:
+  // Receives the next n bytes of the output. Returns false to fail the write.
+  typedef std::function<bool(const uint8_t* data, size_t n)> Callback;
+
+  explicit WOFF2CallbackOut(Callback callback, size_t chunk_size = 65536);
+
+  bool Write(const void *buf, size_t n) override;
+  bool Write(const void *buf, size_t offset, size_t n) override;
+  size_t Size() override { return offset_; }
+
+  // Passes on the data held back, which must be done once the conversion is
+  // over. Returns false if the callback does.
+  bool Flush();
+ private:
+  Callback callback_;
+  size_t chunk_size_;
+  std::vector<uint8_t> chunk_;
+  size_t offset_;
+};
+
 } // namespace woff2
 
 #endif  // WOFF2_WOFF2_OUT_H_
@@ -0,0 +1,126 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Optional reporting of where an encode or decode spends its time. */
+
+#ifndef WOFF2_WOFF2_STATS_H_
+#define WOFF2_WOFF2_STATS_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+namespace woff2 {
+
+// Parts of a conversion that time is reported for. Times are exclusive: when
+// one phase runs inside another, e.g. Brotli streaming the data of a table
+// that is being copied, the inner one is not counted again by the outer one.
+enum class WOFF2Phase {
+  // Decode: reading the WOFF2 header and directory, and writing the sfnt
+  // headers. Encode: parsing the input font.
+  kHeader,
+  // Brotli decompression, or compression.
+  kBrotli,
+  // Decode: rebuilding 'glyf' and 'loca'.
+  kGlyf,
+  // Decode: rebuilding 'hmtx'.
+  kHmtx,
+  // Decode: tables that are passed through untransformed.
+  kTables,
+  // Decode: table entries and checkSumAdjustment. The table data itself is
+  // checksummed as it is written, under the phase of its table.
+  kChecksum,
+  // Decode: inside WOFF2Out. Encode: laying out the WOFF2 file.
+  kOutput,
+  // Encode: normalizing the fonts, including their checksums, and
+  // transforming 'glyf' and 'loca' as they are normalized.
+  kNormalize,
+};
+
+// Why a conversion failed.
+enum class WOFF2Failure {
+  // Malformed WOFF2 header, table directory or collection directory.
+  kInvalidHeader,
+  // Sizes in the header that can't be right.
+  kImplausibleSize,
+  // Corrupt compressed data, or the wrong amount of it; or compression failed.
+  kBrotli,
+  kInvalidGlyf,
+  kInvalidHmtx,
+  // Any other table that could not be rebuilt.
+  kInvalidTable,
+  // The WOFF2Out refused a write, or the encode result buffer is too small.
+  kOutput,
+  // Encode: the input font could not be parsed, or is inconsistent.
+  kInvalidFont,
+  // Encode: the input font could not be normalized.
+  kNormalize,
+  // Decode: the file needs a shared dictionary that was not given, or a
+  // different one was. Encode: the dictionary was made by a different Brotli.
+  kDictionary,
+  // Decode: more memory was needed than WOFF2DecodeParams::memory_limit.
+  kMemoryLimit,
+};
+
+// Working buffers whose growth is reported.
+enum class WOFF2Buffer {
+  // Decode: a single glyph, kDefaultGlyphBuf bytes to start with.
+  kGlyph,
+  // Decode: the points of a glyph.
+  kPoints,
+  // Decode: a table that is rebuilt as a whole.
+  kTable,
+  // Decode: all of the data stream of a collection.
+  kStream,
+  // Encode: the tables collected into one stream.
+  kTransform,
+};
+
+/**
+ * Receives statistics about a conversion it is passed to. Nothing is measured
+ * unless a WOFF2Stats is installed.
+ *
+ * All calls are made on the thread that called the conversion, just before it
+ * returns. With several threads, phase times are summed over all of them.
+ */
+class WOFF2Stats {
+ public:
+  virtual ~WOFF2Stats(void) {}
+
+  // Total time spent in phase, for each phase that was entered.
+  virtual void OnPhase(WOFF2Phase /* phase */, double /* seconds */) {}
+
+  // For each table in the WOFF2 data stream: its length there, which is that
+  // of the transformed data for transformed tables, and its length in the
+  // font. Only called if the conversion succeeded.
+  virtual void OnTable(uint32_t /* tag */, size_t /* stream_length */,
+                       size_t /* font_length */) {}
+
+  // Number of glyphs of each font. Only called if the conversion succeeded,
+  // and by a decode only for fonts whose 'glyf' is transformed.
+  virtual void OnGlyphs(size_t /* font_index */,
+                        uint32_t /* num_glyphs */) {}
+
+  // A buffer had to grow to size bytes during the conversion; memory kept
+  // from earlier conversions in a context is not reported again.
+  virtual void OnBufferGrowth(WOFF2Buffer /* buffer */,
+                              size_t /* size */) {}
+
+  // The conversion failed. tag is the table that failed, or 0.
+  virtual void OnFailure(WOFF2Failure /* reason */,
+                         uint32_t /* tag */) {}
+
+  // The decode went through a DecodeCache, which had the font if hit is set,
+  // and dropped evictions other fonts to make room for it if not.
+  virtual void OnCacheLookup(bool /* hit */, size_t /* evictions */) {}
+
+  // Decode: the most memory the decode took at any one time, counted as
+  // for WOFF2DecodeParams::memory_limit, whether or not there is a limit.
+  virtual void OnPeakMemory(size_t /* bytes */) {}
+};
+
+} // namespace woff2
+
+#endif  // WOFF2_WOFF2_STATS_H_
@@ -0,0 +1,274 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Helpers for commandline tools that convert many files in one run. */
+
+#ifndef WOFF2_BATCH_H_
+#define WOFF2_BATCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <woff2/dictionary.h>
+#include <woff2/stats.h>
+#include "./file.h"
+#include "./parallel.h"
+
+namespace woff2 {
+
+// Inputs and flags common to the batch tools.
+struct BatchOptions {
+  std::vector<std::string> inputs;
+  // Where outputs go; next to their input if empty.
+  std::string out_dir;
+  // Number of files converted at once.
+  int jobs = 1;
+  // The extension of the outputs, which are named after their inputs; NULL
+  // if the tool writes none. No two inputs may have the same output, and no
+  // output may be an input.
+  const char* extension = NULL;
+};
+
+inline const char* FailureName(WOFF2Failure reason) {
+  switch (reason) {
+    case WOFF2Failure::kInvalidHeader: return "invalid header";
+    case WOFF2Failure::kImplausibleSize: return "implausible size";
+    case WOFF2Failure::kBrotli: return "brotli error";
+    case WOFF2Failure::kInvalidGlyf: return "invalid glyf";
+    case WOFF2Failure::kInvalidHmtx: return "invalid hmtx";
+    case WOFF2Failure::kInvalidTable: return "invalid table";
+    case WOFF2Failure::kOutput: return "output error";
+    case WOFF2Failure::kInvalidFont: return "invalid font";
+    case WOFF2Failure::kNormalize: return "normalization failed";
+    case WOFF2Failure::kDictionary: return "wrong or missing dictionary";
+    case WOFF2Failure::kMemoryLimit: return "memory limit exceeded";
+  }
+  return "failed";
+}
+
+// The reason a conversion failed, with the table that failed if there is
+// one, as told to the user.
+inline std::string FailureMessage(WOFF2Failure reason, uint32_t tag) {
+  std::string message = FailureName(reason);
+  if (tag != 0) {
+    char printable[] = {
+      ' ', '\'',
+      static_cast<char>((tag >> 24) & 0xFF),
+      static_cast<char>((tag >> 16) & 0xFF),
+      static_cast<char>((tag >> 8) & 0xFF),
+      static_cast<char>(tag & 0xFF),
+      '\'', '\0'
+    };
+    message += printable;
+  }
+  return message;
+}
+
+// Keeps the reason a conversion failed, to be told to the user.
+class FailureReason : public WOFF2Stats {
+ public:
+  void Reset() { message_ = "failed"; }
+  const std::string& message() const { return message_; }
+
+  void OnFailure(WOFF2Failure reason, uint32_t tag) override {
+    message_ = FailureMessage(reason, tag);
+  }
+
+ private:
+  std::string message_ = "failed";
+};
+
+// Adds the names listed in filename, one per line, to *inputs. "-" reads
+// them from stdin.
+inline bool ReadInputList(const std::string& filename,
+                          std::vector<std::string>* inputs) {
+  std::ifstream file;
+  if (filename != "-") {
+    file.open(filename.c_str());
+    if (!file) {
+      fprintf(stderr, "Could not read list %s.\n", filename.c_str());
+      return false;
+    }
+  }
+  std::istream& in = filename == "-" ? std::cin : file;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty()) {
+      inputs->push_back(line);
+    }
+  }
+  return true;
+}
+
+// Reads the dictionary given by --dictionary=FILE into *dictionary.
+inline bool LoadDictionary(const std::string& filename,
+                           WOFF2Dictionary* dictionary) {
+  MappedFile file(filename);
+  if (!file.ok() ||
+      !ReadWOFF2Dictionary(file.data(), file.size(), dictionary)) {
+    fprintf(stderr, "Could not read dictionary %s.\n", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+inline void PrintBatchUsage(const char* tool, const char* extra_flags) {
+  fprintf(stderr,
+      "Usage: %s [options] <file>...\n"
+      "  --list=FILE     also convert the files named in FILE, one per line;\n"
+      "                  - reads the names from stdin\n"
+      "  --out-dir=DIR   write outputs to DIR instead of next to the inputs\n"
+      "  --jobs=N        convert N files at a time (default 1)\n"
+      "%s", tool, extra_flags);
+}
+
+// The name of the output for input: input with its extension replaced by
+// extension, in options.out_dir if set.
+inline std::string OutputFilename(const BatchOptions& options,
+                                  const std::string& input,
+                                  const char* extension) {
+  std::string base = input;
+  size_t slash = base.find_last_of('/');
+  size_t dot = base.find_last_of('.');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+    base.resize(dot);
+  }
+  if (options.out_dir.empty()) {
+    return base + extension;
+  }
+  if (slash != std::string::npos) {
+    base = base.substr(slash + 1);
+  }
+  std::string dir = options.out_dir;
+  if (dir.back() != '/') {
+    dir += '/';
+  }
+  return dir + base + extension;
+}
+
+// Parses the common flags and the inputs. Any other flag is offered to
+// parse_flag, which returns false if it doesn't know it either. Returns false
+// if the command line is unusable, which includes an --out-dir that isn't a
+// directory, inputs that would be written to the same output and outputs
+// that would replace an input.
+inline bool ParseBatchArgs(int argc, char** argv,
+                           const std::function<bool(const char*)>& parse_flag,
+                           BatchOptions* options) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--list=", 7) == 0) {
+      if (!ReadInputList(arg + 7, &options->inputs)) {
+        return false;
+      }
+    } else if (strncmp(arg, "--out-dir=", 10) == 0) {
+      options->out_dir = arg + 10;
+    } else if (strncmp(arg, "--jobs=", 7) == 0) {
+      options->jobs = atoi(arg + 7);
+      if (options->jobs < 1) {
+        fprintf(stderr, "Invalid value for --jobs: %s\n", arg + 7);
+        return false;
+      }
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      if (!parse_flag(arg)) {
+        fprintf(stderr, "Unknown option %s\n", arg);
+        return false;
+      }
+    } else {
+      options->inputs.push_back(arg);
+    }
+  }
+  if (options->inputs.empty()) {
+    fprintf(stderr, "No input files.\n");
+    return false;
+  }
+  if (!options->out_dir.empty()) {
+    struct stat info;
+    if (stat(options->out_dir.c_str(), &info) != 0 ||
+        (info.st_mode & S_IFMT) != S_IFDIR) {
+      fprintf(stderr, "%s is not a directory.\n", options->out_dir.c_str());
+      return false;
+    }
+  }
+  if (options->extension == NULL) {
+    return true;
+  }
+  // Files have ids where they can have several names, through links or
+  // relative paths; elsewhere their names tell them apart.
+  std::set<FileId> input_ids;
+  std::set<std::string> input_names;
+  for (const std::string& input : options->inputs) {
+    FileId id;
+    if (GetFileId(input, &id)) {
+      input_ids.insert(id);
+    }
+    input_names.insert(input);
+  }
+  std::map<std::string, const std::string*> inputs_by_output;
+  for (const std::string& input : options->inputs) {
+    std::string output = OutputFilename(*options, input, options->extension);
+    auto inserted = inputs_by_output.emplace(output, &input);
+    if (!inserted.second) {
+      fprintf(stderr, "%s and %s would be written to the same output.\n",
+              inserted.first->second->c_str(), input.c_str());
+      return false;
+    }
+    FileId id;
+    if (GetFileId(output, &id) ? input_ids.count(id) > 0
+                               : input_names.count(output) > 0) {
+      fprintf(stderr, "The output of %s, %s, would replace an input.\n",
+              input.c_str(), output.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+// Converts every input to its output on options.jobs threads, printing the
+// outcome of each. convert(worker, input, output, error) does one file, where worker
+// identifies its thread; on failure it sets *error. Returns the number of
+// files that failed.
+inline size_t RunBatch(
+    const BatchOptions& options,
+    const std::function<bool(size_t, const std::string&, const std::string&,
+                             std::string*)>& convert) {
+  std::mutex print_mutex;
+  std::atomic<size_t> failures(0);
+  ParallelForWorkers(options.inputs.size(), options.jobs,
+                     [&](size_t worker, size_t i) {
+    const std::string& input = options.inputs[i];
+    std::string output = OutputFilename(options, input, options.extension);
+    std::string error;
+    bool ok = convert(worker, input, output, &error);
+    std::lock_guard<std::mutex> lock(print_mutex);
+    if (ok) {
+      fprintf(stdout, "Processing %s => %s\n", input.c_str(), output.c_str());
+    } else {
+      fprintf(stderr, "%s: %s\n", input.c_str(), error.c_str());
+      ++failures;
+    }
+    return true;
+  });
+  return failures;
+}
+
+} // namespace woff2
+
+#endif  // WOFF2_BATCH_H_
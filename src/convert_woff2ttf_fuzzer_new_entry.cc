@@ -3,7 +3,7 @@
 
 extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t data_size) {
   // Decode using newer entry pattern.
-  // Same pattern as woff2_decompress.
+  // Same pattern as woff2_decompress, decoding into memory instead of a file.
   std::string output(std::min(woff2::ComputeWOFF2FinalSize(data, data_size),
                               woff2::kDefaultMaxSize), 0);
   woff2::WOFF2StringOut out(&output);
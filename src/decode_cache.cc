@@ -0,0 +1,241 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Cache of decoded fonts. */
+
+#include <woff2/decode_cache.h>
+
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./decode_stream.h"
+
+namespace woff2 {
+
+namespace {
+
+// Bytes charged for an entry on top of its data, for the bookkeeping.
+const size_t kEntryOverhead = 128;
+
+// A fast 64 bit hash, eight bytes at a time. Entries are compared in full on
+// a hit, so it only has to spread the files well.
+uint64_t HashBytes(const uint8_t* data, size_t length) {
+  const uint64_t kMul = 0x9ddfea08eb382d69ULL;
+  uint64_t hash = length * kMul;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * kMul;
+    hash ^= hash >> 47;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, length - i);
+  hash = (hash ^ tail) * kMul;
+  return hash ^ (hash >> 47);
+}
+
+struct Entry {
+  uint64_t hash;
+  // The WOFF2 file.
+  std::string input;
+  // The decoded font for DecodeCache::Mode::kFont, or else the font data
+  // stream.
+  std::string font;
+  std::vector<uint8_t> stream;
+
+  size_t Bytes() const {
+    return input.size() + font.size() + stream.size() + kEntryOverhead;
+  }
+};
+
+// Passes writes on to another WOFF2Out and keeps a copy of what it wrote.
+class CopyingOut : public WOFF2Out {
+ public:
+  CopyingOut(WOFF2Out* out, std::string* copy) : out_(out), copy_(copy) {
+    copy_.SetMaxSize(std::numeric_limits<size_t>::max());
+  }
+
+  bool Write(const void *buf, size_t n) override {
+    size_t offset = out_->Size();
+    return out_->Write(buf, n) && copy_.Write(buf, offset, n);
+  }
+
+  bool Write(const void *buf, size_t offset, size_t n) override {
+    return out_->Write(buf, offset, n) && copy_.Write(buf, offset, n);
+  }
+
+  bool WriteWithChecksum(const void *buf, size_t n,
+                         uint32_t *checksum) override {
+    size_t offset = out_->Size();
+    return out_->WriteWithChecksum(buf, n, checksum) &&
+           copy_.Write(buf, offset, n);
+  }
+
+  size_t Size() override { return out_->Size(); }
+
+  void SizeHint(size_t size) override {
+    out_->SizeHint(size);
+    copy_.SizeHint(size);
+  }
+
+ private:
+  WOFF2Out* out_;
+  WOFF2StringOut copy_;
+};
+
+}  // namespace
+
+struct DecodeCache::State {
+  State(size_t max_bytes, Mode mode)
+      : max_bytes(max_bytes), mode(mode), bytes(0), hits(0), misses(0),
+        evictions(0) {}
+
+  typedef std::list<std::shared_ptr<const Entry>> EntryList;
+
+  // Returns the entry for hash, if any, and makes it the most recently used.
+  std::shared_ptr<const Entry> Find(uint64_t hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = by_hash.find(hash);
+    if (it == by_hash.end()) {
+      return NULL;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    return *it->second;
+  }
+
+  // Adds entry, replacing any with the same hash, and drops the least
+  // recently used ones until the cache fits its budget again. Returns how
+  // many were dropped.
+  size_t Insert(std::shared_ptr<const Entry> entry) {
+    if (entry->Bytes() > max_bytes) {
+      return 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = by_hash.find(entry->hash);
+    if (it != by_hash.end()) {
+      bytes -= (*it->second)->Bytes();
+      entries.erase(it->second);
+      by_hash.erase(it);
+    }
+    bytes += entry->Bytes();
+    entries.push_front(entry);
+    by_hash[entry->hash] = entries.begin();
+
+    size_t dropped = 0;
+    while (bytes > max_bytes) {
+      const Entry& oldest = *entries.back();
+      bytes -= oldest.Bytes();
+      by_hash.erase(oldest.hash);
+      entries.pop_back();
+      ++dropped;
+    }
+    evictions += dropped;
+    return dropped;
+  }
+
+  const size_t max_bytes;
+  const Mode mode;
+
+  mutable std::mutex mutex;
+  // Most recently used first.
+  EntryList entries;
+  std::unordered_map<uint64_t, EntryList::iterator> by_hash;
+  size_t bytes;
+
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+};
+
+DecodeCache::DecodeCache(size_t max_bytes, Mode mode)
+    : state_(new State(max_bytes, mode)) {}
+
+DecodeCache::~DecodeCache() {}
+
+bool DecodeCache::ConvertWOFF2ToTTF(const uint8_t *data, size_t length,
+                                    WOFF2Out* out) {
+  WOFF2DecodeParams params;
+  return ConvertWOFF2ToTTF(data, length, out, params);
+}
+
+bool DecodeCache::ConvertWOFF2ToTTF(const uint8_t *data, size_t length,
+                                    WOFF2Out* out,
+                                    const WOFF2DecodeParams& params) {
+  State& state = *state_;
+  const uint64_t hash = HashBytes(data, length);
+  // Entries stay valid while we hold them, even if they are evicted.
+  std::shared_ptr<const Entry> entry = state.Find(hash);
+  if (entry != NULL && (entry->input.size() != length ||
+                        memcmp(entry->input.data(), data, length) != 0)) {
+    entry.reset();
+  }
+
+  bool ok;
+  size_t evictions = 0;
+  if (entry != NULL) {
+    ++state.hits;
+    if (state.mode == Mode::kFont) {
+      ok = out->Write(entry->font.data(), entry->font.size());
+    } else {
+      ok = ConvertWOFF2ToTTFFromStream(data, length, entry->stream, out,
+                                       params);
+    }
+  } else {
+    ++state.misses;
+    std::shared_ptr<Entry> fresh = std::make_shared<Entry>();
+    fresh->hash = hash;
+    fresh->input.assign(reinterpret_cast<const char*>(data), length);
+    if (state.mode == Mode::kFont) {
+      CopyingOut copying_out(out, &fresh->font);
+      ok = woff2::ConvertWOFF2ToTTF(data, length, &copying_out, params);
+    } else if (DecompressWOFF2Stream(data, length, params.dictionary,
+                                     &fresh->stream)) {
+      ok = ConvertWOFF2ToTTFFromStream(data, length, fresh->stream, out,
+                                       params);
+    } else {
+      // Let the decoder find out, and report, what is wrong.
+      ok = woff2::ConvertWOFF2ToTTF(data, length, out, params);
+      fresh.reset();
+    }
+    if (ok && fresh != NULL) {
+      evictions = state.Insert(std::move(fresh));
+    }
+  }
+
+  if (params.stats != NULL) {
+    params.stats->OnCacheLookup(entry != NULL, evictions);
+  }
+  return ok;
+}
+
+DecodeCache::Counters DecodeCache::GetCounters() const {
+  Counters counters;
+  counters.hits = state_->hits;
+  counters.misses = state_->misses;
+  counters.evictions = state_->evictions;
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  counters.entries = state_->entries.size();
+  counters.bytes = state_->bytes;
+  return counters;
+}
+
+void DecodeCache::Clear() {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  state_->entries.clear();
+  state_->by_hash.clear();
+  state_->bytes = 0;
+}
+
+} // namespace woff2
@@ -0,0 +1,38 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Decoding from a font data stream that has already been decompressed. */
+
+#ifndef WOFF2_DECODE_STREAM_H_
+#define WOFF2_DECODE_STREAM_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <span>
+#include <vector>
+
+#include <woff2/decode.h>
+
+namespace woff2 {
+
+// Decompresses the font data stream of the WOFF2 file in data into *stream,
+// without rebuilding any table. dictionary is as in WOFF2DecodeParams.
+bool DecompressWOFF2Stream(const uint8_t* data, size_t length,
+                           const WOFF2Dictionary* dictionary,
+                           std::vector<uint8_t>* stream);
+
+// Like ConvertWOFF2ToTTF, but takes the font data stream from stream, as set
+// by DecompressWOFF2Stream, unless it is empty. stream is only read from, so
+// any number of decodes may share it.
+bool ConvertWOFF2ToTTFFromStream(const uint8_t* data, size_t length,
+                                 std::span<const uint8_t> stream,
+                                 WOFF2Out* out,
+                                 const WOFF2DecodeParams& params);
+
+} // namespace woff2
+
+#endif  // WOFF2_DECODE_STREAM_H_
@@ -0,0 +1,86 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Reading and writing shared Brotli dictionaries. */
+
+#include <woff2/dictionary.h>
+
+#include <brotli/encode.h>
+
+#include "./buffer.h"
+#include "./port.h"
+#include "./store_bytes.h"
+
+namespace woff2 {
+
+namespace {
+
+// "w2DC"
+const uint32_t kDictionarySignature = 0x77324443;
+const uint8_t kDictionaryVersion = 1;
+const size_t kDictionaryHeaderSize = 16;
+
+}  // namespace
+
+uint16_t ComputeWOFF2DictionaryId(const std::string& primer) {
+  // 32 bit FNV-1a, folded in two.
+  uint32_t hash = 2166136261u;
+  for (char c : primer) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+  }
+  uint16_t id = static_cast<uint16_t>((hash >> 16) ^ hash);
+  return id != 0 ? id : 1;
+}
+
+bool ReadWOFF2Dictionary(const uint8_t* data, size_t length,
+                         WOFF2Dictionary* dictionary) {
+  Buffer file(data, length);
+  uint32_t signature;
+  uint8_t version, quality, window, reserved;
+  uint32_t data_length, primer_length;
+  if (PREDICT_FALSE(!file.ReadU32(&signature) ||
+                    signature != kDictionarySignature ||
+                    !file.ReadU8(&version) || version != kDictionaryVersion ||
+                    !file.ReadU8(&quality) || !file.ReadU8(&window) ||
+                    !file.ReadU8(&reserved) ||
+                    !file.ReadU32(&data_length) ||
+                    !file.ReadU32(&primer_length))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (PREDICT_FALSE(quality > BROTLI_MAX_QUALITY ||
+                    window < BROTLI_MIN_WINDOW_BITS ||
+                    window > BROTLI_MAX_WINDOW_BITS ||
+                    data_length == 0 || primer_length == 0 ||
+                    length - kDictionaryHeaderSize !=
+                        static_cast<uint64_t>(data_length) + primer_length)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  const char* contents = reinterpret_cast<const char*>(data) +
+      kDictionaryHeaderSize;
+  dictionary->data.assign(contents, data_length);
+  dictionary->primer.assign(contents + data_length, primer_length);
+  dictionary->brotli_quality = quality;
+  dictionary->brotli_window = window;
+  dictionary->id = ComputeWOFF2DictionaryId(dictionary->primer);
+  return true;
+}
+
+bool WriteWOFF2Dictionary(const WOFF2Dictionary& dictionary, WOFF2Out* out) {
+  uint8_t header[kDictionaryHeaderSize];
+  size_t offset = 0;
+  StoreU32(kDictionarySignature, &offset, header);
+  header[offset++] = kDictionaryVersion;
+  header[offset++] = static_cast<uint8_t>(dictionary.brotli_quality);
+  header[offset++] = static_cast<uint8_t>(dictionary.brotli_window);
+  header[offset++] = 0;
+  StoreU32(dictionary.data.size(), &offset, header);
+  StoreU32(dictionary.primer.size(), &offset, header);
+  return out->Write(header, sizeof(header)) &&
+         out->Write(dictionary.data.data(), dictionary.data.size()) &&
+         out->Write(dictionary.primer.data(), dictionary.primer.size());
+}
+
+} // namespace woff2
@@ -0,0 +1,228 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Building shared Brotli dictionaries out of what fonts have in common. */
+
+#include <woff2/encode.h>
+
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "./buffer.h"
+#include "./dictionary_encoder.h"
+#include "./font.h"
+#include "./normalize.h"
+#include "./transform.h"
+
+namespace woff2 {
+
+namespace {
+
+// Fonts are compared by the strings of this many bytes they contain.
+const size_t kKeyLength = 8;
+// Shorter strings are not worth a reference from the font data stream.
+const size_t kMinSegmentLength = 16;
+
+uint64_t KeyAt(const uint8_t* data) {
+  uint64_t key;
+  std::memcpy(&key, data, sizeof(key));
+  return key;
+}
+
+// A run of bytes of a font data stream, all made of keys that enough of the
+// fonts have in common.
+struct Segment {
+  size_t font;
+  size_t begin;
+  size_t length;
+  // Over all keys, the number of other fonts that have it.
+  uint64_t score;
+};
+
+// Sets *stream to the font data stream the encoder would compress for font.
+bool FontDataStream(const std::string& font, std::vector<uint8_t>* stream) {
+  FontCollection font_collection;
+  std::vector<GlyfTransformBuffers> transform_buffers;
+  if (!ReadFontCollection(reinterpret_cast<const uint8_t*>(font.data()),
+                          font.size(), &font_collection) ||
+      !NormalizeAndTransformFontCollection(&font_collection, 1,
+                                           &transform_buffers)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  for (const auto& font : font_collection.fonts) {
+    for (const auto tag : font.OutputOrderedTags()) {
+      const Font::Table& original = font.tables.at(tag);
+      if (original.IsReused()) continue;
+      if (tag & 0x80808080) continue;
+      const Font::Table* table = font.FindTable(tag ^ 0x80808080);
+      if (table == NULL) table = &original;
+      stream->insert(stream->end(), table->data, table->data + table->length);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+BrotliEncoderPtr CreatePrimedEncoder(const WOFF2Dictionary& dictionary,
+                                     std::string* primer) {
+  BrotliEncoderPtr state(BrotliEncoderCreateInstance(NULL, NULL, NULL),
+                         &BrotliEncoderDestroyInstance);
+  if (!state) {
+    return state;
+  }
+  // No size hint: the primer must not depend on what comes after it.
+  BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_QUALITY,
+                            dictionary.brotli_quality);
+  BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_LGWIN,
+                            dictionary.brotli_window);
+  BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_MODE, BROTLI_MODE_FONT);
+
+  // Flushing leaves the primer ending on a byte boundary, from where the
+  // next data can be decoded on its own.
+  primer->clear();
+  size_t available_in = dictionary.data.size();
+  const uint8_t* next_in =
+      reinterpret_cast<const uint8_t*>(dictionary.data.data());
+  do {
+    size_t available_out = 0;
+    if (!BrotliEncoderCompressStream(state.get(), BROTLI_OPERATION_FLUSH,
+                                     &available_in, &next_in,
+                                     &available_out, NULL, NULL)) {
+      state.reset();
+      return state;
+    }
+    size_t chunk_len = 0;
+    const uint8_t* chunk = BrotliEncoderTakeOutput(state.get(), &chunk_len);
+    primer->append(reinterpret_cast<const char*>(chunk), chunk_len);
+  } while (available_in > 0 || BrotliEncoderHasMoreOutput(state.get()));
+  return state;
+}
+
+bool BuildWOFF2Dictionary(const std::vector<std::string>& fonts,
+                          size_t max_size, int brotli_quality,
+                          int brotli_window, WOFF2Dictionary* dictionary) {
+  if (max_size == 0 || brotli_quality < BROTLI_MIN_QUALITY ||
+      brotli_quality > BROTLI_MAX_QUALITY ||
+      brotli_window < BROTLI_MIN_WINDOW_BITS ||
+      brotli_window > BROTLI_MAX_WINDOW_BITS) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  std::vector<std::vector<uint8_t>> streams(fonts.size());
+  for (size_t i = 0; i < fonts.size(); ++i) {
+    if (!FontDataStream(fonts[i], &streams[i])) {
+#ifdef FONT_COMPRESSION_BIN
+      fprintf(stderr, "Font %zu could not be transformed.\n", i);
+#endif
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+
+  // The number of fonts each key is found in.
+  struct KeyCount {
+    uint32_t fonts;
+    uint32_t last_font;
+  };
+  std::unordered_map<uint64_t, KeyCount> counts;
+  for (size_t i = 0; i < streams.size(); ++i) {
+    const std::vector<uint8_t>& stream = streams[i];
+    for (size_t pos = 0; pos + kKeyLength <= stream.size(); ++pos) {
+      KeyCount& count = counts[KeyAt(&stream[pos])];
+      if (count.last_font != i + 1) {
+        count.last_font = i + 1;
+        ++count.fonts;
+      }
+    }
+  }
+
+  // What at least half of the fonts have in common, as it is in each font.
+  const uint32_t min_fonts =
+      std::max<uint32_t>(2, (streams.size() + 1) / 2);
+  std::vector<Segment> segments;
+  for (size_t i = 0; i < streams.size(); ++i) {
+    const std::vector<uint8_t>& stream = streams[i];
+    size_t pos = 0;
+    while (pos + kKeyLength <= stream.size()) {
+      Segment segment = {i, pos, 0, 0};
+      for (; pos + kKeyLength <= stream.size(); ++pos) {
+        uint32_t n = counts.find(KeyAt(&stream[pos]))->second.fonts;
+        if (n < min_fonts) {
+          break;
+        }
+        segment.score += n - 1;
+      }
+      if (pos > segment.begin) {
+        segment.length = pos - segment.begin + kKeyLength - 1;
+        if (segment.length >= kMinSegmentLength) {
+          segments.push_back(segment);
+        }
+      }
+      // Skip the key that ended the run.
+      ++pos;
+    }
+  }
+  counts.clear();
+
+  std::sort(segments.begin(), segments.end(),
+            [](const Segment& a, const Segment& b) {
+    return std::tie(b.score, a.font, a.begin) <
+           std::tie(a.score, b.font, b.begin);
+  });
+
+  // Take the best segments, leaving out those that mostly repeat one that was
+  // already taken, as most segments are found in several fonts.
+  std::unordered_set<uint64_t> taken_keys;
+  std::vector<std::pair<const Segment*, size_t>> taken;
+  size_t size = 0;
+  for (const Segment& segment : segments) {
+    if (size >= max_size) {
+      break;
+    }
+    const uint8_t* data = &streams[segment.font][segment.begin];
+    const size_t num_keys = segment.length - kKeyLength + 1;
+    size_t new_keys = 0;
+    for (size_t k = 0; k < num_keys; ++k) {
+      new_keys += taken_keys.count(KeyAt(data + k)) == 0;
+    }
+    if (2 * new_keys < num_keys) {
+      continue;
+    }
+    for (size_t k = 0; k < num_keys; ++k) {
+      taken_keys.insert(KeyAt(data + k));
+    }
+    size_t length = std::min(segment.length, max_size - size);
+    taken.emplace_back(&segment, length);
+    size += length;
+  }
+  if (taken.empty()) {
+#ifdef FONT_COMPRESSION_BIN
+    fprintf(stderr, "The fonts have nothing in common.\n");
+#endif
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // The best segments go last, closest to the data that refers to them.
+  dictionary->data.clear();
+  dictionary->data.reserve(size);
+  for (auto it = taken.rbegin(); it != taken.rend(); ++it) {
+    const uint8_t* data = &streams[it->first->font][it->first->begin];
+    dictionary->data.append(reinterpret_cast<const char*>(data), it->second);
+  }
+  dictionary->brotli_quality = brotli_quality;
+  dictionary->brotli_window = brotli_window;
+  if (!CreatePrimedEncoder(*dictionary, &dictionary->primer)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  dictionary->id = ComputeWOFF2DictionaryId(dictionary->primer);
+  return true;
+}
+
+} // namespace woff2
@@ -0,0 +1,32 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Brotli encoders started on a shared dictionary. */
+
+#ifndef WOFF2_DICTIONARY_ENCODER_H_
+#define WOFF2_DICTIONARY_ENCODER_H_
+
+#include <memory>
+#include <string>
+
+#include <brotli/encode.h>
+#include <woff2/dictionary.h>
+
+namespace woff2 {
+
+typedef std::unique_ptr<BrotliEncoderState, void (*)(BrotliEncoderState*)>
+    BrotliEncoderPtr;
+
+// Creates a font mode encoder with the settings of dictionary and feeds it
+// the dictionary data, setting *primer to what it outputs for it. Anything
+// compressed with the encoder next can be decoded by a decoder that has been
+// given *primer first. Returns an empty pointer if Brotli fails.
+BrotliEncoderPtr CreatePrimedEncoder(const WOFF2Dictionary& dictionary,
+                                     std::string* primer);
+
+} // namespace woff2
+
+#endif  // WOFF2_DICTIONARY_ENCODER_H_
@@ -9,22 +9,128 @@
 #ifndef WOFF2_FILE_H_
 #define WOFF2_FILE_H_
 
+#include <inttypes.h>
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include <fstream>
 #include <iterator>
+#include <string>
+#include <utility>
 
 namespace woff2 {
 
 inline std::string GetFileContent(std::string filename) {
-  std::ifstream ifs(filename.c_str(), std::ios::binary);
-  return std::string(std::istreambuf_iterator<char>(ifs.rdbuf()),
-                     std::istreambuf_iterator<char>());
+  std::ifstream ifs(filename.c_str(), std::ios::binary | std::ios::ate);
+  std::streamoff size = ifs.tellg();
+  if (size <= 0) {
+    return std::string();
+  }
+  std::string content(size, 0);
+  ifs.seekg(0);
+  ifs.read(&content[0], size);
+  content.resize(ifs.gcount());
+  return content;
 }
 
 inline void SetFileContents(std::string filename, std::string::iterator start,
                             std::string::iterator end) {
   std::ofstream ofs(filename.c_str(), std::ios::binary);
-  std::copy(start, end, std::ostream_iterator<char>(ofs));
+  if (start != end) {
+    ofs.write(&*start, end - start);
+  }
 }
 
+// The device and inode of a file, which tell whether two names are of the
+// same file.
+typedef std::pair<uint64_t, uint64_t> FileId;
+
+// Sets *id to the id of filename. Returns false if there is no such file, or
+// if files have no ids here, as on Windows.
+inline bool GetFileId(const std::string& filename, FileId* id) {
+#if defined(_WIN32)
+  (void)filename;
+  (void)id;
+  return false;
+#else
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  *id = FileId(st.st_dev, st.st_ino);
+  return true;
+#endif
+}
+
+// Read-only view of the content of a file, mapped into memory rather than
+// copied. Without mmap, the file is read into memory instead.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& filename)
+      : data_(NULL), size_(0), ok_(false) {
+#if defined(_WIN32)
+    std::ifstream ifs(filename.c_str(), std::ios::binary);
+    if (!ifs) {
+      return;
+    }
+    content_.assign(std::istreambuf_iterator<char>(ifs),
+                    std::istreambuf_iterator<char>());
+    if (ifs.bad()) {
+      return;
+    }
+    data_ = reinterpret_cast<const uint8_t*>(content_.data());
+    size_ = content_.size();
+    ok_ = true;
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      if (st.st_size == 0) {
+        ok_ = true;
+      } else {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          data_ = static_cast<const uint8_t*>(data);
+          size_ = st.st_size;
+          ok_ = true;
+        }
+      }
+    }
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#if !defined(_WIN32)
+    if (data_ != NULL) {
+      munmap(const_cast<uint8_t*>(data_), size_);
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // Whether the file could be opened and mapped.
+  bool ok() const { return ok_; }
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  bool ok_;
+#if defined(_WIN32)
+  std::string content_;
+#endif
+};
+
 } // namespace woff2
 #endif  // WOFF2_FILE_H_
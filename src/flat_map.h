@@ -0,0 +1,177 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* A small sorted map for table bookkeeping, keyed by tags and offsets. */
+
+#ifndef WOFF2_FLAT_MAP_H_
+#define WOFF2_FLAT_MAP_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include <vector>
+
+namespace woff2 {
+
+// A map for the few dozen entries a font has, with the keys in one sorted
+// array so that a lookup is a binary search over contiguous memory. It has
+// the parts of the std::map interface this library uses, and iterates in the
+// order of the keys.
+//
+// As with std::map, a pointer to a value stays valid until the map is
+// cleared or destroyed, whatever is inserted or erased in the meantime: the
+// values are kept apart from the keys, and erasing an entry only removes it
+// from the keys.
+template <typename Key, typename T>
+class FlatMap {
+ public:
+  typedef std::pair<const Key, T> value_type;
+
+ private:
+  // The key of an entry and the position of its value in values_.
+  typedef std::pair<Key, size_t> IndexEntry;
+  typedef typename std::vector<IndexEntry>::const_iterator IndexIterator;
+
+  template <typename Values, typename Value>
+  class Iterator {
+   public:
+    Iterator() : values_(nullptr) {}
+    Iterator(Values* values, IndexIterator it) : values_(values), it_(it) {}
+    // A const_iterator can be made from an iterator.
+    template <typename OtherValues, typename OtherValue>
+    Iterator(const Iterator<OtherValues, OtherValue>& other)
+        : values_(other.values_), it_(other.it_) {}
+
+    Value& operator*() const { return (*values_)[it_->second]; }
+    Value* operator->() const { return &(*values_)[it_->second]; }
+    Iterator& operator++() {
+      ++it_;
+      return *this;
+    }
+    bool operator==(const Iterator& other) const { return it_ == other.it_; }
+    bool operator!=(const Iterator& other) const { return it_ != other.it_; }
+
+   private:
+    template <typename, typename> friend class Iterator;
+    friend class FlatMap;
+
+    Values* values_;
+    IndexIterator it_;
+  };
+
+ public:
+  typedef Iterator<std::deque<value_type>, value_type> iterator;
+  typedef Iterator<const std::deque<value_type>, const value_type>
+      const_iterator;
+
+  FlatMap() : revision_(0) {}
+  FlatMap(const FlatMap& other) : revision_(0) { *this = other; }
+  FlatMap(FlatMap&& other) = default;
+  FlatMap& operator=(FlatMap&& other) = default;
+
+  // Copies only the live entries. The copy has the revision of the original.
+  FlatMap& operator=(const FlatMap& other) {
+    if (this != &other) {
+      values_.clear();
+      index_.clear();
+      index_.reserve(other.index_.size());
+      for (const value_type& value : other) {
+        index_.emplace_back(value.first, values_.size());
+        values_.push_back(value);
+      }
+      revision_ = other.revision_;
+    }
+    return *this;
+  }
+
+  iterator begin() { return iterator(&values_, index_.begin()); }
+  iterator end() { return iterator(&values_, index_.end()); }
+  const_iterator begin() const {
+    return const_iterator(&values_, index_.begin());
+  }
+  const_iterator end() const { return const_iterator(&values_, index_.end()); }
+
+  size_t size() const { return index_.size(); }
+  bool empty() const { return index_.empty(); }
+
+  void reserve(size_t n) { index_.reserve(n); }
+
+  iterator find(const Key& key) {
+    IndexIterator it = LowerBound(key);
+    return iterator(&values_,
+                    it != index_.end() && it->first == key ? it : index_.end());
+  }
+  const_iterator find(const Key& key) const {
+    IndexIterator it = LowerBound(key);
+    return const_iterator(
+        &values_, it != index_.end() && it->first == key ? it : index_.end());
+  }
+
+  size_t count(const Key& key) const { return find(key) != end(); }
+
+  // Returns the value of key. Unlike std::map::at, it must be there.
+  T& at(const Key& key) { return find(key)->second; }
+  const T& at(const Key& key) const { return find(key)->second; }
+
+  // Returns the value of key, adding a value-initialized one if there is
+  // none.
+  T& operator[](const Key& key) {
+    IndexIterator it = LowerBound(key);
+    if (it != index_.end() && it->first == key) {
+      return values_[it->second].second;
+    }
+    index_.insert(index_.begin() + (it - index_.begin()),
+                  IndexEntry(key, values_.size()));
+    values_.emplace_back(key, T());
+    ++revision_;
+    return values_.back().second;
+  }
+
+  // Adds value unless its key is there already, as std::map::insert does.
+  std::pair<iterator, bool> insert(const value_type& value) {
+    IndexIterator it = LowerBound(value.first);
+    if (it != index_.end() && it->first == value.first) {
+      return std::make_pair(iterator(&values_, it), false);
+    }
+    it = index_.insert(index_.begin() + (it - index_.begin()),
+                       IndexEntry(value.first, values_.size()));
+    values_.push_back(value);
+    ++revision_;
+    return std::make_pair(iterator(&values_, it), true);
+  }
+
+  void erase(const_iterator it) {
+    index_.erase(index_.begin() + (it.it_ - index_.begin()));
+    ++revision_;
+  }
+
+  void clear() {
+    values_.clear();
+    index_.clear();
+    ++revision_;
+  }
+
+  // Changes whenever an entry is added or removed, for callers that keep
+  // something derived from the keys.
+  uint64_t revision() const { return revision_; }
+
+ private:
+  IndexIterator LowerBound(const Key& key) const {
+    return std::lower_bound(index_.begin(), index_.end(), key,
+        [](const IndexEntry& entry, const Key& k) { return entry.first < k; });
+  }
+
+  std::deque<value_type> values_;
+  std::vector<IndexEntry> index_;
+  uint64_t revision_;
+};
+
+} // namespace woff2
+
+#endif  // WOFF2_FLAT_MAP_H_
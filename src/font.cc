@@ -19,40 +19,41 @@
 namespace woff2 {
 
 Font::Table* Font::FindTable(uint32_t tag) {
-  std::map<uint32_t, Font::Table>::iterator it = tables.find(tag);
+  auto it = tables.find(tag);
   return it == tables.end() ? 0 : &it->second;
 }
 
 const Font::Table* Font::FindTable(uint32_t tag) const {
-  std::map<uint32_t, Font::Table>::const_iterator it = tables.find(tag);
+  auto it = tables.find(tag);
   return it == tables.end() ? 0 : &it->second;
 }
 
-std::vector<uint32_t> Font::OutputOrderedTags() const {
-  std::vector<uint32_t> output_order;
+const std::vector<uint32_t>& Font::OutputOrderedTags() const {
+  if (output_order_revision_ == tables.revision()) {
+    return output_order_;
+  }
+  output_order_.clear();
+  output_order_revision_ = tables.revision();
 
+  // The tags are in alphabetical order, so that only loca has to be put
+  // immediately after glyf.
+  const bool has_glyf = tables.count(kGlyfTableTag) != 0;
   for (const auto& i : tables) {
-    const Font::Table& table = i.second;
+    const uint32_t tag = i.first;
     // This is a transformed table, we will write it together with the
     // original version.
-    if (table.tag & 0x80808080) {
+    if (tag & 0x80808080) {
       continue;
     }
-    output_order.push_back(table.tag);
-  }
-
-  // Alphabetize then put loca immediately after glyf
-  auto glyf_loc = std::find(output_order.begin(), output_order.end(),
-      kGlyfTableTag);
-  auto loca_loc = std::find(output_order.begin(), output_order.end(),
-      kLocaTableTag);
-  if (glyf_loc != output_order.end() && loca_loc != output_order.end()) {
-    output_order.erase(loca_loc);
-    output_order.insert(std::find(output_order.begin(), output_order.end(),
-      kGlyfTableTag) + 1, kLocaTableTag);
+    if (tag == kLocaTableTag && has_glyf) {
+      continue;
+    }
+    output_order_.push_back(tag);
+    if (tag == kGlyfTableTag && tables.count(kLocaTableTag)) {
+      output_order_.push_back(kLocaTableTag);
+    }
   }
-
-  return output_order;
+  return output_order_;
 }
 
 bool ReadTrueTypeFont(Buffer* file, const uint8_t* data, size_t len,
@@ -64,7 +65,9 @@ bool ReadTrueTypeFont(Buffer* file, const uint8_t* data, size_t len,
     return FONT_COMPRESSION_FAILURE();
   }
 
-  std::map<uint32_t, uint32_t> intervals;
+  FlatMap<uint32_t, uint32_t> intervals;
+  intervals.reserve(font->num_tables);
+  font->tables.reserve(font->num_tables);
   for (uint16_t i = 0; i < font->num_tables; ++i) {
     Font::Table table;
     table.flag_byte = 0;
@@ -108,7 +111,7 @@ bool ReadTrueTypeFont(Buffer* file, const uint8_t* data, size_t len,
 
 bool ReadCollectionFont(Buffer* file, const uint8_t* data, size_t len,
                         Font* font,
-                        std::map<uint32_t, Font::Table*>* all_tables) {
+                        FlatMap<uint32_t, Font::Table*>* all_tables) {
   if (!file->ReadU32(&font->flavor)) {
     return FONT_COMPRESSION_FAILURE();
   }
@@ -119,10 +122,11 @@ bool ReadCollectionFont(Buffer* file, const uint8_t* data, size_t len,
   for (auto& entry : font->tables) {
     Font::Table& table = entry.second;
 
-    if (all_tables->find(table.offset) == all_tables->end()) {
-      (*all_tables)[table.offset] = font->FindTable(table.tag);
+    Font::Table*& first_use = (*all_tables)[table.offset];
+    if (first_use == NULL) {
+      first_use = &table;
     } else {
-      table.reuse_of = (*all_tables)[table.offset];
+      table.reuse_of = first_use;
       if (table.tag != table.reuse_of->tag) {
         return FONT_COMPRESSION_FAILURE();
       }
@@ -153,11 +157,11 @@ bool ReadTrueTypeCollection(Buffer* file, const uint8_t* data, size_t len,
     font_collection->fonts.resize(offsets.size());
     std::vector<Font>::iterator font_it = font_collection->fonts.begin();
 
-    std::map<uint32_t, Font::Table*> all_tables;
     for (const auto offset : offsets) {
       file->set_offset(offset);
       Font& font = *font_it++;
-      if (!ReadCollectionFont(file, data, len, &font, &all_tables)) {
+      if (!ReadCollectionFont(file, data, len, &font,
+                              &font_collection->tables)) {
         return FONT_COMPRESSION_FAILURE();
       }
     }
@@ -388,8 +392,7 @@ bool GetGlyphData(const Font& font, int glyph_index,
 }
 
 bool RemoveDigitalSignature(Font* font) {
-  std::map<uint32_t, Font::Table>::iterator it =
-      font->tables.find(kDsigTableTag);
+  auto it = font->tables.find(kDsigTableTag);
   if (it != font->tables.end()) {
     font->tables.erase(it);
     font->num_tables = font->tables.size();
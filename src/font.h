@@ -12,9 +12,10 @@
 
 #include <stddef.h>
 #include <inttypes.h>
-#include <map>
 #include <vector>
 
+#include "./flat_map.h"
+
 namespace woff2 {
 
 // Represents an sfnt font file. Only the table directory is parsed, for the
@@ -44,11 +45,25 @@ struct Font {
     // Is this table reused by a TTC
     bool IsReused() const;
   };
-  std::map<uint32_t, Table> tables;
-  std::vector<uint32_t> OutputOrderedTags() const;
+  FlatMap<uint32_t, Table> tables;
+  // The tags of the tables but the transformed ones, in the order they are
+  // written in. The order is kept until a table is added or removed, so the
+  // same font must not be asked from several threads at once.
+  const std::vector<uint32_t>& OutputOrderedTags() const;
+
+  // If not empty, whether each glyph keeps its outline, by glyph id. The
+  // others are emptied when the glyphs are normalized.
+  std::vector<bool> retained_glyphs;
+  bool IsGlyphRetained(int glyph_index) const {
+    return retained_glyphs.empty() || retained_glyphs[glyph_index];
+  }
 
   Table* FindTable(uint32_t tag);
   const Table* FindTable(uint32_t tag) const;
+
+ private:
+  mutable std::vector<uint32_t> output_order_;
+  mutable uint64_t output_order_revision_ = 0;
 };
 
 // Accomodates both singular (OTF, TTF) and collection (TTC) fonts
@@ -56,7 +71,7 @@ struct FontCollection {
   uint32_t flavor;
   uint32_t header_version;
   // (offset, first use of table*) pairs
-  std::map<uint32_t, Font::Table*> tables;
+  FlatMap<uint32_t, Font::Table*> tables;
   std::vector<Font> fonts;
 };
 
@@ -8,7 +8,6 @@
 
 #include "./glyph.h"
 
-#include <stdlib.h>
 #include <limits>
 #include "./buffer.h"
 #include "./store_bytes.h"
@@ -64,6 +63,14 @@ bool ReadCompositeGlyphData(Buffer* buffer, Glyph* glyph) {
 }
 
 bool ReadGlyph(const uint8_t* data, size_t len, Glyph* glyph) {
+  glyph->instructions_size = 0;
+  glyph->overlap_simple_flag_set = false;
+  glyph->composite_data_size = 0;
+  glyph->points.Clear();
+  if (len == 0) {
+    return true;
+  }
+
   Buffer buffer(data, len);
 
   int16_t num_contours;
@@ -86,19 +93,18 @@ bool ReadGlyph(const uint8_t* data, size_t len, Glyph* glyph) {
 
   if (num_contours > 0) {
     // Simple glyph.
-    glyph->contours.resize(num_contours);
+    GlyphPoints& points = glyph->points;
+    points.end_points.resize(num_contours);
 
-    // Read the number of points per contour.
-    uint16_t last_point_index = 0;
+    // Read the end points of the contours, which can't go back.
     for (int i = 0; i < num_contours; ++i) {
-      uint16_t point_index;
-      if (!buffer.ReadU16(&point_index)) {
+      if (!buffer.ReadU16(&points.end_points[i]) ||
+          (i > 0 && points.end_points[i] < points.end_points[i - 1])) {
         return FONT_COMPRESSION_FAILURE();
       }
-      uint16_t num_points = point_index - last_point_index + (i == 0 ? 1 : 0);
-      glyph->contours[i].resize(num_points);
-      last_point_index = point_index;
     }
+    const size_t num_points = points.end_points.back() + 1;
+    points.Resize(num_points);
 
     // Read the instructions.
     if (!buffer.ReadU16(&glyph->instructions_size)) {
@@ -110,87 +116,80 @@ bool ReadGlyph(const uint8_t* data, size_t len, Glyph* glyph) {
     }
 
     // Read the run-length coded flags.
-    std::vector<std::vector<uint8_t> > flags(num_contours);
+    std::vector<uint8_t>& flags = glyph->flags;
+    flags.resize(num_points);
+    std::fill(points.on_curve.begin(), points.on_curve.end(), 0);
     {
       uint8_t flag = 0;
       uint8_t flag_repeat = 0;
-      for (int i = 0; i < num_contours; ++i) {
-        flags[i].resize(glyph->contours[i].size());
-        for (size_t j = 0; j < glyph->contours[i].size(); ++j) {
-          if (flag_repeat == 0) {
-            if (!buffer.ReadU8(&flag)) {
+      for (size_t i = 0; i < num_points; ++i) {
+        if (flag_repeat == 0) {
+          if (!buffer.ReadU8(&flag)) {
+            return FONT_COMPRESSION_FAILURE();
+          }
+          if (flag & kFLAG_REPEAT) {
+            if (!buffer.ReadU8(&flag_repeat)) {
               return FONT_COMPRESSION_FAILURE();
             }
-            if (flag & kFLAG_REPEAT) {
-              if (!buffer.ReadU8(&flag_repeat)) {
-                return FONT_COMPRESSION_FAILURE();
-              }
-            }
-          } else {
-            flag_repeat--;
           }
-          flags[i][j] = flag;
-          glyph->contours[i][j].on_curve = flag & kFLAG_ONCURVE;
+        } else {
+          flag_repeat--;
         }
+        flags[i] = flag;
+        points.on_curve[i >> 3] |= (flag & kFLAG_ONCURVE) << (i & 7);
       }
     }
 
-    if (!flags.empty() && !flags[0].empty()) {
-      glyph->overlap_simple_flag_set = (flags[0][0] & kFLAG_OVERLAP_SIMPLE);
-    }
+    glyph->overlap_simple_flag_set = (flags[0] & kFLAG_OVERLAP_SIMPLE);
 
-    // Read the x coordinates.
-    int prev_x = 0;
-    for (int i = 0; i < num_contours; ++i) {
-      for (size_t j = 0; j < glyph->contours[i].size(); ++j) {
-        uint8_t flag = flags[i][j];
-        if (flag & kFLAG_XSHORT) {
-          // single byte x-delta coord value
-          uint8_t x_delta;
-          if (!buffer.ReadU8(&x_delta)) {
+    // Read the x coordinates. Like in the font, they wrap around.
+    int16_t prev_x = 0;
+    for (size_t i = 0; i < num_points; ++i) {
+      uint8_t flag = flags[i];
+      if (flag & kFLAG_XSHORT) {
+        // single byte x-delta coord value
+        uint8_t x_delta;
+        if (!buffer.ReadU8(&x_delta)) {
+          return FONT_COMPRESSION_FAILURE();
+        }
+        int sign = (flag & kFLAG_XREPEATSIGN) ? 1 : -1;
+        points.x[i] = static_cast<int16_t>(prev_x + sign * x_delta);
+      } else {
+        // double byte x-delta coord value
+        int16_t x_delta = 0;
+        if (!(flag & kFLAG_XREPEATSIGN)) {
+          if (!buffer.ReadS16(&x_delta)) {
             return FONT_COMPRESSION_FAILURE();
           }
-          int sign = (flag & kFLAG_XREPEATSIGN) ? 1 : -1;
-          glyph->contours[i][j].x = prev_x + sign * x_delta;
-        } else {
-          // double byte x-delta coord value
-          int16_t x_delta = 0;
-          if (!(flag & kFLAG_XREPEATSIGN)) {
-            if (!buffer.ReadS16(&x_delta)) {
-              return FONT_COMPRESSION_FAILURE();
-            }
-          }
-          glyph->contours[i][j].x = prev_x + x_delta;
         }
-        prev_x = glyph->contours[i][j].x;
+        points.x[i] = static_cast<int16_t>(prev_x + x_delta);
       }
+      prev_x = points.x[i];
     }
 
     // Read the y coordinates.
-    int prev_y = 0;
-    for (int i = 0; i < num_contours; ++i) {
-      for (size_t j = 0; j < glyph->contours[i].size(); ++j) {
-        uint8_t flag = flags[i][j];
-        if (flag & kFLAG_YSHORT) {
-          // single byte y-delta coord value
-          uint8_t y_delta;
-          if (!buffer.ReadU8(&y_delta)) {
+    int16_t prev_y = 0;
+    for (size_t i = 0; i < num_points; ++i) {
+      uint8_t flag = flags[i];
+      if (flag & kFLAG_YSHORT) {
+        // single byte y-delta coord value
+        uint8_t y_delta;
+        if (!buffer.ReadU8(&y_delta)) {
+          return FONT_COMPRESSION_FAILURE();
+        }
+        int sign = (flag & kFLAG_YREPEATSIGN) ? 1 : -1;
+        points.y[i] = static_cast<int16_t>(prev_y + sign * y_delta);
+      } else {
+        // double byte y-delta coord value
+        int16_t y_delta = 0;
+        if (!(flag & kFLAG_YREPEATSIGN)) {
+          if (!buffer.ReadS16(&y_delta)) {
             return FONT_COMPRESSION_FAILURE();
           }
-          int sign = (flag & kFLAG_YREPEATSIGN) ? 1 : -1;
-          glyph->contours[i][j].y = prev_y + sign * y_delta;
-        } else {
-          // double byte y-delta coord value
-          int16_t y_delta = 0;
-          if (!(flag & kFLAG_YREPEATSIGN)) {
-            if (!buffer.ReadS16(&y_delta)) {
-              return FONT_COMPRESSION_FAILURE();
-            }
-          }
-          glyph->contours[i][j].y = prev_y + y_delta;
         }
-        prev_y = glyph->contours[i][j].y;
+        points.y[i] = static_cast<int16_t>(prev_y + y_delta);
       }
+      prev_y = points.y[i];
     }
   } else if (num_contours == -1) {
     // Composite glyph.
@@ -215,6 +214,46 @@ bool ReadGlyph(const uint8_t* data, size_t len, Glyph* glyph) {
   return true;
 }
 
+bool ReadComponentGlyphIds(const uint8_t* data, size_t len,
+                           std::vector<uint16_t>* glyph_ids) {
+  if (len == 0) {
+    return true;
+  }
+  Buffer buffer(data, len);
+  int16_t num_contours;
+  if (!buffer.ReadS16(&num_contours)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (num_contours != -1) {
+    return true;
+  }
+  Glyph glyph;
+  if (!buffer.Skip(8) || !ReadCompositeGlyphData(&buffer, &glyph)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  Buffer components(glyph.composite_data, glyph.composite_data_size);
+  uint16_t flags = kFLAG_MORE_COMPONENTS;
+  while (flags & kFLAG_MORE_COMPONENTS) {
+    uint16_t glyph_id;
+    if (!components.ReadU16(&flags) || !components.ReadU16(&glyph_id)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    glyph_ids->push_back(glyph_id);
+    size_t arg_size = (flags & kFLAG_ARG_1_AND_2_ARE_WORDS) ? 4 : 2;
+    if (flags & kFLAG_WE_HAVE_A_SCALE) {
+      arg_size += 2;
+    } else if (flags & kFLAG_WE_HAVE_AN_X_AND_Y_SCALE) {
+      arg_size += 4;
+    } else if (flags & kFLAG_WE_HAVE_A_TWO_BY_TWO) {
+      arg_size += 8;
+    }
+    if (!components.Skip(arg_size)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  return true;
+}
+
 namespace {
 
 void StoreBbox(const Glyph& glyph, size_t* offset, uint8_t* dst) {
@@ -229,115 +268,10 @@ void StoreInstructions(const Glyph& glyph, size_t* offset, uint8_t* dst) {
   StoreBytes(glyph.instructions_data, glyph.instructions_size, offset, dst);
 }
 
-bool StoreEndPtsOfContours(const Glyph& glyph, size_t* offset, uint8_t* dst) {
-  int end_point = -1;
-  for (const auto& contour : glyph.contours) {
-    end_point += contour.size();
-    if (contour.size() > std::numeric_limits<uint16_t>::max() ||
-        end_point > std::numeric_limits<uint16_t>::max()) {
-      return FONT_COMPRESSION_FAILURE();
-    }
+void StoreEndPtsOfContours(const Glyph& glyph, size_t* offset, uint8_t* dst) {
+  for (uint16_t end_point : glyph.points.end_points) {
     Store16(end_point, offset, dst);
   }
-  return true;
-}
-
-bool StorePoints(const Glyph& glyph, size_t* offset,
-                 uint8_t* dst, size_t dst_size) {
-  int previous_flag = -1;
-  int repeat_count = 0;
-  int last_x = 0;
-  int last_y = 0;
-  size_t x_bytes = 0;
-  size_t y_bytes = 0;
-
-  // Store the flags and calculate the total size of the x and y coordinates.
-  for (const auto& contour : glyph.contours) {
-    for (const auto& point : contour) {
-      int flag = point.on_curve ? kFLAG_ONCURVE : 0;
-      if (previous_flag == -1 && glyph.overlap_simple_flag_set) {
-        // First flag needs to have overlap simple bit set.
-        flag = flag | kFLAG_OVERLAP_SIMPLE;
-      }
-      int dx = point.x - last_x;
-      int dy = point.y - last_y;
-      if (dx == 0) {
-        flag |= kFLAG_XREPEATSIGN;
-      } else if (dx > -256 && dx < 256) {
-        flag |= kFLAG_XSHORT | (dx > 0 ? kFLAG_XREPEATSIGN : 0);
-        x_bytes += 1;
-      } else {
-        x_bytes += 2;
-      }
-      if (dy == 0) {
-        flag |= kFLAG_YREPEATSIGN;
-      } else if (dy > -256 && dy < 256) {
-        flag |= kFLAG_YSHORT | (dy > 0 ? kFLAG_YREPEATSIGN : 0);
-        y_bytes += 1;
-      } else {
-        y_bytes += 2;
-      }
-      if (flag == previous_flag && repeat_count != 255) {
-        dst[*offset - 1] |= kFLAG_REPEAT;
-        repeat_count++;
-      } else {
-        if (repeat_count != 0) {
-          if (*offset >= dst_size) {
-            return FONT_COMPRESSION_FAILURE();
-          }
-          dst[(*offset)++] = repeat_count;
-        }
-        if (*offset >= dst_size) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-        dst[(*offset)++] = flag;
-        repeat_count = 0;
-      }
-      last_x = point.x;
-      last_y = point.y;
-      previous_flag = flag;
-    }
-  }
-  if (repeat_count != 0) {
-    if (*offset >= dst_size) {
-      return FONT_COMPRESSION_FAILURE();
-    }
-    dst[(*offset)++] = repeat_count;
-  }
-
-  if (*offset + x_bytes + y_bytes > dst_size) {
-    return FONT_COMPRESSION_FAILURE();
-  }
-
-  // Store the x and y coordinates.
-  size_t x_offset = *offset;
-  size_t y_offset = *offset + x_bytes;
-  last_x = 0;
-  last_y = 0;
-  for (const auto& contour : glyph.contours) {
-    for (const auto& point : contour) {
-      int dx = point.x - last_x;
-      int dy = point.y - last_y;
-      if (dx == 0) {
-        // pass
-      } else if (dx > -256 && dx < 256) {
-        dst[x_offset++] = std::abs(dx);
-      } else {
-        Store16(dx, &x_offset, dst);
-      }
-      if (dy == 0) {
-        // pass
-      } else if (dy > -256 && dy < 256) {
-        dst[y_offset++] = std::abs(dy);
-      } else {
-        Store16(dy, &y_offset, dst);
-      }
-      last_x += dx;
-      last_y += dy;
-    }
-  }
-  *offset = y_offset;
-  return true;
 }
 
 }  // namespace
@@ -357,22 +291,21 @@ bool StoreGlyph(const Glyph& glyph, uint8_t* dst, size_t* dst_size) {
     if (glyph.have_instructions) {
       StoreInstructions(glyph, &offset, dst);
     }
-  } else if (glyph.contours.size() > 0) {
+  } else if (glyph.num_contours() > 0) {
     // Simple glyph.
-    if (glyph.contours.size() > std::numeric_limits<int16_t>::max()) {
+    if (glyph.num_contours() > std::numeric_limits<int16_t>::max()) {
       return FONT_COMPRESSION_FAILURE();
     }
-    if (*dst_size < ((12ULL + 2 * glyph.contours.size()) +
+    if (*dst_size < ((12ULL + 2 * glyph.num_contours()) +
                      glyph.instructions_size)) {
       return FONT_COMPRESSION_FAILURE();
     }
-    Store16(glyph.contours.size(), &offset, dst);
+    Store16(glyph.num_contours(), &offset, dst);
     StoreBbox(glyph, &offset, dst);
-    if (!StoreEndPtsOfContours(glyph, &offset, dst)) {
-      return FONT_COMPRESSION_FAILURE();
-    }
+    StoreEndPtsOfContours(glyph, &offset, dst);
     StoreInstructions(glyph, &offset, dst);
-    if (!StorePoints(glyph, &offset, dst, *dst_size)) {
+    if (!StorePoints(glyph.points, glyph.overlap_simple_flag_set,
+                     std::span(dst, *dst_size), &offset)) {
       return FONT_COMPRESSION_FAILURE();
     }
   }
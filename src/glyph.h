@@ -16,6 +16,8 @@
 #include <cstdint>
 #include <vector>
 
+#include "./glyph_points.h"
+
 namespace woff2 {
 
 // Represents a parsed simple or composite glyph. The composite glyph data and
@@ -43,12 +45,10 @@ class Glyph {
   bool overlap_simple_flag_set;
 
   // Data model for simple glyphs.
-  struct Point {
-    int x;
-    int y;
-    bool on_curve;
-  };
-  std::vector<std::vector<Point> > contours;
+  GlyphPoints points;
+  size_t num_contours() const { return points.end_points.size(); }
+  // The flags of the points, as ReadGlyph last read them.
+  std::vector<uint8_t> flags;
 
   // Data for composite glyphs.
   const uint8_t* composite_data;
@@ -56,11 +56,18 @@ class Glyph {
   bool have_instructions;
 };
 
-// Parses the glyph from the given data. Returns false on parsing failure or
-// buffer overflow. The glyph is valid only so long the input data pointer is
-// valid.
+// Parses the glyph from the given data, where no data is an empty glyph.
+// Returns false on parsing failure or buffer overflow. The glyph is valid only
+// so long the input data pointer is valid. A glyph can be read into again,
+// reusing the memory it holds.
 bool ReadGlyph(const uint8_t* data, size_t len, Glyph* glyph);
 
+// Appends the ids of the glyphs that the components of the glyph in data
+// refer to, if it is a composite glyph, to *glyph_ids. Returns false on
+// parsing failure or buffer overflow.
+bool ReadComponentGlyphIds(const uint8_t* data, size_t len,
+                           std::vector<uint16_t>* glyph_ids);
+
 // Stores the glyph into the specified dst buffer. The *dst_size is the buffer
 // size on entry and is set to the actual (unpadded) stored size on exit.
 // Returns false on buffer overflow.
@@ -0,0 +1,205 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Bounding boxes and storage of the points of simple glyphs */
+
+#include "./glyph_points.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "./buffer.h"
+#include "./store_bytes.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WOFF2_BBOX_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WOFF2_BBOX_NEON
+#include <arm_neon.h>
+#endif
+
+namespace woff2 {
+
+namespace {
+
+const int kFlagOnCurve = 1 << 0;
+const int kFlagXShort = 1 << 1;
+const int kFlagYShort = 1 << 2;
+const int kFlagRepeat = 1 << 3;
+const int kFlagThisXIsSame = 1 << 4;
+const int kFlagThisYIsSame = 1 << 5;
+const int kFlagOverlapSimple = 1 << 6;
+
+// Sets *min and *max to the smallest and the largest of v[0, n), n > 0.
+void MinMax(const int16_t* v, size_t n, int16_t* min, int16_t* max) {
+  size_t i = 0;
+  int16_t lo = v[0];
+  int16_t hi = v[0];
+#if defined(WOFF2_BBOX_SSE2)
+  if (n >= 8) {
+    __m128i vlo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v));
+    __m128i vhi = vlo;
+    for (i = 8; i + 8 <= n; i += 8) {
+      __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+      vlo = _mm_min_epi16(vlo, w);
+      vhi = _mm_max_epi16(vhi, w);
+    }
+    // The last block overlaps the one before it, which leaves the minimum
+    // and the maximum as they are.
+    __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + n - 8));
+    vlo = _mm_min_epi16(vlo, w);
+    vhi = _mm_max_epi16(vhi, w);
+    vlo = _mm_min_epi16(vlo, _mm_shuffle_epi32(vlo, _MM_SHUFFLE(1, 0, 3, 2)));
+    vhi = _mm_max_epi16(vhi, _mm_shuffle_epi32(vhi, _MM_SHUFFLE(1, 0, 3, 2)));
+    vlo = _mm_min_epi16(vlo, _mm_shuffle_epi32(vlo, _MM_SHUFFLE(2, 3, 0, 1)));
+    vhi = _mm_max_epi16(vhi, _mm_shuffle_epi32(vhi, _MM_SHUFFLE(2, 3, 0, 1)));
+    vlo = _mm_min_epi16(vlo, _mm_srli_epi32(vlo, 16));
+    vhi = _mm_max_epi16(vhi, _mm_srli_epi32(vhi, 16));
+    lo = static_cast<int16_t>(_mm_extract_epi16(vlo, 0));
+    hi = static_cast<int16_t>(_mm_extract_epi16(vhi, 0));
+    i = n;
+  }
+#elif defined(WOFF2_BBOX_NEON)
+  if (n >= 8) {
+    int16x8_t vlo = vld1q_s16(v);
+    int16x8_t vhi = vlo;
+    for (i = 8; i + 8 <= n; i += 8) {
+      int16x8_t w = vld1q_s16(v + i);
+      vlo = vminq_s16(vlo, w);
+      vhi = vmaxq_s16(vhi, w);
+    }
+    int16x8_t w = vld1q_s16(v + n - 8);
+    vlo = vminq_s16(vlo, w);
+    vhi = vmaxq_s16(vhi, w);
+    int16x4_t hlo = vmin_s16(vget_low_s16(vlo), vget_high_s16(vlo));
+    int16x4_t hhi = vmax_s16(vget_low_s16(vhi), vget_high_s16(vhi));
+    hlo = vpmin_s16(hlo, hlo);
+    hhi = vpmax_s16(hhi, hhi);
+    hlo = vpmin_s16(hlo, hlo);
+    hhi = vpmax_s16(hhi, hhi);
+    lo = vget_lane_s16(hlo, 0);
+    hi = vget_lane_s16(hhi, 0);
+    i = n;
+  }
+#endif
+  for (; i < n; ++i) {
+    lo = std::min(lo, v[i]);
+    hi = std::max(hi, v[i]);
+  }
+  *min = lo;
+  *max = hi;
+}
+
+}  // namespace
+
+void ComputeBbox(const GlyphPoints& points, int16_t bbox[4]) {
+  if (points.size() == 0) {
+    std::fill(bbox, bbox + 4, 0);
+    return;
+  }
+  MinMax(points.x.data(), points.size(), &bbox[0], &bbox[2]);
+  MinMax(points.y.data(), points.size(), &bbox[1], &bbox[3]);
+}
+
+bool StorePoints(const GlyphPoints& points, bool has_overlap_bit,
+                 std::span<uint8_t> dst, size_t* offset) {
+  size_t flag_offset = *offset;
+  int last_flag = -1;
+  int repeat_count = 0;
+  int16_t last_x = 0;
+  int16_t last_y = 0;
+  size_t x_bytes = 0;
+  size_t y_bytes = 0;
+
+  // Store the flags and calculate the total size of the x and y coordinates.
+  for (size_t i = 0; i < points.size(); ++i) {
+    int flag = points.OnCurve(i) ? kFlagOnCurve : 0;
+    if (has_overlap_bit && i == 0) {
+      flag |= kFlagOverlapSimple;
+    }
+    // Coordinates wrap around just as they do in the font.
+    int16_t dx = static_cast<int16_t>(points.x[i] - last_x);
+    int16_t dy = static_cast<int16_t>(points.y[i] - last_y);
+    if (dx == 0) {
+      flag |= kFlagThisXIsSame;
+    } else if (dx > -256 && dx < 256) {
+      flag |= kFlagXShort | (dx > 0 ? kFlagThisXIsSame : 0);
+      x_bytes += 1;
+    } else {
+      x_bytes += 2;
+    }
+    if (dy == 0) {
+      flag |= kFlagThisYIsSame;
+    } else if (dy > -256 && dy < 256) {
+      flag |= kFlagYShort | (dy > 0 ? kFlagThisYIsSame : 0);
+      y_bytes += 1;
+    } else {
+      y_bytes += 2;
+    }
+
+    if (flag == last_flag && repeat_count != 255) {
+      dst[flag_offset - 1] |= kFlagRepeat;
+      repeat_count++;
+    } else {
+      if (repeat_count != 0) {
+        if (PREDICT_FALSE(flag_offset >= dst.size())) {
+          return FONT_COMPRESSION_FAILURE();
+        }
+        dst[flag_offset++] = repeat_count;
+      }
+      if (PREDICT_FALSE(flag_offset >= dst.size())) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      dst[flag_offset++] = flag;
+      repeat_count = 0;
+    }
+    last_x = points.x[i];
+    last_y = points.y[i];
+    last_flag = flag;
+  }
+  if (repeat_count != 0) {
+    if (PREDICT_FALSE(flag_offset >= dst.size())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    dst[flag_offset++] = repeat_count;
+  }
+  if (PREDICT_FALSE(x_bytes + y_bytes > dst.size() - flag_offset)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // Store the x and y coordinates.
+  size_t x_offset = flag_offset;
+  size_t y_offset = flag_offset + x_bytes;
+  last_x = 0;
+  last_y = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    int16_t dx = static_cast<int16_t>(points.x[i] - last_x);
+    if (dx == 0) {
+      // pass
+    } else if (dx > -256 && dx < 256) {
+      dst[x_offset++] = std::abs(dx);
+    } else {
+      x_offset = Store16(dst, x_offset, dx);
+    }
+    int16_t dy = static_cast<int16_t>(points.y[i] - last_y);
+    if (dy == 0) {
+      // pass
+    } else if (dy > -256 && dy < 256) {
+      dst[y_offset++] = std::abs(dy);
+    } else {
+      y_offset = Store16(dst, y_offset, dy);
+    }
+    last_x = points.x[i];
+    last_y = points.y[i];
+  }
+  *offset = y_offset;
+  return true;
+}
+
+} // namespace woff2
@@ -0,0 +1,65 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* The points of simple glyphs, as both the encoder and the decoder keep
+   them. */
+
+#ifndef WOFF2_GLYPH_POINTS_H_
+#define WOFF2_GLYPH_POINTS_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <span>
+#include <vector>
+
+namespace woff2 {
+
+// The points of all contours of a simple glyph, one after the other, with
+// each field in an array of its own.
+struct GlyphPoints {
+  std::vector<int16_t> x;
+  std::vector<int16_t> y;
+  // Bit i & 7 of on_curve[i >> 3] is set if point i is on the curve.
+  std::vector<uint8_t> on_curve;
+  // The index of the last point of each contour.
+  std::vector<uint16_t> end_points;
+
+  size_t size() const { return x.size(); }
+
+  bool OnCurve(size_t i) const {
+    return on_curve[i >> 3] & (1 << (i & 7));
+  }
+
+  // Makes room for n points, leaving their values to the caller.
+  void Resize(size_t n) {
+    x.resize(n);
+    y.resize(n);
+    on_curve.resize((n + 7) >> 3);
+  }
+
+  void Clear() {
+    x.clear();
+    y.clear();
+    on_curve.clear();
+    end_points.clear();
+  }
+};
+
+// Sets bbox to the x_min, y_min, x_max and y_max of the points, or to zeros
+// if there are none.
+void ComputeBbox(const GlyphPoints& points, int16_t bbox[4]);
+
+// Stores the flags and then the x and y coordinates of the points, as they
+// are in a simple glyph, at *offset in dst and moves *offset past them. If
+// has_overlap_bit is set, the first flag gets the OVERLAP_SIMPLE bit. Returns
+// false if they don't fit in dst.
+bool StorePoints(const GlyphPoints& points, bool has_overlap_bit,
+                 std::span<uint8_t> dst, size_t* offset);
+
+} // namespace woff2
+
+#endif  // WOFF2_GLYPH_POINTS_H_
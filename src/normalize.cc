@@ -11,13 +11,17 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+#include <algorithm>
+
 #include "./buffer.h"
 #include "./port.h"
 #include "./font.h"
 #include "./glyph.h"
+#include "./parallel.h"
 #include "./round.h"
 #include "./store_bytes.h"
 #include "./table_tags.h"
+#include "./transform.h"
 #include "./woff2_common.h"
 
 namespace woff2 {
@@ -49,13 +53,18 @@ bool WriteNormalizedLoca(int index_fmt, int num_glyphs, Font* font) {
   uint32_t glyf_offset = 0;
   size_t loca_offset = 0;
 
+  Glyph glyph;
   for (int i = 0; i < num_glyphs; ++i) {
     StoreLoca(index_fmt, glyf_offset, &loca_offset, loca_dst);
-    Glyph glyph;
     const uint8_t* glyph_data;
     size_t glyph_size;
-    if (!GetGlyphData(*font, i, &glyph_data, &glyph_size) ||
-        (glyph_size > 0 && !ReadGlyph(glyph_data, glyph_size, &glyph))) {
+    if (!GetGlyphData(*font, i, &glyph_data, &glyph_size)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (!font->IsGlyphRetained(i)) {
+      glyph_size = 0;
+    }
+    if (!ReadGlyph(glyph_data, glyph_size, &glyph)) {
       return FONT_COMPRESSION_FAILURE();
     }
     size_t glyf_dst_size = glyf_table->buffer.size() - glyf_offset;
@@ -106,6 +115,33 @@ bool MakeEditableBuffer(Font* font, int tableTag) {
 
 }  // namespace
 
+bool RetainGlyphs(Font* font, const std::vector<uint16_t>& glyph_ids) {
+  font->retained_glyphs.clear();
+  int num_glyphs = NumGlyphs(*font);
+  if (font->FindTable(kGlyfTableTag) == NULL || num_glyphs == 0) {
+    return true;
+  }
+  std::vector<bool> retained(num_glyphs);
+  std::vector<uint16_t> pending(1, 0);
+  pending.insert(pending.end(), glyph_ids.begin(), glyph_ids.end());
+  while (!pending.empty()) {
+    uint16_t glyph_id = pending.back();
+    pending.pop_back();
+    if (glyph_id >= num_glyphs || retained[glyph_id]) {
+      continue;
+    }
+    retained[glyph_id] = true;
+    const uint8_t* glyph_data;
+    size_t glyph_size;
+    if (!GetGlyphData(*font, glyph_id, &glyph_data, &glyph_size) ||
+        !ReadComponentGlyphIds(glyph_data, glyph_size, &pending)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  font->retained_glyphs.swap(retained);
+  return true;
+}
+
 bool NormalizeGlyphs(Font* font) {
   Font::Table* head_table = font->FindTable(kHeadTableTag);
   Font::Table* glyf_table = font->FindTable(kGlyfTableTag);
@@ -184,6 +220,10 @@ uint32_t ComputeHeaderChecksum(const Font& font) {
   checksum += (max_pow2 << 16 | range_shift);
   for (const auto& i : font.tables) {
     const Font::Table* table = &i.second;
+    // Transformed tables are not part of the font.
+    if (table->tag & 0x80808080) {
+      continue;
+    }
     if (table->IsReused()) {
       table = table->reuse_of;
     }
@@ -216,6 +256,9 @@ bool FixChecksums(Font* font) {
   uint32_t head_checksum = 0;
   for (auto& i : font->tables) {
     Font::Table* table = &i.second;
+    if (table->tag & 0x80808080) {
+      continue;
+    }
     if (table->IsReused()) {
       table = table->reuse_of;
     }
@@ -240,8 +283,10 @@ bool MarkTransformed(Font* font) {
   if (head_table == NULL) {
     return FONT_COMPRESSION_FAILURE();
   }
-  if (head_table->reuse_of != NULL) {
-    head_table = head_table->reuse_of;
+  // The font that owns a shared head marks it, which keeps the fonts of a
+  // collection independent of one another until their checksums are fixed.
+  if (head_table->IsReused()) {
+    return true;
   }
   if (head_table->length < 17) {
     return FONT_COMPRESSION_FAILURE();
@@ -252,36 +297,54 @@ bool MarkTransformed(Font* font) {
   head_table->buffer[16] = head_flags | 0x08;
   return true;
 }
-}  // namespace
 
-
-bool NormalizeWithoutFixingChecksums(Font* font) {
+// Normalizes the font but for its checksums. If transform_buffers is not
+// NULL, glyf and loca are transformed as they are normalized, on up to
+// glyph_threads threads.
+bool NormalizeWithoutFixingChecksums(Font* font, int glyph_threads,
+                                     GlyfTransformBuffers* transform_buffers) {
   return (MakeEditableBuffer(font, kHeadTableTag) &&
           RemoveDigitalSignature(font) &&
           MarkTransformed(font) &&
-          NormalizeGlyphs(font) &&
+          (transform_buffers == NULL
+               ? NormalizeGlyphs(font)
+               : NormalizeAndTransformGlyfAndLocaTables(font, glyph_threads,
+                                                        transform_buffers)) &&
           NormalizeOffsets(font));
 }
 
-bool NormalizeFont(Font* font) {
-  return (NormalizeWithoutFixingChecksums(font) &&
-          FixChecksums(font));
-}
+bool NormalizeFontCollection(FontCollection* font_collection,
+                             int num_threads,
+                             std::vector<GlyfTransformBuffers>*
+                                 transform_buffers) {
+  std::vector<Font>& fonts = font_collection->fonts;
+  if (transform_buffers != NULL && transform_buffers->size() < fonts.size()) {
+    transform_buffers->resize(fonts.size());
+  }
+  auto normalize = [&](size_t i, int glyph_threads) {
+    return NormalizeWithoutFixingChecksums(
+        &fonts[i], glyph_threads,
+        transform_buffers ? &(*transform_buffers)[i] : NULL);
+  };
+
+  if (fonts.size() == 1) {
+    return normalize(0, num_threads) && FixChecksums(&fonts[0]);
+  }
 
-bool NormalizeFontCollection(FontCollection* font_collection) {
-  if (font_collection->fonts.size() == 1) {
-    return NormalizeFont(&font_collection->fonts[0]);
+  // Threads not needed to cover the fonts go to their glyphs instead.
+  int glyph_threads = std::max<int>(1, num_threads / fonts.size());
+  if (!ParallelFor(fonts.size(), num_threads, [&](size_t i) {
+        return normalize(i, glyph_threads);
+      })) {
+#ifdef FONT_COMPRESSION_BIN
+    fprintf(stderr, "Font normalization failed.\n");
+#endif
+    return FONT_COMPRESSION_FAILURE();
   }
 
   uint32_t offset = CollectionHeaderSize(font_collection->header_version,
     font_collection->fonts.size());
   for (auto& font : font_collection->fonts) {
-    if (!NormalizeWithoutFixingChecksums(&font)) {
-#ifdef FONT_COMPRESSION_BIN
-      fprintf(stderr, "Font normalization failed.\n");
-#endif
-      return FONT_COMPRESSION_FAILURE();
-    }
     offset += kSfntHeaderSize + kSfntEntrySize * font.num_tables;
   }
 
@@ -311,4 +374,27 @@ bool NormalizeFontCollection(FontCollection* font_collection) {
   return true;
 }
 
+}  // namespace
+
+bool NormalizeFont(Font* font) {
+  return (NormalizeWithoutFixingChecksums(font, 1, NULL) &&
+          FixChecksums(font));
+}
+
+bool NormalizeFontCollection(FontCollection* font_collection) {
+  return NormalizeFontCollection(font_collection, 1);
+}
+
+bool NormalizeFontCollection(FontCollection* font_collection,
+                             int num_threads) {
+  return NormalizeFontCollection(font_collection, num_threads, NULL);
+}
+
+bool NormalizeAndTransformFontCollection(
+    FontCollection* font_collection, int num_threads,
+    std::vector<GlyfTransformBuffers>* transform_buffers) {
+  return NormalizeFontCollection(font_collection, num_threads,
+                                 transform_buffers);
+}
+
 } // namespace woff2
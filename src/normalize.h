@@ -11,10 +11,15 @@
 #ifndef WOFF2_NORMALIZE_H_
 #define WOFF2_NORMALIZE_H_
 
+#include <inttypes.h>
+
+#include <vector>
+
 namespace woff2 {
 
 struct Font;
 struct FontCollection;
+struct GlyfTransformBuffers;
 
 // Changes the offset fields of the table headers so that the data for the
 // tables will be written in order of increasing tag values, without any gaps
@@ -30,9 +35,25 @@ bool FixChecksums(Font* font);
 // the loca table accordigly.
 bool NormalizeGlyphs(Font* font);
 
+// Makes NormalizeGlyphs() keep the outlines of only glyph 0, the glyphs in
+// glyph_ids and the components of the composite glyphs among them, leaving
+// all other glyphs empty. Their ids stay the same, so that the other tables
+// remain valid. Ids beyond the glyphs of the font are ignored. Returns false
+// if a composite glyph can't be parsed.
+bool RetainGlyphs(Font* font, const std::vector<uint16_t>& glyph_ids);
+
 // Performs all of the normalization steps above.
 bool NormalizeFont(Font* font);
 bool NormalizeFontCollection(FontCollection* font_collection);
+// Same, normalizing the fonts of a collection on up to num_threads threads.
+bool NormalizeFontCollection(FontCollection* font_collection,
+                             int num_threads);
+// Same, also adding the transformed glyf and loca tables to each font, with
+// memory from (*transform_buffers)[i] for font i. Each glyph is read once for
+// both; see NormalizeAndTransformGlyfAndLocaTables().
+bool NormalizeAndTransformFontCollection(
+    FontCollection* font_collection, int num_threads,
+    std::vector<GlyfTransformBuffers>* transform_buffers);
 
 } // namespace woff2
 
@@ -0,0 +1,58 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Helper for spreading independent pieces of work over several threads. */
+
+#include "./parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace woff2 {
+
+bool ParallelFor(size_t count, int num_threads,
+                 const std::function<bool(size_t)>& fn) {
+  return ParallelForWorkers(count, num_threads,
+                            [&fn](size_t, size_t i) { return fn(i); });
+}
+
+bool ParallelForWorkers(size_t count, int num_threads,
+                        const std::function<bool(size_t, size_t)>& fn) {
+  size_t max_threads = num_threads > 1 ? num_threads : 1;
+  size_t thread_count = std::min(count, max_threads);
+  if (thread_count <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      if (!fn(0, i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::atomic<size_t> next_index(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&](size_t worker_index) {
+    for (size_t i = next_index++; i < count && ok; i = next_index++) {
+      if (!fn(worker_index, i)) {
+        ok = false;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return ok;
+}
+
+} // namespace woff2
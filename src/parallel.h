@@ -0,0 +1,34 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Helper for spreading independent pieces of work over several threads. */
+
+#ifndef WOFF2_PARALLEL_H_
+#define WOFF2_PARALLEL_H_
+
+#include <stddef.h>
+
+#include <functional>
+
+namespace woff2 {
+
+// Calls fn(i) for every i in [0, count), using up to num_threads threads
+// (including the calling one). Work is handed out one index at a time, so
+// uneven pieces still keep every thread busy. Returns false if any call
+// returned false; remaining indices may then be skipped. With num_threads <= 1
+// everything runs in order on the calling thread.
+bool ParallelFor(size_t count, int num_threads,
+                 const std::function<bool(size_t)>& fn);
+
+// Like ParallelFor, but calls fn(worker, i), where worker in
+// [0, num_threads) identifies the thread making the call. Calls with the same
+// worker never overlap, so state indexed by it needs no locking.
+bool ParallelForWorkers(size_t count, int num_threads,
+                        const std::function<bool(size_t, size_t)>& fn);
+
+} // namespace woff2
+
+#endif  // WOFF2_PARALLEL_H_
@@ -0,0 +1,105 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Collection of the statistics reported to a WOFF2Stats. */
+
+#include "./stats.h"
+
+#include <algorithm>
+
+namespace woff2 {
+
+StatsRecorder::StatsRecorder(WOFF2Stats* stats)
+    : stats_(stats),
+      phase_(kNoPhase),
+      seconds_(),
+      entered_(),
+      grown_to_(),
+      peak_memory_(0),
+      failed_(false),
+      failure_(WOFF2Failure::kInvalidHeader),
+      failure_tag_(0) {}
+
+int StatsRecorder::SwitchPhase(int phase) {
+  if (stats_ == NULL) {
+    return kNoPhase;
+  }
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (phase_ != kNoPhase) {
+    std::chrono::duration<double> elapsed = now - phase_start_;
+    seconds_[phase_] += elapsed.count();
+  }
+  if (phase != kNoPhase) {
+    entered_[phase] = true;
+  }
+  int previous = phase_;
+  phase_ = phase;
+  phase_start_ = now;
+  return previous;
+}
+
+void StatsRecorder::Grew(WOFF2Buffer buffer, size_t before, size_t after) {
+  if (stats_ != NULL && after > before) {
+    size_t& grown_to = grown_to_[static_cast<int>(buffer)];
+    grown_to = std::max(grown_to, after);
+  }
+}
+
+void StatsRecorder::Fail(WOFF2Failure reason, uint32_t tag) {
+  if (stats_ != NULL && !failed_) {
+    failed_ = true;
+    failure_ = reason;
+    failure_tag_ = tag;
+  }
+}
+
+void StatsRecorder::PeakMemory(size_t bytes) {
+  if (stats_ != NULL) {
+    peak_memory_ = std::max(peak_memory_, bytes);
+  }
+}
+
+void StatsRecorder::Merge(const StatsRecorder& other) {
+  if (stats_ == NULL) {
+    return;
+  }
+  for (int i = 0; i < kNumPhases; ++i) {
+    seconds_[i] += other.seconds_[i];
+    entered_[i] = entered_[i] || other.entered_[i];
+  }
+  for (int i = 0; i < kNumBuffers; ++i) {
+    grown_to_[i] = std::max(grown_to_[i], other.grown_to_[i]);
+  }
+  peak_memory_ = std::max(peak_memory_, other.peak_memory_);
+  if (other.failed_) {
+    Fail(other.failure_, other.failure_tag_);
+  }
+}
+
+void StatsRecorder::Report() {
+  if (stats_ == NULL) {
+    return;
+  }
+  SwitchPhase(kNoPhase);
+  for (int i = 0; i < kNumPhases; ++i) {
+    if (entered_[i]) {
+      stats_->OnPhase(static_cast<WOFF2Phase>(i), seconds_[i]);
+    }
+  }
+  for (int i = 0; i < kNumBuffers; ++i) {
+    if (grown_to_[i] > 0) {
+      stats_->OnBufferGrowth(static_cast<WOFF2Buffer>(i), grown_to_[i]);
+    }
+  }
+  if (peak_memory_ > 0) {
+    stats_->OnPeakMemory(peak_memory_);
+  }
+  if (failed_) {
+    stats_->OnFailure(failure_, failure_tag_);
+  }
+}
+
+} // namespace woff2
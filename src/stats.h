@@ -0,0 +1,100 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* Collection of the statistics reported to a WOFF2Stats. */
+
+#ifndef WOFF2_STATS_H_
+#define WOFF2_STATS_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <array>
+#include <chrono>
+
+#include <woff2/stats.h>
+
+namespace woff2 {
+
+const int kNumPhases = static_cast<int>(WOFF2Phase::kNormalize) + 1;
+const int kNumBuffers = static_cast<int>(WOFF2Buffer::kTransform) + 1;
+
+// Accumulates the statistics of one conversion, to be handed to its
+// WOFF2Stats at the end. If there is no WOFF2Stats every method returns right
+// away, without reading the clock.
+class StatsRecorder {
+ public:
+  explicit StatsRecorder(WOFF2Stats* stats);
+
+  bool enabled() const { return stats_ != NULL; }
+  WOFF2Stats* stats() const { return stats_; }
+
+  // Starts charging time to phase, or to no phase if it is kNoPhase, and
+  // returns the phase that was charged until now.
+  static const int kNoPhase = -1;
+  int SwitchPhase(int phase);
+
+  // Notes that buffer grew from before to after bytes, if it did.
+  void Grew(WOFF2Buffer buffer, size_t before, size_t after);
+
+  // Notes why the conversion failed. The first reason noted is kept, which
+  // is the most specific one as failures propagate outwards.
+  void Fail(WOFF2Failure reason, uint32_t tag = 0);
+  bool failed() const { return failed_; }
+
+  // Notes that the decode took bytes of memory at its peak. The largest
+  // value noted is reported.
+  void PeakMemory(size_t bytes);
+
+  // Adds what other, which recorded part of the same conversion on another
+  // thread, has collected. Its failure wins only if this has none.
+  void Merge(const StatsRecorder& other);
+
+  // Hands the phase times, buffer growths, peak memory and failure to the
+  // WOFF2Stats.
+  void Report();
+
+ private:
+  WOFF2Stats* stats_;
+  int phase_;
+  std::chrono::steady_clock::time_point phase_start_;
+  std::array<double, kNumPhases> seconds_;
+  std::array<bool, kNumPhases> entered_;
+  std::array<size_t, kNumBuffers> grown_to_;
+  size_t peak_memory_;
+  bool failed_;
+  WOFF2Failure failure_;
+  uint32_t failure_tag_;
+};
+
+// Charges the time until it goes out of scope to phase.
+class ScopedPhase {
+ public:
+  ScopedPhase(StatsRecorder* recorder, WOFF2Phase phase)
+      : recorder_(recorder != NULL && recorder->enabled() ? recorder : NULL),
+        previous_(StatsRecorder::kNoPhase) {
+    if (recorder_ != NULL) {
+      previous_ = recorder_->SwitchPhase(static_cast<int>(phase));
+    }
+  }
+
+  ~ScopedPhase() {
+    if (recorder_ != NULL) {
+      recorder_->SwitchPhase(previous_);
+    }
+  }
+
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+ private:
+  StatsRecorder* recorder_;
+  int previous_;
+};
+
+} // namespace woff2
+
+#endif  // WOFF2_STATS_H_
@@ -8,11 +8,16 @@
 
 #include "./transform.h"
 
+#include <algorithm>
+#include <array>
 #include <complex>  // for std::abs
 
 #include "./buffer.h"
 #include "./font.h"
 #include "./glyph.h"
+#include "./parallel.h"
+#include "./round.h"
+#include "./store_bytes.h"
 #include "./table_tags.h"
 #include "./variable_length.h"
 
@@ -24,6 +29,9 @@ const int FLAG_ARG_1_AND_2_ARE_WORDS = 1 << 0;
 const int FLAG_WE_HAVE_INSTRUCTIONS = 1 << 8;
 const int FLAG_OVERLAP_SIMPLE_BITMAP = 1 << 0;
 
+// Fewer glyphs than this are not worth handing to a thread of their own.
+const int kMinGlyphsPerRange = 256;
+
 void WriteBytes(std::vector<uint8_t>* out, const uint8_t* data, size_t len) {
   if (len == 0) return;
   size_t offset = out->size();
@@ -31,144 +39,199 @@ void WriteBytes(std::vector<uint8_t>* out, const uint8_t* data, size_t len) {
   memcpy(&(*out)[offset], data, len);
 }
 
-void WriteBytes(std::vector<uint8_t>* out, const std::vector<uint8_t>& in) {
-  for (size_t i = 0; i < in.size(); ++i) {
-    out->push_back(in[i]);
-  }
-}
-
 void WriteUShort(std::vector<uint8_t>* out, int value) {
   out->push_back(value >> 8);
   out->push_back(value & 255);
 }
 
-void WriteLong(std::vector<uint8_t>* out, int value) {
-  out->push_back((value >> 24) & 255);
-  out->push_back((value >> 16) & 255);
-  out->push_back((value >> 8) & 255);
-  out->push_back(value & 255);
+// Makes room for n more bytes at the end of *stream and returns where they
+// start. The caller shrinks the stream back to what it wrote.
+uint8_t* Grow(std::vector<uint8_t>* stream, size_t n) {
+  size_t size = stream->size();
+  stream->resize(size + n);
+  return stream->data() + size;
 }
 
 // Glyf table preprocessing, based on
 // GlyfEncoder.java
 class GlyfEncoder {
  public:
-  explicit GlyfEncoder(int num_glyphs)
-      : n_glyphs_(num_glyphs) {
-    bbox_bitmap_.resize(((num_glyphs + 31) >> 5) << 2);
+  // Encodes into *streams, whose previous content is discarded.
+  GlyfEncoder(int num_glyphs, GlyfStreams* streams)
+      : streams_(streams), n_glyphs_(num_glyphs) {
+    streams_->n_contour.clear();
+    streams_->n_points.clear();
+    streams_->flag_byte.clear();
+    streams_->composite.clear();
+    streams_->bbox_bitmap.assign(((num_glyphs + 31) >> 5) << 2, 0);
+    streams_->bbox.clear();
+    streams_->glyph.clear();
+    streams_->instruction.clear();
+    streams_->overlap_bitmap.clear();
+  }
+
+  // Reserves room for encoding num_glyphs glyphs that take glyf_size bytes
+  // in 'glyf', so that the streams don't have to grow while encoding. In
+  // typical fonts the coordinates take about half of that, the flags and the
+  // instructions a fifth each.
+  void Reserve(int num_glyphs, size_t glyf_size) {
+    streams_->n_contour.reserve(2 * num_glyphs);
+    streams_->n_points.reserve(num_glyphs);
+    streams_->flag_byte.reserve(glyf_size / 4);
+    streams_->glyph.reserve(glyf_size / 2);
+    streams_->instruction.reserve(glyf_size / 4);
   }
 
   bool Encode(int glyph_id, const Glyph& glyph) {
     if (glyph.composite_data_size > 0) {
       WriteCompositeGlyph(glyph_id, glyph);
-    } else if (glyph.contours.size() > 0) {
+    } else if (glyph.num_contours() > 0) {
       WriteSimpleGlyph(glyph_id, glyph);
     } else {
-      WriteUShort(&n_contour_stream_, 0);
+      WriteUShort(&streams_->n_contour, 0);
     }
     return true;
   }
 
-  void GetTransformedGlyfBytes(std::vector<uint8_t>* result) {
-    WriteUShort(result, 0);  // Version
-    WriteUShort(result, overlap_bitmap_.empty()
-                            ? 0x00
-                            : FLAG_OVERLAP_SIMPLE_BITMAP);  // Flags
-    WriteUShort(result, n_glyphs_);
-    WriteUShort(result, 0);  // index_format, will be set later
-    WriteLong(result, n_contour_stream_.size());
-    WriteLong(result, n_points_stream_.size());
-    WriteLong(result, flag_byte_stream_.size());
-    WriteLong(result, glyph_stream_.size());
-    WriteLong(result, composite_stream_.size());
-    WriteLong(result, bbox_bitmap_.size() + bbox_stream_.size());
-    WriteLong(result, instruction_stream_.size());
-    WriteBytes(result, n_contour_stream_);
-    WriteBytes(result, n_points_stream_);
-    WriteBytes(result, flag_byte_stream_);
-    WriteBytes(result, glyph_stream_);
-    WriteBytes(result, composite_stream_);
-    WriteBytes(result, bbox_bitmap_);
-    WriteBytes(result, bbox_stream_);
-    WriteBytes(result, instruction_stream_);
-    if (!overlap_bitmap_.empty()) {
-      WriteBytes(result, overlap_bitmap_);
+  // Stores the transformed glyf table made of the glyphs of encoders, which
+  // encoded consecutive ranges of glyphs in order, to *result. Each stream
+  // is copied once, straight to its place in the table.
+  static void GetTransformedGlyfBytes(const std::vector<GlyfEncoder>& encoders,
+                                      std::vector<uint8_t>* result) {
+    const GlyfStreams& first = *encoders[0].streams_;
+    bool has_overlap_bitmap = false;
+    std::array<size_t, 7> sizes = {};
+    for (const GlyfEncoder& encoder : encoders) {
+      const GlyfStreams& streams = *encoder.streams_;
+      has_overlap_bitmap |= !streams.overlap_bitmap.empty();
+      sizes[0] += streams.n_contour.size();
+      sizes[1] += streams.n_points.size();
+      sizes[2] += streams.flag_byte.size();
+      sizes[3] += streams.glyph.size();
+      sizes[4] += streams.composite.size();
+      sizes[5] += streams.bbox.size();
+      sizes[6] += streams.instruction.size();
+    }
+    const size_t bbox_bitmap_size = first.bbox_bitmap.size();
+    const size_t overlap_bitmap_size =
+        has_overlap_bitmap ? (encoders[0].n_glyphs_ + 7) >> 3 : 0;
+    size_t total_size = 36 + bbox_bitmap_size + overlap_bitmap_size;
+    for (size_t size : sizes) {
+      total_size += size;
+    }
+    result->resize(total_size);
+    uint8_t* dst = result->data();
+    size_t offset = 0;
+    Store16(0, &offset, dst);  // Version
+    Store16(has_overlap_bitmap ? FLAG_OVERLAP_SIMPLE_BITMAP : 0x00, &offset,
+            dst);  // Flags
+    Store16(encoders[0].n_glyphs_, &offset, dst);
+    Store16(0, &offset, dst);  // index_format, will be set later
+    for (int i = 0; i < 7; ++i) {
+      StoreU32(sizes[i] + (i == 5 ? bbox_bitmap_size : 0), &offset, dst);
+    }
+
+    // The bitmaps of the ranges each have the bits of their own glyphs.
+    auto store_bitmap = [&](std::vector<uint8_t> GlyfStreams::*bitmap,
+                            size_t size) {
+      std::fill(dst + offset, dst + offset + size, 0);
+      for (const GlyfEncoder& encoder : encoders) {
+        const std::vector<uint8_t>& bits = encoder.streams_->*bitmap;
+        for (size_t i = 0; i < bits.size(); ++i) {
+          dst[offset + i] |= bits[i];
+        }
+      }
+      offset += size;
+    };
+    auto store_stream = [&](std::vector<uint8_t> GlyfStreams::*stream) {
+      for (const GlyfEncoder& encoder : encoders) {
+        const std::vector<uint8_t>& bytes = encoder.streams_->*stream;
+        StoreBytes(bytes.data(), bytes.size(), &offset, dst);
+      }
+    };
+    store_stream(&GlyfStreams::n_contour);
+    store_stream(&GlyfStreams::n_points);
+    store_stream(&GlyfStreams::flag_byte);
+    store_stream(&GlyfStreams::glyph);
+    store_stream(&GlyfStreams::composite);
+    store_bitmap(&GlyfStreams::bbox_bitmap, bbox_bitmap_size);
+    store_stream(&GlyfStreams::bbox);
+    store_stream(&GlyfStreams::instruction);
+    if (has_overlap_bitmap) {
+      store_bitmap(&GlyfStreams::overlap_bitmap, overlap_bitmap_size);
     }
   }
 
  private:
   void WriteInstructions(const Glyph& glyph) {
-    Write255UShort(&glyph_stream_, glyph.instructions_size);
-    WriteBytes(&instruction_stream_,
+    Write255UShort(&streams_->glyph, glyph.instructions_size);
+    WriteBytes(&streams_->instruction,
                glyph.instructions_data, glyph.instructions_size);
   }
 
   bool ShouldWriteSimpleGlyphBbox(const Glyph& glyph) {
-    if (glyph.contours.empty() || glyph.contours[0].empty()) {
+    if (glyph.points.size() == 0) {
       return glyph.x_min || glyph.y_min || glyph.x_max || glyph.y_max;
     }
 
-    int16_t x_min = glyph.contours[0][0].x;
-    int16_t y_min = glyph.contours[0][0].y;
-    int16_t x_max = x_min;
-    int16_t y_max = y_min;
-    for (const auto& contour : glyph.contours) {
-      for (const auto& point : contour) {
-        if (point.x < x_min) x_min = point.x;
-        if (point.x > x_max) x_max = point.x;
-        if (point.y < y_min) y_min = point.y;
-        if (point.y > y_max) y_max = point.y;
-      }
-    }
-
-    if (glyph.x_min != x_min)
-      return true;
-    if (glyph.y_min != y_min)
-      return true;
-    if (glyph.x_max != x_max)
-      return true;
-    if (glyph.y_max != y_max)
-      return true;
-
-    return false;
+    int16_t bbox[4];
+    ComputeBbox(glyph.points, bbox);
+    return glyph.x_min != bbox[0] || glyph.y_min != bbox[1] ||
+           glyph.x_max != bbox[2] || glyph.y_max != bbox[3];
   }
 
   void WriteSimpleGlyph(int glyph_id, const Glyph& glyph) {
     if (glyph.overlap_simple_flag_set) {
       EnsureOverlapBitmap();
-      overlap_bitmap_[glyph_id >> 3] |= 0x80 >> (glyph_id & 7);
+      streams_->overlap_bitmap[glyph_id >> 3] |= 0x80 >> (glyph_id & 7);
     }
-    int num_contours = glyph.contours.size();
-    WriteUShort(&n_contour_stream_, num_contours);
+    const GlyphPoints& points = glyph.points;
+    int num_contours = glyph.num_contours();
+    WriteUShort(&streams_->n_contour, num_contours);
     if (ShouldWriteSimpleGlyphBbox(glyph)) {
       WriteBbox(glyph_id, glyph);
     }
+
+    // The counts of the glyph bound what it adds to each stream, so the
+    // streams grow once per glyph and the points are stored directly.
+    std::vector<uint8_t>& n_points = streams_->n_points;
+    size_t n_points_size = n_points.size();
+    uint8_t* n_points_dst = Grow(&n_points, 3 * num_contours);
+    size_t n_points_offset = 0;
+    int last_end_point = -1;
     for (int i = 0; i < num_contours; i++) {
-      Write255UShort(&n_points_stream_, glyph.contours[i].size());
+      Store255UShort(points.end_points[i] - last_end_point, &n_points_offset,
+                     n_points_dst);
+      last_end_point = points.end_points[i];
     }
-    int lastX = 0;
-    int lastY = 0;
-    for (int i = 0; i < num_contours; i++) {
-      int num_points = glyph.contours[i].size();
-      for (int j = 0; j < num_points; j++) {
-        int x = glyph.contours[i][j].x;
-        int y = glyph.contours[i][j].y;
-        int dx = x - lastX;
-        int dy = y - lastY;
-        WriteTriplet(glyph.contours[i][j].on_curve, dx, dy);
-        lastX = x;
-        lastY = y;
-      }
+    n_points.resize(n_points_size + n_points_offset);
+
+    uint8_t* flag_dst = Grow(&streams_->flag_byte, points.size());
+    std::vector<uint8_t>& glyph_stream = streams_->glyph;
+    size_t glyph_size = glyph_stream.size();
+    uint8_t* glyph_dst = Grow(&glyph_stream, 4 * points.size());
+    uint8_t* glyph_end = glyph_dst;
+    int16_t lastX = 0;
+    int16_t lastY = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+      // The deltas are the ones in the font, where coordinates wrap around.
+      int16_t dx = static_cast<int16_t>(points.x[i] - lastX);
+      int16_t dy = static_cast<int16_t>(points.y[i] - lastY);
+      glyph_end += StoreTriplet(points.OnCurve(i), dx, dy, &flag_dst[i],
+                                glyph_end);
+      lastX = points.x[i];
+      lastY = points.y[i];
     }
+    glyph_stream.resize(glyph_size + (glyph_end - glyph_dst));
     if (num_contours > 0) {
       WriteInstructions(glyph);
     }
   }
 
   void WriteCompositeGlyph(int glyph_id, const Glyph& glyph) {
-    WriteUShort(&n_contour_stream_, -1);
+    WriteUShort(&streams_->n_contour, -1);
     WriteBbox(glyph_id, glyph);
-    WriteBytes(&composite_stream_,
+    WriteBytes(&streams_->composite,
                glyph.composite_data,
                glyph.composite_data_size);
     if (glyph.have_instructions) {
@@ -177,14 +240,22 @@ class GlyfEncoder {
   }
 
   void WriteBbox(int glyph_id, const Glyph& glyph) {
-    bbox_bitmap_[glyph_id >> 3] |= 0x80 >> (glyph_id & 7);
-    WriteUShort(&bbox_stream_, glyph.x_min);
-    WriteUShort(&bbox_stream_, glyph.y_min);
-    WriteUShort(&bbox_stream_, glyph.x_max);
-    WriteUShort(&bbox_stream_, glyph.y_max);
+    streams_->bbox_bitmap[glyph_id >> 3] |= 0x80 >> (glyph_id & 7);
+    uint8_t* dst = Grow(&streams_->bbox, 8);
+    size_t offset = 0;
+    Store16(glyph.x_min, &offset, dst);
+    Store16(glyph.y_min, &offset, dst);
+    Store16(glyph.x_max, &offset, dst);
+    Store16(glyph.y_max, &offset, dst);
   }
 
-  void WriteTriplet(bool on_curve, int x, int y) {
+  // Stores the flag of the point with deltas (x, y) to *flag and its
+  // coordinate bytes to glyph, and returns how many of those there are, at
+  // most 4. Points on a horizontal or vertical line take their own encodings;
+  // the other encodings only depend on the larger of the two deltas, so it
+  // picks one without a chain of comparisons.
+  static size_t StoreTriplet(bool on_curve, int x, int y, uint8_t* flag,
+                             uint8_t* glyph) {
     int abs_x = std::abs(x);
     int abs_y = std::abs(y);
     int on_curve_bit = on_curve ? 0 : 128;
@@ -192,63 +263,125 @@ class GlyfEncoder {
     int y_sign_bit = (y < 0) ? 0 : 1;
     int xy_sign_bits = x_sign_bit + 2 * y_sign_bit;
     if (x == 0 && abs_y < 1280) {
-      flag_byte_stream_.push_back(on_curve_bit +
-                                  ((abs_y & 0xf00) >> 7) + y_sign_bit);
-      glyph_stream_.push_back(abs_y & 0xff);
-    } else if (y == 0 && abs_x < 1280) {
-      flag_byte_stream_.push_back(on_curve_bit + 10 +
-                                  ((abs_x & 0xf00) >> 7) + x_sign_bit);
-      glyph_stream_.push_back(abs_x & 0xff);
-    } else if (abs_x < 65 && abs_y < 65) {
-      flag_byte_stream_.push_back(on_curve_bit + 20 +
-                                  ((abs_x - 1) & 0x30) +
-                                  (((abs_y - 1) & 0x30) >> 2) +
-                                  xy_sign_bits);
-      glyph_stream_.push_back((((abs_x - 1) & 0xf) << 4) | ((abs_y - 1) & 0xf));
-    } else if (abs_x < 769 && abs_y < 769) {
-      flag_byte_stream_.push_back(on_curve_bit + 84 +
-                                  12 * (((abs_x - 1) & 0x300) >> 8) +
-                                  (((abs_y - 1) & 0x300) >> 6) + xy_sign_bits);
-      glyph_stream_.push_back((abs_x - 1) & 0xff);
-      glyph_stream_.push_back((abs_y - 1) & 0xff);
-    } else if (abs_x < 4096 && abs_y < 4096) {
-      flag_byte_stream_.push_back(on_curve_bit + 120 + xy_sign_bits);
-      glyph_stream_.push_back(abs_x >> 4);
-      glyph_stream_.push_back(((abs_x & 0xf) << 4) | (abs_y >> 8));
-      glyph_stream_.push_back(abs_y & 0xff);
-    } else {
-      flag_byte_stream_.push_back(on_curve_bit + 124 + xy_sign_bits);
-      glyph_stream_.push_back(abs_x >> 8);
-      glyph_stream_.push_back(abs_x & 0xff);
-      glyph_stream_.push_back(abs_y >> 8);
-      glyph_stream_.push_back(abs_y & 0xff);
+      *flag = on_curve_bit + ((abs_y & 0xf00) >> 7) + y_sign_bit;
+      glyph[0] = abs_y & 0xff;
+      return 1;
+    }
+    if (y == 0 && abs_x < 1280) {
+      *flag = on_curve_bit + 10 + ((abs_x & 0xf00) >> 7) + x_sign_bit;
+      glyph[0] = abs_x & 0xff;
+      return 1;
+    }
+    int max_abs = std::max(abs_x, abs_y);
+    switch ((max_abs >= 65) + (max_abs >= 769) + (max_abs >= 4096)) {
+      case 0:
+        *flag = on_curve_bit + 20 + ((abs_x - 1) & 0x30) +
+                (((abs_y - 1) & 0x30) >> 2) + xy_sign_bits;
+        glyph[0] = (((abs_x - 1) & 0xf) << 4) | ((abs_y - 1) & 0xf);
+        return 1;
+      case 1:
+        *flag = on_curve_bit + 84 + 12 * (((abs_x - 1) & 0x300) >> 8) +
+                (((abs_y - 1) & 0x300) >> 6) + xy_sign_bits;
+        glyph[0] = (abs_x - 1) & 0xff;
+        glyph[1] = (abs_y - 1) & 0xff;
+        return 2;
+      case 2:
+        *flag = on_curve_bit + 120 + xy_sign_bits;
+        glyph[0] = abs_x >> 4;
+        glyph[1] = ((abs_x & 0xf) << 4) | (abs_y >> 8);
+        glyph[2] = abs_y & 0xff;
+        return 3;
+      default:
+        *flag = on_curve_bit + 124 + xy_sign_bits;
+        glyph[0] = abs_x >> 8;
+        glyph[1] = abs_x & 0xff;
+        glyph[2] = abs_y >> 8;
+        glyph[3] = abs_y & 0xff;
+        return 4;
     }
   }
 
   void EnsureOverlapBitmap() {
-    if (overlap_bitmap_.empty()) {
-      overlap_bitmap_.resize((n_glyphs_ + 7) >> 3);
+    if (streams_->overlap_bitmap.empty()) {
+      streams_->overlap_bitmap.resize((n_glyphs_ + 7) >> 3);
     }
   }
 
-  std::vector<uint8_t> n_contour_stream_;
-  std::vector<uint8_t> n_points_stream_;
-  std::vector<uint8_t> flag_byte_stream_;
-  std::vector<uint8_t> composite_stream_;
-  std::vector<uint8_t> bbox_bitmap_;
-  std::vector<uint8_t> bbox_stream_;
-  std::vector<uint8_t> glyph_stream_;
-  std::vector<uint8_t> instruction_stream_;
-  std::vector<uint8_t> overlap_bitmap_;
+  GlyfStreams* streams_;
   int n_glyphs_;
 };
 
-}  // namespace
+// Appends the glyph in normalized form, padded to 4 bytes, to the first *size
+// bytes of *glyf and adds its length to *size. *glyf is grown as needed.
+bool AppendNormalizedGlyph(const Glyph& glyph, std::vector<uint8_t>* glyf,
+                           size_t* size) {
+  // The flags and the coordinates take at most 5 bytes per point.
+  size_t max_size = 12 + 2 * glyph.num_contours() + 5 * glyph.points.size() +
+      glyph.composite_data_size + glyph.instructions_size + 3;
+  if (glyf->size() - *size < max_size) {
+    glyf->resize(std::max(*size + max_size, 2 * glyf->size()));
+  }
+  size_t glyph_size = glyf->size() - *size;
+  if (!StoreGlyph(glyph, glyf->data() + *size, &glyph_size)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  size_t padded_size = Round4(glyph_size);
+  std::fill(glyf->begin() + *size + glyph_size,
+            glyf->begin() + *size + padded_size, 0);
+  *size += padded_size;
+  return true;
+}
 
-bool TransformGlyfAndLocaTables(Font* font) {
-  // no transform for CFF
-  const Font::Table* glyf_table = font->FindTable(kGlyfTableTag);
-  const Font::Table* loca_table = font->FindTable(kLocaTableTag);
+// Encodes glyphs [begin, end) of the font. If normalized_glyf is not NULL, the
+// glyphs are also stored there in normalized form, each starting at
+// normalized_offsets[i] from the first one.
+bool EncodeGlyphs(const Font& font, int begin, int end,
+                  GlyfEncoder* encoder, std::vector<uint8_t>* normalized_glyf,
+                  uint32_t* normalized_offsets) {
+  Glyph glyph;
+  size_t normalized_size = 0;
+  if (normalized_glyf != NULL) {
+    // Like NormalizeGlyphs, start from the share of the glyf table that the
+    // glyphs take, with room for them to grow a little.
+    const Font::Table* glyf_table = font.FindTable(kGlyfTableTag);
+    int num_glyphs = NumGlyphs(font);
+    normalized_glyf->resize(
+        1.1 * glyf_table->length * (end - begin) / std::max(num_glyphs, 1) +
+        2 * (end - begin));
+  }
+  for (int i = begin; i < end; ++i) {
+    const uint8_t* glyph_data;
+    size_t glyph_size;
+    if (!GetGlyphData(font, i, &glyph_data, &glyph_size)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (!font.IsGlyphRetained(i)) {
+      glyph_size = 0;
+    }
+    if (!ReadGlyph(glyph_data, glyph_size, &glyph)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    encoder->Encode(i, glyph);
+    if (normalized_glyf != NULL) {
+      if (!AppendNormalizedGlyph(glyph, normalized_glyf, &normalized_size) ||
+          normalized_size > std::numeric_limits<uint32_t>::max()) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      normalized_offsets[i] = normalized_size;
+    }
+  }
+  if (normalized_glyf != NULL) {
+    normalized_glyf->resize(normalized_size);
+  }
+  return true;
+}
+
+// Checks that the font has both glyf and loca or neither, and sets
+// *transform if they are there and not shared with another font.
+bool ShouldTransformGlyfAndLoca(const Font& font, bool* transform) {
+  const Font::Table* glyf_table = font.FindTable(kGlyfTableTag);
+  const Font::Table* loca_table = font.FindTable(kLocaTableTag);
+  *transform = false;
 
   // If you don't have glyf/loca this transform isn't very interesting
   if (loca_table == NULL && glyf_table == NULL) {
@@ -262,31 +395,113 @@ bool TransformGlyfAndLocaTables(Font* font) {
   if (loca_table->IsReused() != glyf_table->IsReused()) {
     return FONT_COMPRESSION_FAILURE();
   }
-  if (loca_table->IsReused()) {
-    return true;
-  }
+  *transform = !loca_table->IsReused();
+  return true;
+}
 
-  Font::Table* transformed_glyf = &font->tables[kGlyfTableTag ^ 0x80808080];
-  Font::Table* transformed_loca = &font->tables[kLocaTableTag ^ 0x80808080];
+// Encodes the glyphs of the font in consecutive ranges, on up to num_threads
+// threads, and adds the transformed glyf and loca tables made of them. If
+// normalize is set, the glyf and loca tables are also normalized in the same
+// pass. The ranges are joined in order, so the result doesn't depend on
+// num_threads.
+bool EncodeGlyfAndLoca(Font* font, bool normalize, int num_threads,
+                       GlyfTransformBuffers* buffers) {
+  Font::Table* head_table = font->FindTable(kHeadTableTag);
+  if (head_table == NULL || head_table->length < 52) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  Font::Table* glyf_table = font->FindTable(kGlyfTableTag);
+  Font::Table* loca_table = font->FindTable(kLocaTableTag);
 
   int num_glyphs = NumGlyphs(*font);
-  GlyfEncoder encoder(num_glyphs);
-  for (int i = 0; i < num_glyphs; ++i) {
-    Glyph glyph;
-    const uint8_t* glyph_data;
-    size_t glyph_size;
-    if (!GetGlyphData(*font, i, &glyph_data, &glyph_size) ||
-        (glyph_size > 0 && !ReadGlyph(glyph_data, glyph_size, &glyph))) {
-      return FONT_COMPRESSION_FAILURE();
-    }
-    encoder.Encode(i, glyph);
+  // Encode consecutive ranges of glyphs separately and join the streams.
+  int num_ranges = std::max(1, std::min(num_threads,
+                                        num_glyphs / kMinGlyphsPerRange));
+  if (buffers->ranges.size() < static_cast<size_t>(num_ranges)) {
+    buffers->ranges.resize(num_ranges);
+  }
+  std::vector<GlyfEncoder> encoders;
+  encoders.reserve(num_ranges);
+  auto range_begin = [&](size_t range) {
+    return static_cast<int>(static_cast<int64_t>(num_glyphs) * range /
+                            num_ranges);
+  };
+  for (int i = 0; i < num_ranges; ++i) {
+    encoders.emplace_back(num_glyphs, &buffers->ranges[i]);
+    int range_glyphs = range_begin(i + 1) - range_begin(i);
+    encoders.back().Reserve(range_glyphs, static_cast<uint64_t>(
+        glyf_table->length) * range_glyphs / std::max(num_glyphs, 1));
   }
-  encoder.GetTransformedGlyfBytes(&transformed_glyf->buffer);
 
-  const Font::Table* head_table = font->FindTable(kHeadTableTag);
-  if (head_table == NULL || head_table->length < 52) {
+  // The first range writes its normalized glyphs straight to the glyf table.
+  std::vector<uint32_t>& offsets = buffers->normalized_offsets;
+  if (normalize) {
+    if (buffers->normalized_glyf.size() < static_cast<size_t>(num_ranges)) {
+      buffers->normalized_glyf.resize(num_ranges);
+    }
+    glyf_table->buffer.clear();
+    for (int i = 1; i < num_ranges; ++i) {
+      buffers->normalized_glyf[i].clear();
+    }
+    offsets.resize(num_glyphs + 1);
+    offsets[0] = 0;
+  }
+  if (!ParallelFor(num_ranges, num_threads, [&](size_t range) {
+        std::vector<uint8_t>* normalized_glyf = NULL;
+        if (normalize) {
+          normalized_glyf = range == 0 ? &glyf_table->buffer
+                                       : &buffers->normalized_glyf[range];
+        }
+        return EncodeGlyphs(*font, range_begin(range), range_begin(range + 1),
+                            &encoders[range], normalized_glyf,
+                            normalize ? &offsets[1] : NULL);
+      })) {
     return FONT_COMPRESSION_FAILURE();
   }
+
+  if (normalize) {
+    // Each range has offsets from its own start; move them after the ranges
+    // before it.
+    std::vector<uint8_t>& glyf = glyf_table->buffer;
+    for (int range = 1; range < num_ranges; ++range) {
+      const std::vector<uint8_t>& range_glyf = buffers->normalized_glyf[range];
+      if (glyf.size() + range_glyf.size() >
+          std::numeric_limits<uint32_t>::max()) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      for (int i = range_begin(range); i < range_begin(range + 1); ++i) {
+        offsets[i + 1] += glyf.size();
+      }
+      glyf.insert(glyf.end(), range_glyf.begin(), range_glyf.end());
+    }
+    glyf_table->data = glyf.empty() ? NULL : glyf.data();
+    glyf_table->length = glyf.size();
+
+    // Short offsets only reach 2^17 bytes, beyond that loca goes long.
+    int index_fmt = head_table->data[51];
+    if (index_fmt == 0 && glyf.size() >= (1UL << 17)) {
+      index_fmt = 1;
+      head_table->buffer[51] = 1;
+    }
+    int entry_size = index_fmt == 0 ? 2 : 4;
+    loca_table->buffer.assign(Round4(num_glyphs + 1) * entry_size, 0);
+    loca_table->length = (num_glyphs + 1) * entry_size;
+    size_t loca_offset = 0;
+    for (uint32_t offset : offsets) {
+      if (index_fmt == 0) {
+        Store16(offset >> 1, &loca_offset, loca_table->buffer.data());
+      } else {
+        StoreU32(offset, &loca_offset, loca_table->buffer.data());
+      }
+    }
+    loca_table->data = loca_table->buffer.data();
+  }
+
+  Font::Table* transformed_glyf = &font->tables[kGlyfTableTag ^ 0x80808080];
+  Font::Table* transformed_loca = &font->tables[kLocaTableTag ^ 0x80808080];
+  transformed_glyf->buffer.swap(buffers->glyf);
+  transformed_glyf->buffer.clear();
+  GlyfEncoder::GetTransformedGlyfBytes(encoders, &transformed_glyf->buffer);
   transformed_glyf->buffer[7] = head_table->data[51];  // index_format
 
   transformed_glyf->tag = kGlyfTableTag ^ 0x80808080;
@@ -300,6 +515,32 @@ bool TransformGlyfAndLocaTables(Font* font) {
   return true;
 }
 
+}  // namespace
+
+bool TransformGlyfAndLocaTables(Font* font) {
+  GlyfTransformBuffers buffers;
+  return TransformGlyfAndLocaTables(font, 1, &buffers);
+}
+
+bool TransformGlyfAndLocaTables(Font* font, int num_threads,
+                                GlyfTransformBuffers* buffers) {
+  // no transform for CFF
+  bool transform;
+  if (!ShouldTransformGlyfAndLoca(*font, &transform)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  return !transform || EncodeGlyfAndLoca(font, false, num_threads, buffers);
+}
+
+bool NormalizeAndTransformGlyfAndLocaTables(Font* font, int num_threads,
+                                            GlyfTransformBuffers* buffers) {
+  bool transform;
+  if (!ShouldTransformGlyfAndLoca(*font, &transform)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  return !transform || EncodeGlyfAndLoca(font, true, num_threads, buffers);
+}
+
 // See https://www.microsoft.com/typography/otspec/hmtx.htm
 // See WOFF2 spec, 5.4. Transformed hmtx table format
 bool TransformHmtxTable(Font* font) {
@@ -340,12 +581,12 @@ bool TransformHmtxTable(Font* font) {
   bool remove_monospace_lsb = (num_glyphs - num_hmetrics) > 0;
 
   Buffer hmtx_buf(hmtx_table->data, hmtx_table->length);
+  Glyph glyph;
   for (int i = 0; i < num_glyphs; i++) {
-    Glyph glyph;
     const uint8_t* glyph_data;
     size_t glyph_size;
     if (!GetGlyphData(*font, i, &glyph_data, &glyph_size) ||
-        (glyph_size > 0 && !ReadGlyph(glyph_data, glyph_size, &glyph))) {
+        !ReadGlyph(glyph_data, glyph_size, &glyph)) {
       return FONT_COMPRESSION_FAILURE();
     }
 
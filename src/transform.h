@@ -9,14 +9,53 @@
 #ifndef WOFF2_TRANSFORM_H_
 #define WOFF2_TRANSFORM_H_
 
+#include <vector>
+
 #include "./font.h"
 
 namespace woff2 {
 
+// The streams a transformed glyf table is built from.
+struct GlyfStreams {
+  std::vector<uint8_t> n_contour;
+  std::vector<uint8_t> n_points;
+  std::vector<uint8_t> flag_byte;
+  std::vector<uint8_t> composite;
+  std::vector<uint8_t> bbox_bitmap;
+  std::vector<uint8_t> bbox;
+  std::vector<uint8_t> glyph;
+  std::vector<uint8_t> instruction;
+  std::vector<uint8_t> overlap_bitmap;
+};
+
+// Memory for transforming the glyf table of a font. Passing the same buffers
+// to successive transforms lets them reuse it.
+struct GlyfTransformBuffers {
+  // Streams for each range of glyphs that is encoded on its own.
+  std::vector<GlyfStreams> ranges;
+  // When normalizing too, the normalized glyphs of each range but the first,
+  // which go straight to the glyf table, and the new loca offsets.
+  std::vector<std::vector<uint8_t>> normalized_glyf;
+  std::vector<uint32_t> normalized_offsets;
+  // Handed to the transformed glyf table as its buffer.
+  std::vector<uint8_t> glyf;
+};
+
 // Adds the transformed versions of the glyf and loca tables to the font. The
 // transformed loca table has zero length. The tag of the transformed tables is
 // derived from the original tag by flipping the MSBs of every byte.
 bool TransformGlyfAndLocaTables(Font* font);
+// Same, encoding ranges of glyphs on up to num_threads threads with memory
+// from *buffers.
+bool TransformGlyfAndLocaTables(Font* font, int num_threads,
+                                GlyfTransformBuffers* buffers);
+
+// Normalizes the glyf and loca tables of the font as NormalizeGlyphs() does
+// and adds their transformed versions as TransformGlyfAndLocaTables() does,
+// reading each glyph only once for both. The rest of the font must have been
+// normalized up to NormalizeGlyphs(), which this replaces.
+bool NormalizeAndTransformGlyfAndLocaTables(Font* font, int num_threads,
+                                            GlyfTransformBuffers* buffers);
 
 // Apply transformation to hmtx table if applicable for this font.
 bool TransformHmtxTable(Font* font);
@@ -39,10 +39,18 @@ void Write255UShort(std::vector<uint8_t>* out, int value) {
 }
 
 void Store255UShort(int val, size_t* offset, uint8_t* dst) {
-  std::vector<uint8_t> packed;
-  Write255UShort(&packed, val);
-  for (uint8_t packed_byte : packed) {
-    dst[(*offset)++] = packed_byte;
+  if (val < 253) {
+    dst[(*offset)++] = val;
+  } else if (val < 506) {
+    dst[(*offset)++] = 255;
+    dst[(*offset)++] = val - 253;
+  } else if (val < 762) {
+    dst[(*offset)++] = 254;
+    dst[(*offset)++] = val - 506;
+  } else {
+    dst[(*offset)++] = 253;
+    dst[(*offset)++] = val >> 8;
+    dst[(*offset)++] = val & 0xff;
   }
 }
 
@@ -0,0 +1,423 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* A commandline tool for measuring encode and decode throughput over a
+   corpus of fonts. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "./file.h"
+#include "./font.h"
+#include <woff2/decode.h>
+#include <woff2/encode.h>
+#include <woff2/output.h>
+#include <woff2/stats.h>
+
+// Every C++ allocation goes through these so that the peak amount of memory
+// held during a run can be reported. Brotli allocates with malloc, which is
+// not counted.
+namespace {
+
+std::atomic<size_t> g_allocated(0);
+std::atomic<size_t> g_peak_allocated(0);
+
+// Keeps the payload aligned for any type, like the allocation itself.
+const size_t kAllocationHeader = alignof(std::max_align_t);
+
+void* CountedAlloc(size_t n) {
+  void* p = malloc(n + kAllocationHeader);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  *static_cast<size_t*>(p) = n;
+  size_t allocated = g_allocated.fetch_add(n) + n;
+  size_t peak = g_peak_allocated.load();
+  while (allocated > peak &&
+         !g_peak_allocated.compare_exchange_weak(peak, allocated)) {
+  }
+  return static_cast<char*>(p) + kAllocationHeader;
+}
+
+void CountedFree(void* p) {
+  if (p == NULL) {
+    return;
+  }
+  void* block = static_cast<char*>(p) - kAllocationHeader;
+  g_allocated.fetch_sub(*static_cast<size_t*>(block));
+  free(block);
+}
+
+}  // namespace
+
+void* operator new(size_t n) { return CountedAlloc(n); }
+void* operator new[](size_t n) { return CountedAlloc(n); }
+void operator delete(void* p) noexcept { CountedFree(p); }
+void operator delete[](void* p) noexcept { CountedFree(p); }
+void operator delete(void* p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* p, size_t) noexcept { CountedFree(p); }
+
+namespace {
+
+struct Options {
+  int iterations = 20;
+  int warmup = 2;
+  int quality = 11;
+  int threads = 1;
+  bool decode = true;
+  bool encode = true;
+  bool phases = false;
+};
+
+const char* const kPhaseNames[] = {
+  "header", "brotli", "glyf", "hmtx", "tables", "checksum", "output",
+  "normalize",
+};
+const int kNumPhases = sizeof(kPhaseNames) / sizeof(kPhaseNames[0]);
+
+// Adds up the phase times of every conversion it is installed in.
+class PhaseTimes : public woff2::WOFF2Stats {
+ public:
+  PhaseTimes() : seconds_() {}
+
+  void OnPhase(woff2::WOFF2Phase phase, double seconds) override {
+    seconds_[static_cast<int>(phase)] += seconds;
+  }
+
+  void Print(const char* mode) const {
+    double total = 0;
+    for (double seconds : seconds_) {
+      total += seconds;
+    }
+    if (total <= 0) {
+      return;
+    }
+    printf("%s phases:", mode);
+    for (int i = 0; i < kNumPhases; ++i) {
+      if (seconds_[i] > 0) {
+        printf(" %s %.1f%%", kPhaseNames[i], 100 * seconds_[i] / total);
+      }
+    }
+    printf("\n");
+  }
+
+ private:
+  double seconds_[kNumPhases];
+};
+
+// A font in both of its forms.
+struct Sample {
+  std::string name;
+  std::string ttf;
+  std::string woff2;
+  int num_glyphs;
+};
+
+struct Result {
+  double seconds;  // total of the timed iterations
+  double p50;
+  double p99;
+  size_t peak;  // most memory allocated at once by one iteration
+};
+
+bool ParseInt(const char* arg, const char* name, int min, int* value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  char* end;
+  long v = strtol(arg + len + 1, &end, 10);
+  if (*end != '\0' || v < min || v > 1000000) {
+    fprintf(stderr, "Invalid value for %s: %s\n", name, arg + len + 1);
+    exit(1);
+  }
+  *value = v;
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr,
+      "Usage: woff2_bench [options] <directory or font file>...\n"
+      "Encodes each .ttf/.otf/.ttc and decodes each .woff2; all other\n"
+      "files are skipped. MB/s counts bytes of the uncompressed font.\n"
+      "  --iterations=N  timed runs per font (default 20)\n"
+      "  --warmup=N      untimed runs per font first (default 2)\n"
+      "  --quality=Q     Brotli quality used to encode (default 11)\n"
+      "  --threads=N     num_threads for both directions (default 1)\n"
+      "  --phases        break the time down by phase; this makes the\n"
+      "                  conversions themselves a little slower\n"
+      "  --decode-only\n"
+      "  --encode-only\n");
+}
+
+std::string Extension(const std::string& path) {
+  std::string ext = std::filesystem::path(path).extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext;
+}
+
+void CollectFiles(const std::string& arg, std::vector<std::string>* files) {
+  std::error_code ec;
+  if (!std::filesystem::is_directory(arg, ec)) {
+    files->push_back(arg);
+    return;
+  }
+  std::vector<std::string> entries;
+  for (const auto& entry : std::filesystem::directory_iterator(arg, ec)) {
+    if (entry.is_regular_file(ec)) {
+      entries.push_back(entry.path().string());
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  files->insert(files->end(), entries.begin(), entries.end());
+}
+
+int CountGlyphs(const std::string& ttf) {
+  woff2::FontCollection collection;
+  if (!woff2::ReadFontCollection(
+          reinterpret_cast<const uint8_t*>(ttf.data()), ttf.size(),
+          &collection)) {
+    return 0;
+  }
+  int num_glyphs = 0;
+  for (const woff2::Font& font : collection.fonts) {
+    num_glyphs += std::max(0, woff2::NumGlyphs(font));
+  }
+  return num_glyphs;
+}
+
+bool Encode(const std::string& ttf, const woff2::WOFF2Params& params,
+            std::string* woff2) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(ttf.data());
+  size_t length = woff2::MaxWOFF2CompressedSize(data, ttf.size());
+  woff2->resize(length);
+  if (!woff2::ConvertTTFToWOFF2(data, ttf.size(),
+          reinterpret_cast<uint8_t*>(&(*woff2)[0]), &length, params)) {
+    return false;
+  }
+  woff2->resize(length);
+  return true;
+}
+
+bool Decode(const std::string& woff2, const woff2::WOFF2DecodeParams& params,
+            std::string* ttf) {
+  ttf->clear();
+  woff2::WOFF2StringOut out(ttf);
+  // Large collections decode to more than the default limit.
+  out.SetMaxSize(std::numeric_limits<size_t>::max());
+  return woff2::ConvertWOFF2ToTTF(
+      reinterpret_cast<const uint8_t*>(woff2.data()), woff2.size(), &out,
+      params);
+}
+
+// Loads path and produces the other form of the font. Returns false if the
+// file is not a font, or can't be converted.
+bool LoadSample(const std::string& path, const Options& options,
+                Sample* sample) {
+  std::string ext = Extension(path);
+  bool is_woff2 = ext == ".woff2";
+  if (!is_woff2 && ext != ".ttf" && ext != ".otf" && ext != ".ttc") {
+    return false;
+  }
+  sample->name = std::filesystem::path(path).filename().string();
+  std::string content = woff2::GetFileContent(path);
+  bool ok;
+  if (is_woff2) {
+    sample->woff2 = content;
+    ok = Decode(sample->woff2, woff2::WOFF2DecodeParams(), &sample->ttf);
+  } else {
+    sample->ttf = content;
+    woff2::WOFF2Params params;
+    params.brotli_quality = options.quality;
+    ok = Encode(sample->ttf, params, &sample->woff2);
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: could not be %s, skipped.\n", sample->name.c_str(),
+            is_woff2 ? "decoded" : "encoded");
+    return false;
+  }
+  sample->num_glyphs = CountGlyphs(sample->ttf);
+  return true;
+}
+
+// Runs fn warmup times untimed, then iterations times timed.
+template <typename Fn>
+bool Measure(const Options& options, Fn fn, Result* result) {
+  for (int i = 0; i < options.warmup; ++i) {
+    if (!fn()) {
+      return false;
+    }
+  }
+  std::vector<double> times;
+  result->seconds = 0;
+  result->peak = 0;
+  for (int i = 0; i < options.iterations; ++i) {
+    size_t base = g_allocated.load();
+    g_peak_allocated.store(base);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = fn();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (!ok) {
+      return false;
+    }
+    times.push_back(elapsed.count());
+    result->seconds += elapsed.count();
+    result->peak = std::max(result->peak, g_peak_allocated.load() - base);
+  }
+  std::sort(times.begin(), times.end());
+  // Nearest rank percentiles.
+  auto percentile = [&times](double p) {
+    size_t rank = static_cast<size_t>(p * times.size() + 0.999999);
+    return times[std::clamp<size_t>(rank, 1, times.size()) - 1];
+  };
+  result->p50 = percentile(0.50);
+  result->p99 = percentile(0.99);
+  return true;
+}
+
+void PrintHeader() {
+  printf("%-6s %-40s %9s %11s %9s %9s %9s\n", "mode", "font", "MB/s",
+         "glyphs/s", "p50 ms", "p99 ms", "peak KB");
+}
+
+void PrintResult(const char* mode, const std::string& name, size_t bytes,
+                 int num_glyphs, int iterations, const Result& result) {
+  printf("%-6s %-40s %9.2f %11.0f %9.3f %9.3f %9zu\n", mode, name.c_str(),
+         bytes * iterations / result.seconds / 1e6,
+         num_glyphs * iterations / result.seconds, result.p50 * 1e3,
+         result.p99 * 1e3, (result.peak + 1023) / 1024);
+}
+
+// Sums over the corpus, for the closing summary.
+struct Totals {
+  double seconds = 0;
+  size_t bytes = 0;
+  size_t glyphs = 0;
+  size_t peak = 0;
+};
+
+void Accumulate(const Sample& sample, const Result& result, Totals* totals) {
+  totals->seconds += result.seconds;
+  totals->bytes += sample.ttf.size();
+  totals->glyphs += sample.num_glyphs;
+  totals->peak = std::max(totals->peak, result.peak);
+}
+
+void PrintTotals(const char* mode, const Totals& totals, int iterations) {
+  if (totals.seconds <= 0) {
+    return;
+  }
+  printf("%-6s %-40s %9.2f %11.0f %9s %9s %9zu\n", mode, "(all)",
+         totals.bytes * iterations / totals.seconds / 1e6,
+         totals.glyphs * iterations / totals.seconds, "", "",
+         (totals.peak + 1023) / 1024);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (ParseInt(arg, "--iterations", 1, &options.iterations) ||
+        ParseInt(arg, "--warmup", 0, &options.warmup) ||
+        ParseInt(arg, "--quality", 0, &options.quality) ||
+        ParseInt(arg, "--threads", 1, &options.threads)) {
+      continue;
+    }
+    if (strcmp(arg, "--decode-only") == 0) {
+      options.encode = false;
+    } else if (strcmp(arg, "--encode-only") == 0) {
+      options.decode = false;
+    } else if (strcmp(arg, "--phases") == 0) {
+      options.phases = true;
+    } else if (arg[0] == '-') {
+      Usage();
+      return 1;
+    } else {
+      CollectFiles(arg, &files);
+    }
+  }
+  if (files.empty() || (!options.encode && !options.decode)) {
+    Usage();
+    return 1;
+  }
+
+  woff2::WOFF2Params encode_params;
+  encode_params.brotli_quality = options.quality;
+  encode_params.num_threads = options.threads;
+  woff2::WOFF2DecodeParams decode_params;
+  decode_params.num_threads = options.threads;
+  PhaseTimes encode_phases;
+  PhaseTimes decode_phases;
+  if (options.phases) {
+    encode_params.stats = &encode_phases;
+    decode_params.stats = &decode_phases;
+  }
+
+  PrintHeader();
+  Totals decode_totals;
+  Totals encode_totals;
+  bool ok = true;
+  for (const std::string& file : files) {
+    Sample sample;
+    if (!LoadSample(file, options, &sample)) {
+      continue;
+    }
+    Result result;
+    if (options.decode) {
+      std::string ttf;
+      ttf.reserve(sample.ttf.size());
+      if (Measure(options, [&]() {
+            return Decode(sample.woff2, decode_params, &ttf);
+          }, &result)) {
+        PrintResult("decode", sample.name, sample.ttf.size(),
+                    sample.num_glyphs, options.iterations, result);
+        Accumulate(sample, result, &decode_totals);
+      } else {
+        fprintf(stderr, "%s: decode failed.\n", sample.name.c_str());
+        ok = false;
+      }
+    }
+    if (options.encode) {
+      std::string woff2;
+      if (Measure(options, [&]() {
+            return Encode(sample.ttf, encode_params, &woff2);
+          }, &result)) {
+        PrintResult("encode", sample.name, sample.ttf.size(),
+                    sample.num_glyphs, options.iterations, result);
+        Accumulate(sample, result, &encode_totals);
+      } else {
+        fprintf(stderr, "%s: encode failed.\n", sample.name.c_str());
+        ok = false;
+      }
+    }
+  }
+  PrintTotals("decode", decode_totals, options.iterations);
+  PrintTotals("encode", encode_totals, options.iterations);
+  decode_phases.Print("decode");
+  encode_phases.Print("encode");
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    printf("max resident set: %ld KB\n", usage.ru_maxrss);
+  }
+  return ok ? 0 : 1;
+}
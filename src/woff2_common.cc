@@ -7,27 +7,58 @@
 /* Helpers common across multiple parts of woff2 */
 
 #include <algorithm>
+#include <cstring>
 #include <span>
 
 #include "./woff2_common.h"
 
 #include "./port.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WOFF2_SUM_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled in through a target attribute and only used on CPUs that
+// report it, so no compiler flags are required.
+#if defined(WOFF2_SUM_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define WOFF2_SUM_AVX2
+#include <immintrin.h>
+#endif
+
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && \
+    defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define WOFF2_SUM_NEON
+#include <arm_neon.h>
+#endif
+
 namespace woff2 {
 
-uint32_t ComputeULongSum(std::span<const uint8_t> buf) {
+namespace {
+
+// Checksum kernels sum the big-endian words of src[0, n). If kCopy is set,
+// they also copy the bytes to dst while they are loaded.
+typedef uint32_t (*SumFunction)(const uint8_t* src, uint8_t* dst, size_t n);
+
+template <bool kCopy>
+uint32_t SumScalar(const uint8_t* src, uint8_t* dst, size_t n) {
+  if (kCopy && n > 0) {
+    std::memcpy(dst, src, n);
+  }
   uint32_t checksum = 0;
-  size_t aligned_size = buf.size() & ~3;
+  size_t aligned_size = n & ~3;
   for (size_t i = 0; i < aligned_size; i += 4) {
     checksum +=
-        (buf[i] << 24) | (buf[i + 1] << 16) | (buf[i + 2] << 8) | buf[i + 3];
+        (src[i] << 24) | (src[i + 1] << 16) | (src[i + 2] << 8) | src[i + 3];
   }
 
   // treat size not aligned on 4 as if it were padded to 4 with 0's
-  if (buf.size() != aligned_size) {
+  if (n != aligned_size) {
     uint32_t v = 0;
-    for (size_t i = aligned_size; i < buf.size(); ++i) {
-      v |= buf[i] << (24 - 8 * (i & 3));
+    for (size_t i = aligned_size; i < n; ++i) {
+      v |= src[i] << (24 - 8 * (i & 3));
     }
     checksum += v;
   }
@@ -35,6 +66,120 @@ uint32_t ComputeULongSum(std::span<const uint8_t> buf) {
   return checksum;
 }
 
+#ifdef WOFF2_SUM_SSE2
+// Lane-wise sums wrap around just like the scalar sum, so the four lanes can
+// be added up at the end.
+inline uint32_t HorizontalSum(__m128i sum) {
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+}
+
+template <bool kCopy>
+uint32_t SumSse2(const uint8_t* src, uint8_t* dst, size_t n) {
+  __m128i sum = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    if (kCopy) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+    // SSE2 has no byte shuffle: swap the bytes of each 16-bit half, then the
+    // halves of each 32-bit word.
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    sum = _mm_add_epi32(sum, v);
+  }
+  return HorizontalSum(sum) +
+      SumScalar<kCopy>(src + i, kCopy ? dst + i : NULL, n - i);
+}
+#endif  // WOFF2_SUM_SSE2
+
+#ifdef WOFF2_SUM_AVX2
+template <bool kCopy>
+__attribute__((target("avx2")))
+uint32_t SumAvx2(const uint8_t* src, uint8_t* dst, size_t n) {
+  const __m256i bswap = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  // Two accumulators keep the adds of consecutive blocks independent.
+  __m256i sum0 = _mm256_setzero_si256();
+  __m256i sum1 = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i v1 =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+    if (kCopy) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v0);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), v1);
+    }
+    sum0 = _mm256_add_epi32(sum0, _mm256_shuffle_epi8(v0, bswap));
+    sum1 = _mm256_add_epi32(sum1, _mm256_shuffle_epi8(v1, bswap));
+  }
+  __m256i sum = _mm256_add_epi32(sum0, sum1);
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  // Leave the short tail to the SSE2 kernel; it needs no AVX state.
+  return HorizontalSum(half) +
+      SumSse2<kCopy>(src + i, kCopy ? dst + i : NULL, n - i);
+}
+#endif  // WOFF2_SUM_AVX2
+
+#ifdef WOFF2_SUM_NEON
+template <bool kCopy>
+uint32_t SumNeon(const uint8_t* src, uint8_t* dst, size_t n) {
+  uint32x4_t sum = vdupq_n_u32(0);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t v = vld1q_u8(src + i);
+    if (kCopy) {
+      vst1q_u8(dst + i, v);
+    }
+    sum = vaddq_u32(sum, vreinterpretq_u32_u8(vrev32q_u8(v)));
+  }
+  uint32x2_t half = vadd_u32(vget_low_u32(sum), vget_high_u32(sum));
+  return vget_lane_u32(vpadd_u32(half, half), 0) +
+      SumScalar<kCopy>(src + i, kCopy ? dst + i : NULL, n - i);
+}
+#endif  // WOFF2_SUM_NEON
+
+struct SumFunctions {
+  SumFunction sum;
+  SumFunction copy_and_sum;
+};
+
+SumFunctions SelectSumFunctions() {
+#if defined(WOFF2_SUM_AVX2)
+  if (__builtin_cpu_supports("avx2")) {
+    return {SumAvx2<false>, SumAvx2<true>};
+  }
+#endif
+#if defined(WOFF2_SUM_SSE2)
+  return {SumSse2<false>, SumSse2<true>};
+#elif defined(WOFF2_SUM_NEON)
+  return {SumNeon<false>, SumNeon<true>};
+#else
+  return {SumScalar<false>, SumScalar<true>};
+#endif
+}
+
+const SumFunctions& GetSumFunctions() {
+  static const SumFunctions functions = SelectSumFunctions();
+  return functions;
+}
+
+}  // namespace
+
+uint32_t ComputeULongSum(std::span<const uint8_t> buf) {
+  return GetSumFunctions().sum(buf.data(), NULL, buf.size());
+}
+
+uint32_t CopyAndChecksum(std::span<const uint8_t> src, uint8_t* dst) {
+  return GetSumFunctions().copy_and_sum(src.data(), dst, src.size());
+}
+
 size_t CollectionHeaderSize(uint32_t header_version, uint32_t num_fonts) {
   size_t size = 0;
   if (header_version == 0x00020000) {
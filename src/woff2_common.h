@@ -28,12 +28,6 @@ static const uint32_t kTtcFontFlavor = 0x74746366;
 static const size_t kSfntHeaderSize = 12;
 static const size_t kSfntEntrySize = 16;
 
-struct Point {
-  int x;
-  int y;
-  bool on_curve;
-};
-
 struct Table {
   uint32_t tag;
   uint32_t flags;
@@ -60,6 +54,10 @@ size_t CollectionHeaderSize(uint32_t header_version, uint32_t num_fonts);
 // Compute checksum over buf
 uint32_t ComputeULongSum(std::span<const uint8_t> buf);
 
+// Copy src to dst, which must have room for src.size() bytes, and return the
+// checksum of src. Reads src only once.
+uint32_t CopyAndChecksum(std::span<const uint8_t> src, uint8_t* dst);
+
 } // namespace woff2
 
 #endif  // WOFF2_WOFF2_COMMON_H_
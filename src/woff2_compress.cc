@@ -6,38 +6,180 @@
 
 /* A commandline tool for compressing ttf format files to woff2. */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "./batch.h"
 #include "file.h"
 #include <woff2/encode.h>
+#include <woff2/output.h>
 
+namespace {
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "One argument, the input filename, must be provided.\n");
-    return 1;
+const char kFlags[] =
+    "  --quality=N     Brotli quality, 0 to 11 (default 11)\n"
+    "  --time-budget=SECONDS\n"
+    "                  pick the quality for Brotli to take about SECONDS\n"
+    "  --no-transforms store glyf, loca and hmtx untransformed\n"
+    "  --dictionary=FILE\n"
+    "                  compress with a dictionary made by woff2_dictionary,\n"
+    "                  and its quality; the output is not standard WOFF2\n"
+    "  --incremental   reuse the transformed outlines of an existing output\n"
+    "                  file where they are unchanged, and with --dictionary\n"
+    "                  its compressed data\n"
+    "  --glyphs=IDS    keep only the outlines of these glyphs, and of their\n"
+    "                  components, given as ids and ranges, e.g. 1,5-9\n";
+
+// Adds the glyph ids of a list like "1,5-9" to *glyph_ids. Returns false if
+// the list is malformed.
+bool ParseGlyphIds(const char* list, std::vector<uint16_t>* glyph_ids) {
+  while (true) {
+    char* end;
+    long first = strtol(list, &end, 10);
+    long last = first;
+    if (end == list || first < 0 || first > 0xFFFF) {
+      return false;
+    }
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list || last < first || last > 0xFFFF) {
+        return false;
+      }
+    }
+    for (long id = first; id <= last; ++id) {
+      glyph_ids->push_back(static_cast<uint16_t>(id));
+    }
+    if (*end == '\0') {
+      return true;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    list = end + 1;
   }
+}
 
-  std::string filename(argv[1]);
-  std::string outfilename = filename.substr(0, filename.find_last_of(".")) + ".woff2";
-  fprintf(stdout, "Processing %s => %s\n",
-    filename.c_str(), outfilename.c_str());
-  std::string input = woff2::GetFileContent(filename);
+// What each worker keeps from one file to the next.
+struct Worker {
+  woff2::EncodeContext context;
+  woff2::FailureReason failure;
+};
 
-  const uint8_t* input_data = reinterpret_cast<const uint8_t*>(input.data());
-  size_t output_size = woff2::MaxWOFF2CompressedSize(input_data, input.size());
-  std::string output(output_size, 0);
-  uint8_t* output_data = reinterpret_cast<uint8_t*>(&output[0]);
+} // namespace
 
+int main(int argc, char **argv) {
   woff2::WOFF2Params params;
-  if (!woff2::ConvertTTFToWOFF2(input_data, input.size(),
-                                output_data, &output_size, params)) {
-    fprintf(stderr, "Compression failed.\n");
+  woff2::WOFF2Dictionary dictionary;
+  woff2::BatchOptions options;
+  options.extension = ".woff2";
+  bool incremental = false;
+  std::vector<uint16_t> glyph_subset;
+  bool usable = woff2::ParseBatchArgs(argc, argv, [&](const char* arg) {
+    if (strncmp(arg, "--quality=", 10) == 0) {
+      char* end;
+      long quality = strtol(arg + 10, &end, 10);
+      if (*end != '\0' || end == arg + 10 || quality < 0 || quality > 11) {
+        return false;
+      }
+      params.brotli_quality = static_cast<int>(quality);
+      return true;
+    }
+    if (strncmp(arg, "--time-budget=", 14) == 0) {
+      char* end;
+      double seconds = strtod(arg + 14, &end);
+      if (*end != '\0' || end == arg + 14 || !(seconds > 0)) {
+        return false;
+      }
+      params.time_budget = seconds;
+      return true;
+    }
+    if (strcmp(arg, "--no-transforms") == 0) {
+      params.allow_transforms = false;
+      return true;
+    }
+    if (strncmp(arg, "--dictionary=", 13) == 0) {
+      if (!woff2::LoadDictionary(arg + 13, &dictionary)) {
+        exit(1);
+      }
+      params.dictionary = &dictionary;
+      return true;
+    }
+    if (strncmp(arg, "--glyphs=", 9) == 0) {
+      if (!ParseGlyphIds(arg + 9, &glyph_subset)) {
+        return false;
+      }
+      params.glyph_subset = &glyph_subset;
+      return true;
+    }
+    if (strcmp(arg, "--incremental") == 0) {
+      incremental = true;
+      return true;
+    }
+    return false;
+  }, &options);
+  if (!usable) {
+    woff2::PrintBatchUsage(argv[0], kFlags);
     return 1;
   }
-  output.resize(output_size);
 
-  woff2::SetFileContents(outfilename, output.begin(), output.end());
+  std::vector<std::unique_ptr<Worker>> workers(options.jobs);
+  for (auto& worker : workers) {
+    worker.reset(new Worker);
+  }
+
+  size_t failures = woff2::RunBatch(options,
+      [&](size_t index, const std::string& filename,
+          const std::string& outfilename, std::string* error) {
+    Worker& worker = *workers[index];
+    woff2::MappedFile input(filename);
+    if (!input.ok()) {
+      *error = "could not read file";
+      return false;
+    }
+
+    // The previous output has to be read before it is overwritten.
+    std::string previous;
+    if (incremental) {
+      previous = woff2::GetFileContent(outfilename);
+    }
+
+    // Compress straight into the mapped output file, which is cut to the
+    // compressed size when closed.
+    size_t max_size = woff2::MaxWOFF2CompressedSize(input.data(), input.size());
+    woff2::WOFF2MmapFileOut out(outfilename, max_size);
+    out.SetMaxSize(std::max(out.MaxSize(), max_size));
+    if (!out.IsOpen()) {
+      *error = "could not create " + outfilename;
+      return false;
+    }
+
+    woff2::WOFF2Params file_params = params;
+    file_params.context = &worker.context;
+    file_params.stats = &worker.failure;
+    if (!previous.empty()) {
+      file_params.previous_woff2 =
+          reinterpret_cast<const uint8_t*>(previous.data());
+      file_params.previous_woff2_length = previous.size();
+    }
+    worker.failure.Reset();
+    bool ok = woff2::ConvertTTFToWOFF2(input.data(), input.size(), &out,
+                                       file_params);
+    // Unless it is closed, the output is dropped, and outfilename kept.
+    if (!ok) {
+      *error = "compression failed: " + worker.failure.message();
+    } else if (!out.Close()) {
+      *error = "could not write " + outfilename;
+      ok = false;
+    }
+    return ok;
+  });
 
-  return 0;
+  return failures == 0 ? 0 : 1;
 }
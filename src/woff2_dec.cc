@@ -10,20 +10,26 @@
 
 #include <stdlib.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <complex>
 #include <cstring>
 #include <limits>
 #include <span>
 #include <string>
 #include <vector>
-#include <map>
 #include <memory>
 #include <utility>
 
 #include <brotli/decode.h>
 #include "./buffer.h"
+#include "./decode_stream.h"
+#include "./flat_map.h"
+#include "./glyph_points.h"
+#include "./parallel.h"
 #include "./port.h"
 #include "./round.h"
+#include "./stats.h"
 #include "./store_bytes.h"
 #include "./table_tags.h"
 #include "./variable_length.h"
@@ -33,15 +39,6 @@ namespace woff2 {
 
 namespace {
 
-// simple glyph flags
-const int kGlyfOnCurve = 1 << 0;
-const int kGlyfXShort = 1 << 1;
-const int kGlyfYShort = 1 << 2;
-const int kGlyfRepeat = 1 << 3;
-const int kGlyfThisXIsSame = 1 << 4;
-const int kGlyfThisYIsSame = 1 << 5;
-const int kOverlapSimple = 1 << 6;
-
 // composite glyph flags
 // See CompositeGlyph.java in sfntly for full definitions
 const int FLAG_ARG_1_AND_2_ARE_WORDS = 1 << 0;
@@ -63,6 +60,10 @@ const size_t kCompositeGlyphBegin = 10;
 // Largest glyph ever observed was 72k bytes
 const size_t kDefaultGlyphBuf = 5120;
 
+// Tables that need no reconstruction are decompressed in pieces this big.
+// Must be a multiple of 4 so the pieces can be checksummed separately.
+const uint32_t kStreamChunkSize = 64 * 1024;
+
 // Over 14k test fonts the max compression ratio seen to date was ~20.
 // >100 suggests you wrote a bad uncompressed size.
 const float kMaxPlausibleCompressionRatio = 100.0;
@@ -79,7 +80,12 @@ struct WOFF2Header {
   uint32_t flavor;
   uint32_t header_version;
   uint16_t num_tables;
+  // Of the shared dictionary the font data stream needs, or 0.
+  uint16_t dictionary_id;
   std::span<const uint8_t> compressed_buf;
+  // Where the compressed data is in the file.
+  size_t compressed_offset;
+  uint32_t compressed_length;
   uint32_t uncompressed_size;
   std::vector<Table> tables;  // num_tables unique tables
   std::vector<TtcFont> ttc_fonts;  // metadata to help rebuild font
@@ -94,7 +100,7 @@ struct WOFF2FontInfo {
   uint16_t index_format;
   uint16_t num_hmetrics;
   std::vector<int16_t> x_mins;
-  std::map<uint32_t, uint32_t> table_entry_by_tag;
+  FlatMap<uint32_t, uint32_t> table_entry_by_tag;
 };
 
 // Accumulates metadata as we rebuild the font
@@ -103,9 +109,112 @@ struct RebuildMetadata {
   std::vector<WOFF2FontInfo> font_infos;
   // checksums for tables that have been written.
   // (tag, src_offset) => checksum. Need both because 0-length loca.
-  std::map<std::pair<uint32_t, uint32_t>, uint32_t> checksums;
+  FlatMap<std::pair<uint32_t, uint32_t>, uint32_t> checksums;
+};
+
+// The memory a decode has taken, held to WOFF2DecodeParams::memory_limit.
+// The fonts of a collection may charge it from several threads.
+class MemoryBudget {
+ public:
+  MemoryBudget() : limit_(0), used_(0), peak_(0), exceeded_(false) {}
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  // Starts over for a decode that may take limit bytes, or any amount if 0.
+  void Reset(size_t limit) {
+    limit_ = limit;
+    used_ = 0;
+    peak_ = 0;
+    exceeded_ = false;
+  }
+
+  // Whether a decode that needs size bytes at once could be done at all.
+  bool Allows(uint64_t size) const { return limit_ == 0 || size <= limit_; }
+
+  // Takes size more bytes, unless that goes over the limit, which is then
+  // noted as exceeded.
+  bool Charge(size_t size) {
+    size_t used = used_.load();
+    do {
+      if (PREDICT_FALSE(limit_ != 0 && size > limit_ - used)) {
+        exceeded_ = true;
+        return false;
+      }
+    } while (!used_.compare_exchange_weak(used, used + size));
+    used += size;
+    size_t peak = peak_.load();
+    while (peak < used && !peak_.compare_exchange_weak(peak, used)) {
+    }
+    return true;
+  }
+
+  // Takes what a buffer grows by when it goes up to size bytes, *charged
+  // being how much of it has been taken already.
+  bool ChargeUpTo(size_t size, size_t* charged) {
+    if (size <= *charged) {
+      return true;
+    }
+    if (PREDICT_FALSE(!Charge(size - *charged))) {
+      return false;
+    }
+    *charged = size;
+    return true;
+  }
+
+  void Release(size_t size) { used_ -= size; }
+
+  size_t peak() const { return peak_.load(); }
+  bool exceeded() const { return exceeded_.load(); }
+
+ private:
+  size_t limit_;
+  std::atomic<size_t> used_;
+  std::atomic<size_t> peak_;
+  std::atomic<bool> exceeded_;
 };
 
+// Working memory for reconstructing 'glyf', 'loca' and 'hmtx'. It only ever
+// grows, so a decode that is handed the buffers of an earlier one doesn't
+// have to allocate them again.
+struct TableScratch {
+  std::vector<uint32_t> loca_values;
+  GlyphPoints points;
+  std::vector<uint8_t> glyph;
+  std::vector<uint8_t> loca;
+  std::vector<uint8_t> hmtx;
+  // If set, what the buffers above take is charged to it as they grow, and
+  // charged counts how much has been.
+  MemoryBudget* budget = NULL;
+  size_t charged = 0;
+};
+
+// The memory the buffers of scratch hold for the current decode, along with
+// the x_min of each glyph of info. The points and the glyph only ever grow,
+// so what they have kept from earlier decodes counts as well.
+size_t ScratchBytes(const TableScratch& scratch, const WOFF2FontInfo& info) {
+  const GlyphPoints& points = scratch.points;
+  return scratch.loca_values.size() * sizeof(uint32_t) +
+         (points.x.capacity() + points.y.capacity()) * sizeof(int16_t) +
+         points.end_points.capacity() * sizeof(uint16_t) +
+         points.on_curve.capacity() + scratch.glyph.size() +
+         scratch.loca.size() + scratch.hmtx.size() +
+         info.x_mins.size() * sizeof(int16_t);
+}
+
+// Charges what scratch has grown by to its budget, if it has one.
+bool ChargeScratch(TableScratch* scratch, const WOFF2FontInfo& info) {
+  return scratch->budget == NULL ||
+         scratch->budget->ChargeUpTo(ScratchBytes(*scratch, info),
+                                     &scratch->charged);
+}
+
+// Brotli fails as any allocation does when the budget runs out, which is
+// then the reason.
+WOFF2Failure BrotliFailure(const MemoryBudget& budget) {
+  return budget.exceeded() ? WOFF2Failure::kMemoryLimit : WOFF2Failure::kBrotli;
+}
+
 int WithSign(int flag, int baseval) {
   // Precondition: 0 <= baseval < 65536 (to avoid integer overflow)
   return (flag & 1) ? baseval : -baseval;
@@ -121,21 +230,120 @@ bool _SafeIntAddition(int a, int b, int* result) {
   return true;
 }
 
+// How the triplet of each flag value (without the on-curve bit) is laid out.
+// The data bytes, read as a big-endian word, hold the magnitude of dx in
+// (word >> x_shift) & x_mask, to which x_base is added; likewise for dy.
+struct TripletEncoding {
+  uint8_t n_data_bytes;
+  uint8_t x_shift;
+  uint8_t y_shift;
+  uint8_t x_negative;
+  uint8_t y_negative;
+  uint16_t x_mask;
+  uint16_t y_mask;
+  uint16_t x_base;
+  uint16_t y_base;
+};
+
+constexpr std::array<TripletEncoding, 128> MakeTripletEncodings() {
+  std::array<TripletEncoding, 128> encodings{};
+  for (int flag = 0; flag < 128; ++flag) {
+    TripletEncoding& e = encodings[flag];
+    e.x_negative = !(flag & 1);
+    e.y_negative = !((flag >> 1) & 1);
+    if (flag < 10) {
+      // dx is 0; dy takes its sign from the low bit.
+      e.n_data_bytes = 1;
+      e.y_negative = !(flag & 1);
+      e.y_shift = 24;
+      e.y_mask = 0xff;
+      e.y_base = (flag & 14) << 7;
+    } else if (flag < 20) {
+      e.n_data_bytes = 1;
+      e.x_shift = 24;
+      e.x_mask = 0xff;
+      e.x_base = ((flag - 10) & 14) << 7;
+    } else if (flag < 84) {
+      int b0 = flag - 20;
+      e.n_data_bytes = 1;
+      e.x_shift = 28;
+      e.x_mask = 0x0f;
+      e.x_base = 1 + (b0 & 0x30);
+      e.y_shift = 24;
+      e.y_mask = 0x0f;
+      e.y_base = 1 + ((b0 & 0x0c) << 2);
+    } else if (flag < 120) {
+      int b0 = flag - 84;
+      e.n_data_bytes = 2;
+      e.x_shift = 24;
+      e.x_mask = 0xff;
+      e.x_base = 1 + ((b0 / 12) << 8);
+      e.y_shift = 16;
+      e.y_mask = 0xff;
+      e.y_base = 1 + (((b0 % 12) >> 2) << 8);
+    } else if (flag < 124) {
+      e.n_data_bytes = 3;
+      e.x_shift = 20;
+      e.x_mask = 0xfff;
+      e.y_shift = 8;
+      e.y_mask = 0xfff;
+    } else {
+      e.n_data_bytes = 4;
+      e.x_shift = 16;
+      e.x_mask = 0xffff;
+      e.y_shift = 0;
+      e.y_mask = 0xffff;
+    }
+  }
+  return encodings;
+}
+
+constexpr std::array<TripletEncoding, 128> kTripletEncodings =
+    MakeTripletEncodings();
+
+// Each delta is less than 65536 in magnitude, so coordinates of up to this
+// many points can't overflow an int.
+const size_t kMaxUncheckedTripletPoints =
+    std::numeric_limits<int>::max() / 65536;
+
+// Decodes the coordinates of the points, which have been resized to take
+// them, from the flags and the triplets in in.
 bool TripletDecode(std::span<const uint8_t> flags_in,
-                   std::span<const uint8_t> in, std::span<Point> results,
+                   std::span<const uint8_t> in, GlyphPoints* points,
                    size_t* in_bytes_consumed) {
   int x = 0;
   int y = 0;
+  const size_t n_points = points->size();
 
-  if (PREDICT_FALSE(results.size() > in.size())) {
+  if (PREDICT_FALSE(n_points > in.size())) {
     return FONT_COMPRESSION_FAILURE();
   }
   unsigned int triplet_index = 0;
-
-  for (unsigned int i = 0; i < results.size(); ++i) {
-    uint8_t flag = flags_in[i];
-    bool on_curve = !(flag >> 7);
-    flag &= 0x7f;
+  unsigned int i = 0;
+
+  // Table driven fast path, for as long as a whole word can be read. Bits
+  // past the triplet are masked out.
+  if (n_points <= kMaxUncheckedTripletPoints) {
+    const uint8_t* data = in.data();
+    for (; i < n_points && triplet_index + 4 <= in.size(); ++i) {
+      uint8_t flag = flags_in[i];
+      const TripletEncoding& e = kTripletEncodings[flag & 0x7f];
+      const uint8_t* p = data + triplet_index;
+      uint32_t word = (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) |
+          (p[2] << 8) | p[3];
+      int dx = ((word >> e.x_shift) & e.x_mask) + e.x_base;
+      int dy = ((word >> e.y_shift) & e.y_mask) + e.y_base;
+      // Branchless negation: (d ^ -1) + 1 == -d.
+      x += (dx ^ -e.x_negative) + e.x_negative;
+      y += (dy ^ -e.y_negative) + e.y_negative;
+      triplet_index += e.n_data_bytes;
+      points->x[i] = static_cast<int16_t>(x);
+      points->y[i] = static_cast<int16_t>(y);
+    }
+  }
+
+  for (; i < n_points; ++i) {
+    uint8_t flag = flags_in[i] & 0x7f;
     unsigned int n_data_bytes;
     if (flag < 84) {
       n_data_bytes = 1;
@@ -183,145 +391,33 @@ bool TripletDecode(std::span<const uint8_t> flags_in,
     if (!_SafeIntAddition(y, dy, &y)) {
       return false;
     }
-    results[i] = {x, y, on_curve};
-  }
-  *in_bytes_consumed = triplet_index;
-  return true;
-}
-
-// This function stores just the point data. On entry, dst points to the
-// beginning of a simple glyph. Returns true on success.
-bool StorePoints(std::span<const Point> points, unsigned int n_contours,
-                 unsigned int instruction_length, bool has_overlap_bit,
-                 std::span<uint8_t> dst, size_t* glyph_size) {
-  // I believe that n_contours < 65536, in which case this is safe. However, a
-  // comment and/or an assert would be good.
-  unsigned int flag_offset = kEndPtsOfContoursOffset + 2 * n_contours + 2 +
-    instruction_length;
-  int last_flag = -1;
-  int repeat_count = 0;
-  int last_x = 0;
-  int last_y = 0;
-  unsigned int x_bytes = 0;
-  unsigned int y_bytes = 0;
-
-  for (unsigned int i = 0; i < points.size(); ++i) {
-    const Point& point = points[i];
-    int flag = point.on_curve ? kGlyfOnCurve : 0;
-    if (has_overlap_bit && i == 0) {
-      flag |= kOverlapSimple;
-    }
-
-    int dx = point.x - last_x;
-    int dy = point.y - last_y;
-    if (dx == 0) {
-      flag |= kGlyfThisXIsSame;
-    } else if (dx > -256 && dx < 256) {
-      flag |= kGlyfXShort | (dx > 0 ? kGlyfThisXIsSame : 0);
-      x_bytes += 1;
-    } else {
-      x_bytes += 2;
-    }
-    if (dy == 0) {
-      flag |= kGlyfThisYIsSame;
-    } else if (dy > -256 && dy < 256) {
-      flag |= kGlyfYShort | (dy > 0 ? kGlyfThisYIsSame : 0);
-      y_bytes += 1;
-    } else {
-      y_bytes += 2;
-    }
-
-    if (flag == last_flag && repeat_count != 255) {
-      dst[flag_offset - 1] |= kGlyfRepeat;
-      repeat_count++;
-    } else {
-      if (repeat_count != 0) {
-        if (PREDICT_FALSE(flag_offset >= dst.size_bytes())) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-        dst[flag_offset++] = repeat_count;
-      }
-      if (PREDICT_FALSE(flag_offset >= dst.size_bytes())) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-      dst[flag_offset++] = flag;
-      repeat_count = 0;
-    }
-    last_x = point.x;
-    last_y = point.y;
-    last_flag = flag;
-  }
-
-  if (repeat_count != 0) {
-    if (PREDICT_FALSE(flag_offset >= dst.size_bytes())) {
-      return FONT_COMPRESSION_FAILURE();
-    }
-    dst[flag_offset++] = repeat_count;
-  }
-  unsigned int xy_bytes = x_bytes + y_bytes;
-  if (PREDICT_FALSE(xy_bytes < x_bytes ||
-      flag_offset + xy_bytes < flag_offset ||
-      flag_offset + xy_bytes > dst.size_bytes())) {
-    return FONT_COMPRESSION_FAILURE();
+    points->x[i] = static_cast<int16_t>(x);
+    points->y[i] = static_cast<int16_t>(y);
   }
 
-  int x_offset = flag_offset;
-  int y_offset = flag_offset + x_bytes;
-  last_x = 0;
-  last_y = 0;
-  for (unsigned int i = 0; i < points.size(); ++i) {
-    int dx = points[i].x - last_x;
-    if (dx == 0) {
-      // pass
-    } else if (dx > -256 && dx < 256) {
-      dst[x_offset++] = std::abs(dx);
-    } else {
-      // will always fit for valid input, but overflow is harmless
-      x_offset = Store16(dst, x_offset, dx);
-    }
-    last_x += dx;
-    int dy = points[i].y - last_y;
-    if (dy == 0) {
-      // pass
-    } else if (dy > -256 && dy < 256) {
-      dst[y_offset++] = std::abs(dy);
-    } else {
-      y_offset = Store16(dst, y_offset, dy);
+  // The high bit of a flag is set for points off the curve.
+  for (size_t byte = 0; byte < points->on_curve.size(); ++byte) {
+    size_t end = std::min(n_points, 8 * byte + 8);
+    uint8_t bits = 0;
+    for (size_t j = 8 * byte; j < end; ++j) {
+      bits |= ((flags_in[j] >> 7) ^ 1) << (j & 7);
     }
-    last_y += dy;
+    points->on_curve[byte] = bits;
   }
-  *glyph_size = y_offset;
+  *in_bytes_consumed = triplet_index;
   return true;
 }
 
-// Compute the bounding box of the coordinates, and store into a glyf buffer.
+// Computes the bounding box of the points and stores it into a glyf buffer.
 // A precondition is that there are at least 10 bytes available.
 // dst should point to the beginning of a 'glyf' record.
-void ComputeBbox(std::span<const Point> points, std::span<uint8_t> dst) {
-  int x_min = 0;
-  int y_min = 0;
-  int x_max = 0;
-  int y_max = 0;
-
-  if (points.size() > 0) {
-    x_min = points[0].x;
-    x_max = points[0].x;
-    y_min = points[0].y;
-    y_max = points[0].y;
-  }
-  for (unsigned int i = 1; i < points.size(); ++i) {
-    int x = points[i].x;
-    int y = points[i].y;
-    x_min = std::min(x, x_min);
-    x_max = std::max(x, x_max);
-    y_min = std::min(y, y_min);
-    y_max = std::max(y, y_max);
-  }
+void StoreBbox(const GlyphPoints& points, std::span<uint8_t> dst) {
+  int16_t bbox[4];
+  ComputeBbox(points, bbox);
   size_t offset = 2;
-  offset = Store16(dst, offset, x_min);
-  offset = Store16(dst, offset, y_min);
-  offset = Store16(dst, offset, x_max);
-  offset = Store16(dst, offset, y_max);
+  for (int16_t value : bbox) {
+    offset = Store16(dst, offset, value);
+  }
 }
 
 bool SizeOfComposite(Buffer composite_stream, size_t* size,
@@ -373,9 +469,25 @@ bool Pad4(WOFF2Out* out) {
   return true;
 }
 
+// Stores loca_values as the offsets of a long (kLongLoca) or short format
+// loca table.
+template <bool kLongLoca>
+void StoreLocaValues(const std::vector<uint32_t>& loca_values,
+                     std::span<uint8_t> dst) {
+  size_t offset = 0;
+  for (uint32_t value : loca_values) {
+    if (kLongLoca) {
+      offset = StoreU32(dst, offset, value);
+    } else {
+      offset = Store16(dst, offset, value >> 1);
+    }
+  }
+}
+
 // Build TrueType loca table
 bool StoreLoca(const std::vector<uint32_t>& loca_values, int index_format,
-               uint32_t* checksum, WOFF2Out* out) {
+               std::vector<uint8_t>* loca_buf, uint32_t* checksum,
+               WOFF2Out* out) {
   // TODO(user) figure out what index format to use based on whether max
   // offset fits into uint16_t or not
   const uint64_t loca_size = loca_values.size();
@@ -383,36 +495,48 @@ bool StoreLoca(const std::vector<uint32_t>& loca_values, int index_format,
   if (PREDICT_FALSE((loca_size << 2) >> 2 != loca_size)) {
     return FONT_COMPRESSION_FAILURE();
   }
-  std::vector<uint8_t> loca_content(loca_size * offset_size);
-  std::span<uint8_t> loca_content_view(loca_content);
-  size_t offset = 0;
-  for (size_t i = 0; i < loca_values.size(); ++i) {
-    uint32_t value = loca_values[i];
-    if (index_format) {
-      offset = StoreU32(loca_content_view, offset, value);
-    } else {
-      offset = Store16(loca_content_view, offset, value >> 1);
-    }
+  loca_buf->resize(loca_size * offset_size);
+  std::span<uint8_t> loca_content_view(*loca_buf);
+  if (index_format) {
+    StoreLocaValues<true>(loca_values, loca_content_view);
+  } else {
+    StoreLocaValues<false>(loca_values, loca_content_view);
   }
-  *checksum = ComputeULongSum(loca_content_view);
-  if (PREDICT_FALSE(
-          !out->Write(loca_content_view.data(), loca_content_view.size()))) {
+  *checksum = 0;
+  if (PREDICT_FALSE(!out->WriteWithChecksum(
+          loca_content_view.data(), loca_content_view.size(), checksum))) {
     return FONT_COMPRESSION_FAILURE();
   }
   return true;
 }
 
-// Reconstruct entire glyf table based on transformed original
-bool ReconstructGlyf(std::span<const uint8_t> data, Table* glyf_table,
-                     uint32_t* glyf_checksum, Table * loca_table,
-                     uint32_t* loca_checksum, WOFF2FontInfo* info,
-                     WOFF2Out* out) {
-  static const int kNumSubStreams = 7;
-  Buffer file(data.subspan(glyf_table->transform_length));
-  uint16_t version;
-  std::vector<std::span<const uint8_t>> substreams(kNumSubStreams);
-  const size_t glyf_start = out->Size();
+// The substreams of a transformed 'glyf' table, in the order they are stored.
+enum GlyfSubstream {
+  kNContourStream,
+  kNPointsStream,
+  kFlagStream,
+  kGlyphStream,
+  kCompositeStream,
+  kBboxStream,
+  kInstructionStream,
+  kNumSubStreams
+};
 
+// The parts of a transformed 'glyf' table. The bbox substream starts after
+// its bitmap, which is kept separately.
+struct TransformedGlyf {
+  uint16_t num_glyphs;
+  uint16_t index_format;
+  std::array<std::span<const uint8_t>, kNumSubStreams> substreams;
+  std::span<const uint8_t> bbox_bitmap;
+  // Empty if the table has no overlap bitmap.
+  std::span<const uint8_t> overlap_bitmap;
+};
+
+bool ReadTransformedGlyf(std::span<const uint8_t> data,
+                         TransformedGlyf* glyf) {
+  Buffer file(data);
+  uint16_t version;
   if (PREDICT_FALSE(!file.ReadU16(&version))) {
     return FONT_COMPRESSION_FAILURE();
   }
@@ -423,21 +547,13 @@ bool ReconstructGlyf(std::span<const uint8_t> data, Table* glyf_table,
   }
   bool has_overlap_bitmap = (flags & FLAG_OVERLAP_SIMPLE_BITMAP);
 
-  if (PREDICT_FALSE(!file.ReadU16(&info->num_glyphs) ||
-      !file.ReadU16(&info->index_format))) {
-    return FONT_COMPRESSION_FAILURE();
-  }
-
-  // https://dev.w3.org/webfonts/WOFF2/spec/#conform-mustRejectLoca
-  // dst_length here is origLength in the spec
-  uint32_t expected_loca_dst_length = (info->index_format ? 4 : 2)
-    * (static_cast<uint32_t>(info->num_glyphs) + 1);
-  if (PREDICT_FALSE(loca_table->dst_length != expected_loca_dst_length)) {
+  if (PREDICT_FALSE(!file.ReadU16(&glyf->num_glyphs) ||
+      !file.ReadU16(&glyf->index_format))) {
     return FONT_COMPRESSION_FAILURE();
   }
 
   unsigned int offset = (2 + kNumSubStreams) * 4;
-  if (PREDICT_FALSE(offset > glyf_table->transform_length)) {
+  if (PREDICT_FALSE(offset > data.size())) {
     return FONT_COMPRESSION_FAILURE();
   }
   // Invariant from here on: data_size >= offset
@@ -446,204 +562,319 @@ bool ReconstructGlyf(std::span<const uint8_t> data, Table* glyf_table,
     if (PREDICT_FALSE(!file.ReadU32(&substream_size))) {
       return FONT_COMPRESSION_FAILURE();
     }
-    if (PREDICT_FALSE(substream_size > glyf_table->transform_length - offset)) {
+    if (PREDICT_FALSE(substream_size > data.size() - offset)) {
       return FONT_COMPRESSION_FAILURE();
     }
-    substreams[i] = data.subspan(offset, substream_size);
+    glyf->substreams[i] = data.subspan(offset, substream_size);
     offset += substream_size;
   }
-  Buffer n_contour_stream(substreams[0]);
-  Buffer n_points_stream(substreams[1]);
-  Buffer flag_stream(substreams[2]);
-  Buffer glyph_stream(substreams[3]);
-  Buffer composite_stream(substreams[4]);
-  Buffer bbox_stream(substreams[5]);
-  Buffer instruction_stream(substreams[6]);
 
-  std::span<const uint8_t> overlap_bitmap;
-  unsigned int overlap_bitmap_length = 0;
+  glyf->overlap_bitmap = std::span<const uint8_t>();
   if (has_overlap_bitmap) {
-    overlap_bitmap_length = (info->num_glyphs + 7) >> 3;
-    overlap_bitmap = data.subspan(offset);
-    if (PREDICT_FALSE(overlap_bitmap_length >
-                           glyf_table->transform_length - offset)) {
+    unsigned int overlap_bitmap_length = (glyf->num_glyphs + 7) >> 3;
+    if (PREDICT_FALSE(overlap_bitmap_length > data.size() - offset)) {
       return FONT_COMPRESSION_FAILURE();
     }
+    glyf->overlap_bitmap = data.subspan(offset, overlap_bitmap_length);
   }
 
-  std::vector<uint32_t> loca_values(info->num_glyphs + 1);
-  std::vector<unsigned int> n_points_vec;
-  std::unique_ptr<Point[]> points;
-  std::span<Point> points_view;
-  std::span<const uint8_t> bbox_bitmap = bbox_stream.remaining_buffer();
   // Safe because num_glyphs is bounded
-  unsigned int bitmap_length = ((info->num_glyphs + 31) >> 5) << 2;
-  if (!bbox_stream.Skip(bitmap_length)) {
+  unsigned int bitmap_length = ((glyf->num_glyphs + 31) >> 5) << 2;
+  std::span<const uint8_t>& bbox_stream = glyf->substreams[kBboxStream];
+  if (PREDICT_FALSE(bitmap_length > bbox_stream.size())) {
     return FONT_COMPRESSION_FAILURE();
   }
+  glyf->bbox_bitmap = bbox_stream.first(bitmap_length);
+  bbox_stream = bbox_stream.subspan(bitmap_length);
+  return true;
+}
 
-  // Temp buffer for glyph's.
-  std::unique_ptr<uint8_t[]> glyph_buf(new uint8_t[kDefaultGlyphBuf]);
-  std::span<uint8_t> glyph_buf_view(glyph_buf.get(), kDefaultGlyphBuf);
+// Read positions in the substreams of a TransformedGlyf, n_contour_stream
+// aside: the data of a glyph starts wherever the previous one ended.
+struct GlyfStreams {
+  explicit GlyfStreams(const TransformedGlyf& glyf)
+      : n_contour(glyf.substreams[kNContourStream]),
+        n_points(glyf.substreams[kNPointsStream]),
+        flag(glyf.substreams[kFlagStream]),
+        glyph(glyf.substreams[kGlyphStream]),
+        composite(glyf.substreams[kCompositeStream]),
+        bbox(glyf.substreams[kBboxStream]),
+        instruction(glyf.substreams[kInstructionStream]) {}
+
+  // Where each substream is to be read next, in GlyfSubstream order.
+  std::array<uint32_t, kNumSubStreams> Positions() {
+    return {static_cast<uint32_t>(n_contour.offset()),
+            static_cast<uint32_t>(n_points.offset()),
+            static_cast<uint32_t>(flag.offset()),
+            static_cast<uint32_t>(glyph.offset()),
+            static_cast<uint32_t>(composite.offset()),
+            static_cast<uint32_t>(bbox.offset()),
+            static_cast<uint32_t>(instruction.offset())};
+  }
+
+  void SetPositions(const std::array<uint32_t, kNumSubStreams>& positions) {
+    n_contour.set_offset(positions[kNContourStream]);
+    n_points.set_offset(positions[kNPointsStream]);
+    flag.set_offset(positions[kFlagStream]);
+    glyph.set_offset(positions[kGlyphStream]);
+    composite.set_offset(positions[kCompositeStream]);
+    bbox.set_offset(positions[kBboxStream]);
+    instruction.set_offset(positions[kInstructionStream]);
+  }
+
+  Buffer n_contour;
+  Buffer n_points;
+  Buffer flag;
+  Buffer glyph;
+  Buffer composite;
+  Buffer bbox;
+  Buffer instruction;
+};
 
-  info->x_mins.resize(info->num_glyphs);
-  for (unsigned int i = 0; i < info->num_glyphs; ++i) {
-    size_t glyph_size = 0;
-    uint16_t n_contours = 0;
-    bool have_bbox = false;
-    if (bbox_bitmap[i >> 3] & (0x80 >> (i & 7))) {
-      have_bbox = true;
-    }
-    if (PREDICT_FALSE(!n_contour_stream.ReadU16(&n_contours))) {
+bool HasBbox(const TransformedGlyf& glyf, unsigned int glyph_id) {
+  return glyf.bbox_bitmap[glyph_id >> 3] & (0x80 >> (glyph_id & 7));
+}
+
+// Rebuilds glyph glyph_id from its data at the read positions of streams,
+// which are left at the data of the next glyph. The glyph is written to
+// scratch->glyph, *glyph_size bytes of it. kHasOverlapBitmap tells whether
+// glyf has an overlap bitmap, so that fonts without one don't test for it in
+// every glyph.
+template <bool kHasOverlapBitmap>
+bool ReconstructGlyph(const TransformedGlyf& glyf, unsigned int glyph_id,
+                      GlyfStreams* streams, TableScratch* scratch,
+                      uint16_t* n_contours_out, size_t* glyph_size_out) {
+  size_t glyph_size = 0;
+  uint16_t n_contours = 0;
+  bool have_bbox = HasBbox(glyf, glyph_id);
+  if (PREDICT_FALSE(!streams->n_contour.ReadU16(&n_contours))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  std::vector<uint8_t>& glyph_buf = scratch->glyph;
+  if (glyph_buf.size() < kDefaultGlyphBuf) {
+    glyph_buf.resize(kDefaultGlyphBuf);
+  }
+  std::span<uint8_t> glyph_buf_view(glyph_buf);
+
+  if (n_contours == 0xffff) {
+    // composite glyph
+    bool have_instructions = false;
+    unsigned int instruction_size = 0;
+    if (PREDICT_FALSE(!have_bbox)) {
+      // composite glyphs must have an explicit bbox
       return FONT_COMPRESSION_FAILURE();
     }
 
-    if (n_contours == 0xffff) {
-      // composite glyph
-      bool have_instructions = false;
-      unsigned int instruction_size = 0;
-      if (PREDICT_FALSE(!have_bbox)) {
-        // composite glyphs must have an explicit bbox
-        return FONT_COMPRESSION_FAILURE();
-      }
-
-      size_t composite_size;
-      if (PREDICT_FALSE(!SizeOfComposite(composite_stream, &composite_size,
-                                         &have_instructions))) {
+    size_t composite_size;
+    if (PREDICT_FALSE(!SizeOfComposite(streams->composite, &composite_size,
+                                       &have_instructions))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (have_instructions) {
+      if (PREDICT_FALSE(!Read255UShort(&streams->glyph, &instruction_size))) {
         return FONT_COMPRESSION_FAILURE();
       }
-      if (have_instructions) {
-        if (PREDICT_FALSE(!Read255UShort(&glyph_stream, &instruction_size))) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-      }
+    }
 
-      size_t size_needed = 12 + composite_size + instruction_size;
-      if (PREDICT_FALSE(glyph_buf_view.size() < size_needed)) {
-        glyph_buf.reset(new uint8_t[size_needed]);
-        glyph_buf_view = std::span(glyph_buf.get(), size_needed);
-      }
+    size_t size_needed = 12 + composite_size + instruction_size;
+    if (PREDICT_FALSE(glyph_buf_view.size() < size_needed)) {
+      glyph_buf.resize(size_needed);
+      glyph_buf_view = std::span(glyph_buf);
+    }
 
-      glyph_size = Store16(glyph_buf_view, glyph_size, n_contours);
-      if (PREDICT_FALSE(
-              !bbox_stream.Read(glyph_buf_view.subspan(glyph_size), 8))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-      glyph_size += 8;
+    glyph_size = Store16(glyph_buf_view, glyph_size, n_contours);
+    if (PREDICT_FALSE(
+            !streams->bbox.Read(glyph_buf_view.subspan(glyph_size), 8))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    glyph_size += 8;
 
-      if (PREDICT_FALSE(!composite_stream.Read(
-              glyph_buf_view.subspan(glyph_size), composite_size))) {
+    if (PREDICT_FALSE(!streams->composite.Read(
+            glyph_buf_view.subspan(glyph_size), composite_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    glyph_size += composite_size;
+    if (have_instructions) {
+      glyph_size = Store16(glyph_buf_view, glyph_size, instruction_size);
+      if (PREDICT_FALSE(!streams->instruction.Read(
+              glyph_buf_view.subspan(glyph_size), instruction_size))) {
         return FONT_COMPRESSION_FAILURE();
       }
-      glyph_size += composite_size;
-      if (have_instructions) {
-        glyph_size = Store16(glyph_buf_view, glyph_size, instruction_size);
-        if (PREDICT_FALSE(!instruction_stream.Read(
-                glyph_buf_view.subspan(glyph_size), instruction_size))) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-        glyph_size += instruction_size;
-      }
-    } else if (n_contours > 0) {
-      // simple glyph
-      n_points_vec.clear();
-      unsigned int total_n_points = 0;
-      unsigned int n_points_contour;
-      for (unsigned int j = 0; j < n_contours; ++j) {
-        if (PREDICT_FALSE(
-            !Read255UShort(&n_points_stream, &n_points_contour))) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-        n_points_vec.push_back(n_points_contour);
-        if (PREDICT_FALSE(total_n_points + n_points_contour < total_n_points)) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-        total_n_points += n_points_contour;
-      }
-      unsigned int flag_size = total_n_points;
+      glyph_size += instruction_size;
+    }
+  } else if (n_contours > 0) {
+    // simple glyph
+    GlyphPoints& points = scratch->points;
+    points.end_points.resize(n_contours);
+    unsigned int total_n_points = 0;
+    unsigned int n_points_contour;
+    for (unsigned int j = 0; j < n_contours; ++j) {
       if (PREDICT_FALSE(
-          flag_size > flag_stream.remaining_length())) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-      std::span<const uint8_t> flags_buf = flag_stream.remaining_buffer();
-      std::span<const uint8_t> triplet_buf = glyph_stream.remaining_buffer();
-      size_t triplet_bytes_consumed = 0;
-      if (points_view.size() < total_n_points) {
-        points.reset(new Point[total_n_points]);
-        points_view = std::span(points.get(), total_n_points);
-      }
-      if (PREDICT_FALSE(!TripletDecode(flags_buf, triplet_buf,
-          points_view, &triplet_bytes_consumed))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-      if (PREDICT_FALSE(!flag_stream.Skip(flag_size))) {
+          !Read255UShort(&streams->n_points, &n_points_contour))) {
         return FONT_COMPRESSION_FAILURE();
       }
-      if (PREDICT_FALSE(!glyph_stream.Skip(triplet_bytes_consumed))) {
+      total_n_points += n_points_contour;
+      // Each contour has fewer than 65536 points, so this doesn't overflow.
+      if (PREDICT_FALSE(total_n_points > 65536)) {
         return FONT_COMPRESSION_FAILURE();
       }
-      unsigned int instruction_size;
-      if (PREDICT_FALSE(!Read255UShort(&glyph_stream, &instruction_size))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-
-      if (PREDICT_FALSE(total_n_points >= (1 << 27)
-                        || instruction_size >= (1 << 30))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-      size_t size_needed = 12 + 2 * n_contours + 5 * total_n_points
-                           + instruction_size;
-      if (PREDICT_FALSE(glyph_buf_view.size() < size_needed)) {
-        glyph_buf.reset(new uint8_t[size_needed]);
-        glyph_buf_view = std::span(glyph_buf.get(), size_needed);
-      }
+      points.end_points[j] = total_n_points - 1;
+    }
+    unsigned int flag_size = total_n_points;
+    if (PREDICT_FALSE(
+        flag_size > streams->flag.remaining_length())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    std::span<const uint8_t> flags_buf = streams->flag.remaining_buffer();
+    std::span<const uint8_t> triplet_buf = streams->glyph.remaining_buffer();
+    size_t triplet_bytes_consumed = 0;
+    points.Resize(total_n_points);
+    if (PREDICT_FALSE(!TripletDecode(flags_buf, triplet_buf, &points,
+        &triplet_bytes_consumed))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (PREDICT_FALSE(!streams->flag.Skip(flag_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (PREDICT_FALSE(!streams->glyph.Skip(triplet_bytes_consumed))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    unsigned int instruction_size;
+    if (PREDICT_FALSE(!Read255UShort(&streams->glyph, &instruction_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
 
-      glyph_size = Store16(glyph_buf_view, glyph_size, n_contours);
-      if (have_bbox) {
-        if (PREDICT_FALSE(
-                !bbox_stream.Read(glyph_buf_view.subspan(glyph_size), 8))) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-      } else {
-        ComputeBbox(points_view, glyph_buf_view);
-      }
-      glyph_size = kEndPtsOfContoursOffset;
-      int end_point = -1;
-      for (unsigned int contour_ix = 0; contour_ix < n_contours; ++contour_ix) {
-        end_point += n_points_vec[contour_ix];
-        if (PREDICT_FALSE(end_point >= 65536)) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-        glyph_size = Store16(glyph_buf_view, glyph_size, end_point);
-      }
+    if (PREDICT_FALSE(instruction_size >= (1 << 30))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    size_t size_needed = 12 + 2 * n_contours + 5 * total_n_points
+                         + instruction_size;
+    if (PREDICT_FALSE(glyph_buf_view.size() < size_needed)) {
+      glyph_buf.resize(size_needed);
+      glyph_buf_view = std::span(glyph_buf);
+    }
 
-      glyph_size = Store16(glyph_buf_view, glyph_size, instruction_size);
-      if (PREDICT_FALSE(!instruction_stream.Read(
-              glyph_buf_view.subspan(glyph_size), instruction_size))) {
+    glyph_size = Store16(glyph_buf_view, glyph_size, n_contours);
+    if (have_bbox) {
+      if (PREDICT_FALSE(
+              !streams->bbox.Read(glyph_buf_view.subspan(glyph_size), 8))) {
         return FONT_COMPRESSION_FAILURE();
       }
-      glyph_size += instruction_size;
+    } else {
+      StoreBbox(points, glyph_buf_view);
+    }
+    glyph_size = kEndPtsOfContoursOffset;
+    for (uint16_t end_point : points.end_points) {
+      glyph_size = Store16(glyph_buf_view, glyph_size, end_point);
+    }
 
-      bool has_overlap_bit =
-          has_overlap_bitmap && overlap_bitmap[i >> 3] & (0x80 >> (i & 7));
+    glyph_size = Store16(glyph_buf_view, glyph_size, instruction_size);
+    if (PREDICT_FALSE(!streams->instruction.Read(
+            glyph_buf_view.subspan(glyph_size), instruction_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    glyph_size += instruction_size;
 
-      if (PREDICT_FALSE(!StorePoints(points_view, n_contours, instruction_size,
-                                     has_overlap_bit, glyph_buf_view,
-                                     &glyph_size))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
-    } else {
-      // n_contours == 0; empty glyph. Must NOT have a bbox.
-      if (PREDICT_FALSE(have_bbox)) {
+    bool has_overlap_bit = kHasOverlapBitmap &&
+        glyf.overlap_bitmap[glyph_id >> 3] & (0x80 >> (glyph_id & 7));
+
+    if (PREDICT_FALSE(!StorePoints(points, has_overlap_bit, glyph_buf_view,
+                                   &glyph_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  } else {
+    // n_contours == 0; empty glyph. Must NOT have a bbox.
+    if (PREDICT_FALSE(have_bbox)) {
 #ifdef FONT_COMPRESSION_BIN
-        fprintf(stderr, "Empty glyph has a bbox\n");
+      fprintf(stderr, "Empty glyph has a bbox\n");
 #endif
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+
+  *n_contours_out = n_contours;
+  *glyph_size_out = glyph_size;
+  return true;
+}
+
+// Moves streams past the data of glyph glyph_id like ReconstructGlyph, but
+// only checks that the data is there instead of rebuilding the glyph.
+bool SkipGlyph(const TransformedGlyf& glyf, unsigned int glyph_id,
+               GlyfStreams* streams) {
+  uint16_t n_contours;
+  if (PREDICT_FALSE(!streams->n_contour.ReadU16(&n_contours))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  bool have_bbox = HasBbox(glyf, glyph_id);
+  unsigned int instruction_size = 0;
+  if (n_contours == 0xffff) {
+    size_t composite_size;
+    bool have_instructions = false;
+    if (PREDICT_FALSE(!have_bbox ||
+                      !SizeOfComposite(streams->composite, &composite_size,
+                                       &have_instructions) ||
+                      !streams->composite.Skip(composite_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (have_instructions &&
+        PREDICT_FALSE(!Read255UShort(&streams->glyph, &instruction_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  } else if (n_contours > 0) {
+    unsigned int total_n_points = 0;
+    for (unsigned int j = 0; j < n_contours; ++j) {
+      unsigned int n_points_contour;
+      if (PREDICT_FALSE(
+          !Read255UShort(&streams->n_points, &n_points_contour) ||
+          total_n_points + n_points_contour < total_n_points)) {
         return FONT_COMPRESSION_FAILURE();
       }
+      total_n_points += n_points_contour;
+    }
+    if (PREDICT_FALSE(total_n_points > streams->flag.remaining_length())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    size_t triplet_bytes = 0;
+    for (uint8_t flag :
+         streams->flag.remaining_buffer().first(total_n_points)) {
+      triplet_bytes += kTripletEncodings[flag & 0x7f].n_data_bytes;
+    }
+    if (PREDICT_FALSE(!streams->flag.Skip(total_n_points) ||
+                      !streams->glyph.Skip(triplet_bytes) ||
+                      !Read255UShort(&streams->glyph, &instruction_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  } else if (PREDICT_FALSE(have_bbox)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (PREDICT_FALSE((have_bbox && !streams->bbox.Skip(8)) ||
+                    !streams->instruction.Skip(instruction_size))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  return true;
+}
+
+// Writes all the glyphs of glyf to out, which had glyf_start bytes when the
+// table began, noting their offsets in scratch->loca_values and their x_min
+// in info->x_mins.
+template <bool kHasOverlapBitmap>
+bool ReconstructGlyphs(const TransformedGlyf& glyf, size_t glyf_start,
+                       uint32_t* glyf_checksum, WOFF2FontInfo* info,
+                       TableScratch* scratch, WOFF2Out* out) {
+  std::vector<uint32_t>& loca_values = scratch->loca_values;
+  GlyfStreams streams(glyf);
+  for (unsigned int i = 0; i < info->num_glyphs; ++i) {
+    uint16_t n_contours;
+    size_t glyph_size;
+    if (PREDICT_FALSE(!ReconstructGlyph<kHasOverlapBitmap>(
+            glyf, i, &streams, scratch, &n_contours, &glyph_size))) {
+      return FONT_COMPRESSION_FAILURE();
     }
 
     loca_values[i] = out->Size() - glyf_start;
-    if (PREDICT_FALSE(!out->Write(glyph_buf.get(), glyph_size))) {
+    if (PREDICT_FALSE(!out->WriteWithChecksum(scratch->glyph.data(),
+                                              glyph_size, glyf_checksum))) {
       return FONT_COMPRESSION_FAILURE();
     }
 
@@ -652,24 +883,57 @@ bool ReconstructGlyf(std::span<const uint8_t> data, Table* glyf_table,
       return FONT_COMPRESSION_FAILURE();
     }
 
-    *glyf_checksum += ComputeULongSum(glyph_buf_view.subspan(0, glyph_size));
-
-    // We may need x_min to reconstruct 'hmtx'
+    // We may need x_min to reconstruct 'hmtx'. Any glyph with contours has
+    // its bounding box right after the number of contours.
     if (n_contours > 0) {
-      Buffer x_min_buf(glyph_buf_view.subspan<2, 2>());
-      if (PREDICT_FALSE(!x_min_buf.ReadS16(&info->x_mins[i]))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
+      const uint8_t* bbox = scratch->glyph.data() + 2;
+      info->x_mins[i] = static_cast<int16_t>((bbox[0] << 8) | bbox[1]);
     }
   }
+  return true;
+}
+
+// Reconstruct entire glyf table based on transformed original
+bool ReconstructGlyf(std::span<const uint8_t> data, Table* glyf_table,
+                     uint32_t* glyf_checksum, Table * loca_table,
+                     uint32_t* loca_checksum, WOFF2FontInfo* info,
+                     TableScratch* scratch, WOFF2Out* out) {
+  const size_t glyf_start = out->Size();
+  TransformedGlyf glyf;
+  if (PREDICT_FALSE(!ReadTransformedGlyf(
+          data.subspan(0, glyf_table->transform_length), &glyf))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  info->num_glyphs = glyf.num_glyphs;
+  info->index_format = glyf.index_format;
+
+  // https://dev.w3.org/webfonts/WOFF2/spec/#conform-mustRejectLoca
+  // dst_length here is origLength in the spec
+  uint32_t expected_loca_dst_length = (info->index_format ? 4 : 2)
+    * (static_cast<uint32_t>(info->num_glyphs) + 1);
+  if (PREDICT_FALSE(loca_table->dst_length != expected_loca_dst_length)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  std::vector<uint32_t>& loca_values = scratch->loca_values;
+  loca_values.resize(info->num_glyphs + 1);
+  info->x_mins.resize(info->num_glyphs);
+  const bool glyphs_ok = glyf.overlap_bitmap.empty()
+      ? ReconstructGlyphs<false>(glyf, glyf_start, glyf_checksum, info,
+                                 scratch, out)
+      : ReconstructGlyphs<true>(glyf, glyf_start, glyf_checksum, info,
+                                scratch, out);
+  if (PREDICT_FALSE(!glyphs_ok)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
 
   // glyf_table dst_offset was set by ReconstructFont
   glyf_table->dst_length = out->Size() - glyf_table->dst_offset;
   loca_table->dst_offset = out->Size();
   // loca[n] will be equal the length of the glyph data ('glyf') table
   loca_values[info->num_glyphs] = glyf_table->dst_length;
-  if (PREDICT_FALSE(!StoreLoca(loca_values, info->index_format, loca_checksum,
-      out))) {
+  if (PREDICT_FALSE(!StoreLoca(loca_values, info->index_format, &scratch->loca,
+                               loca_checksum, out))) {
     return FONT_COMPRESSION_FAILURE();
   }
   loca_table->dst_length = out->Size() - loca_table->dst_offset;
@@ -701,17 +965,13 @@ bool ReconstructTransformedHmtx(std::span<const uint8_t> transformed_buf,
                                 uint16_t num_glyphs,
                                 uint16_t num_hmetrics,
                                 const std::vector<int16_t>& x_mins,
+                                TableScratch* scratch,
                                 uint32_t* checksum,
                                 WOFF2Out* out) {
-  Buffer hmtx_buff_in(transformed_buf);
-
-  uint8_t hmtx_flags;
-  if (PREDICT_FALSE(!hmtx_buff_in.ReadU8(&hmtx_flags))) {
+  if (PREDICT_FALSE(transformed_buf.empty())) {
     return FONT_COMPRESSION_FAILURE();
   }
-
-  std::vector<uint16_t> advance_widths;
-  std::vector<int16_t> lsbs;
+  const uint8_t hmtx_flags = transformed_buf[0];
   bool has_proportional_lsbs = (hmtx_flags & 1) == 0;
   bool has_monospace_lsbs = (hmtx_flags & 2) == 0;
 
@@ -741,75 +1001,486 @@ bool ReconstructTransformedHmtx(std::span<const uint8_t> transformed_buf,
     return FONT_COMPRESSION_FAILURE();
   }
 
-  for (uint16_t i = 0; i < num_hmetrics; i++) {
-    uint16_t advance_width;
-    if (PREDICT_FALSE(!hmtx_buff_in.ReadU16(&advance_width))) {
-      return FONT_COMPRESSION_FAILURE();
-    }
-    advance_widths.push_back(advance_width);
+  // The advance widths come first, then the lsbs of the proportional glyphs
+  // and those of the monospace glyphs, each only if it wasn't dropped. With
+  // the size checked up front, the table is written in a single pass.
+  const size_t num_monospace = num_glyphs - num_hmetrics;
+  const size_t proportional_offset = 1 + 2 * num_hmetrics;
+  const size_t monospace_offset =
+      proportional_offset + (has_proportional_lsbs ? 2 * num_hmetrics : 0);
+  const size_t transformed_size =
+      monospace_offset + (has_monospace_lsbs ? 2 * num_monospace : 0);
+  if (PREDICT_FALSE(transformed_buf.size() < transformed_size)) {
+    return FONT_COMPRESSION_FAILURE();
   }
 
-  for (uint16_t i = 0; i < num_hmetrics; i++) {
-    int16_t lsb;
+  // bake me a shiny new hmtx table
+  scratch->hmtx.resize(2 * num_glyphs + 2 * num_hmetrics);
+  const uint8_t* advance_widths = transformed_buf.data() + 1;
+  const uint8_t* proportional_lsbs =
+      transformed_buf.data() + proportional_offset;
+  const uint8_t* monospace_lsbs = transformed_buf.data() + monospace_offset;
+  uint8_t* dst = scratch->hmtx.data();
+  for (size_t i = 0; i < num_hmetrics; ++i) {
+    memcpy(dst, advance_widths + 2 * i, 2);
     if (has_proportional_lsbs) {
-      if (PREDICT_FALSE(!hmtx_buff_in.ReadS16(&lsb))) {
-        return FONT_COMPRESSION_FAILURE();
-      }
+      memcpy(dst + 2, proportional_lsbs + 2 * i, 2);
     } else {
-      lsb = x_mins[i];
+      dst[2] = x_mins[i] >> 8;
+      dst[3] = x_mins[i];
+    }
+    dst += 4;
+  }
+  if (has_monospace_lsbs) {
+    memcpy(dst, monospace_lsbs, 2 * num_monospace);
+  } else {
+    for (size_t i = num_hmetrics; i < num_glyphs; ++i) {
+      dst[0] = x_mins[i] >> 8;
+      dst[1] = x_mins[i];
+      dst += 2;
     }
-    lsbs.push_back(lsb);
   }
 
-  for (uint16_t i = num_hmetrics; i < num_glyphs; i++) {
-    int16_t lsb;
-    if (has_monospace_lsbs) {
-      if (PREDICT_FALSE(!hmtx_buff_in.ReadS16(&lsb))) {
-        return FONT_COMPRESSION_FAILURE();
+  *checksum = 0;
+  if (PREDICT_FALSE(!out->WriteWithChecksum(
+          scratch->hmtx.data(), scratch->hmtx.size(), checksum))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  return true;
+}
+
+// Keeps the blocks Brotli's decoder frees, to hand them out again to later
+// decoders instead of going back to malloc.
+class BrotliMemoryPool {
+ public:
+  BrotliMemoryPool()
+      : budget_(NULL), verified_(NULL), verified_id_(0),
+        verified_data_size_(0), verified_primer_size_(0) {}
+  ~BrotliMemoryPool() { Clear(); }
+
+  BrotliMemoryPool(const BrotliMemoryPool&) = delete;
+  BrotliMemoryPool& operator=(const BrotliMemoryPool&) = delete;
+
+  // Creates a decoder whose memory comes from this pool. It must be destroyed
+  // before the pool is. With a dictionary, the decoder has been given its
+  // primer, and goes on from there.
+  BrotliDecoderState* CreateDecoder(const WOFF2Dictionary* dictionary = NULL) {
+    BrotliDecoderState* state =
+        BrotliDecoderCreateInstance(&Alloc, &Free, this);
+    if (state != NULL && dictionary != NULL && !Prime(state, *dictionary)) {
+      BrotliDecoderDestroyInstance(state);
+      return NULL;
+    }
+    return state;
+  }
+
+  // Charges the blocks the decoders take, and the primer, to budget from now
+  // on; a decoder that would go over it fails.
+  void set_budget(MemoryBudget* budget) { budget_ = budget; }
+
+  void Clear() {
+    for (Block* block : free_blocks_) {
+      free(block);
+    }
+    free_blocks_.clear();
+    std::vector<uint8_t>().swap(primer_buf_);
+    verified_ = NULL;
+  }
+
+ private:
+  // Decodes the primer, which must give exactly the dictionary data, and
+  // consume all of the primer without ending the stream. The data comes out
+  // a chunk at a time, and is only compared with the dictionary the first
+  // time this pool primes with it.
+  bool Prime(BrotliDecoderState* state, const WOFF2Dictionary& dictionary) {
+    const size_t chunk_size =
+        std::min<size_t>(dictionary.data.size() + 1, kStreamChunkSize);
+    if (PREDICT_FALSE(budget_ != NULL && !budget_->Charge(chunk_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    const bool verify = !IsVerified(dictionary);
+    primer_buf_.resize(chunk_size);
+    size_t available_in = dictionary.primer.size();
+    const uint8_t* next_in =
+        reinterpret_cast<const uint8_t*>(dictionary.primer.data());
+    size_t position = 0;
+    bool matches = true;
+    BrotliDecoderResult result;
+    do {
+      size_t available_out = chunk_size;
+      uint8_t* next_out = primer_buf_.data();
+      result = BrotliDecoderDecompressStream(
+          state, &available_in, &next_in, &available_out, &next_out, NULL);
+      const size_t n = chunk_size - available_out;
+      if (n > dictionary.data.size() - position) {
+        matches = false;
+        break;
+      }
+      if (verify && std::memcmp(primer_buf_.data(),
+                                dictionary.data.data() + position, n) != 0) {
+        matches = false;
+        break;
+      }
+      position += n;
+    } while (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+    if (budget_ != NULL) {
+      budget_->Release(chunk_size);
+    }
+    if (PREDICT_FALSE(!matches ||
+                      result != BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT ||
+                      position != dictionary.data.size())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (verify) {
+      verified_ = &dictionary;
+      verified_id_ = dictionary.id;
+      verified_data_size_ = dictionary.data.size();
+      verified_primer_size_ = dictionary.primer.size();
+    }
+    return true;
+  }
+
+  // Whether dictionary is the one whose primer has been seen to give its
+  // data.
+  bool IsVerified(const WOFF2Dictionary& dictionary) const {
+    return verified_ == &dictionary && verified_id_ == dictionary.id &&
+           verified_data_size_ == dictionary.data.size() &&
+           verified_primer_size_ == dictionary.primer.size();
+  }
+
+  // used is what the decoder asked for, which is what the budget is
+  // charged, so that it doesn't depend on what earlier decoders left.
+  struct alignas(std::max_align_t) Block {
+    size_t size;
+    size_t used;
+  };
+
+  static void* Alloc(void* opaque, size_t size) {
+    BrotliMemoryPool* pool = static_cast<BrotliMemoryPool*>(opaque);
+    std::vector<Block*>& blocks = pool->free_blocks_;
+    // Take the smallest free block that fits, unless it is more than twice
+    // the size needed; the ring buffer shouldn't end up holding a bit table.
+    size_t best = blocks.size();
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      size_t block_size = blocks[i]->size;
+      if (block_size >= size && block_size / 2 <= size &&
+          (best == blocks.size() || block_size < blocks[best]->size)) {
+        best = i;
       }
+    }
+    if (PREDICT_FALSE(pool->budget_ != NULL && !pool->budget_->Charge(size))) {
+      return NULL;
+    }
+    Block* block;
+    if (best < blocks.size()) {
+      block = blocks[best];
+      blocks[best] = blocks.back();
+      blocks.pop_back();
     } else {
-      lsb = x_mins[i];
+      if (PREDICT_FALSE(size > std::numeric_limits<size_t>::max() -
+                               sizeof(Block))) {
+        return NULL;
+      }
+      block = static_cast<Block*>(malloc(sizeof(Block) + size));
+      if (PREDICT_FALSE(block == NULL)) {
+        if (pool->budget_ != NULL) {
+          pool->budget_->Release(size);
+        }
+        return NULL;
+      }
+      block->size = size;
     }
-    lsbs.push_back(lsb);
+    block->used = size;
+    return block + 1;
   }
 
-  // bake me a shiny new hmtx table
-  std::vector<uint8_t> hmtx_table(2 * num_glyphs + 2 * num_hmetrics);
-  std::span<uint8_t> hmtx_table_view(hmtx_table);
-  size_t hmtx_table_view_offset = 0;
-  for (uint32_t i = 0; i < num_glyphs; i++) {
-    if (i < num_hmetrics) {
-      Store16(advance_widths[i], &hmtx_table_view_offset, hmtx_table_view);
+  static void Free(void* opaque, void* address) {
+    if (address != NULL) {
+      BrotliMemoryPool* pool = static_cast<BrotliMemoryPool*>(opaque);
+      Block* block = static_cast<Block*>(address) - 1;
+      if (pool->budget_ != NULL) {
+        pool->budget_->Release(block->used);
+      }
+      pool->free_blocks_.push_back(block);
     }
-    Store16(lsbs[i], &hmtx_table_view_offset, hmtx_table_view);
   }
 
-  *checksum = ComputeULongSum(hmtx_table_view);
-  if (PREDICT_FALSE(
-          !out->Write(hmtx_table_view.data(), hmtx_table_view.size()))) {
+  MemoryBudget* budget_;
+  std::vector<Block*> free_blocks_;
+  std::vector<uint8_t> primer_buf_;
+  // The last dictionary that was verified, as it was then.
+  const WOFF2Dictionary* verified_;
+  uint16_t verified_id_;
+  size_t verified_data_size_;
+  size_t verified_primer_size_;
+};
+
+// Everything a decode may keep around for the next one.
+struct DecodeScratch {
+  WOFF2Header hdr;
+  RebuildMetadata metadata;
+  BrotliMemoryPool brotli_pool;
+  // The whole font data stream of a collection.
+  std::vector<uint8_t> uncompressed_buf;
+  // The table being reconstructed, or part of it, for a single font.
+  std::vector<uint8_t> table_buf;
+  std::vector<uint8_t> chunk_buf;
+  std::vector<uint8_t> header_buf;
+  std::vector<Table> sorted_tables;
+  TableScratch tables;
+  // What the current decode has taken, with how much of uncompressed_buf,
+  // table_buf and chunk_buf has been charged to it.
+  MemoryBudget budget;
+  size_t uncompressed_charged = 0;
+  size_t table_charged = 0;
+  size_t chunk_charged = 0;
+};
+
+bool Woff2Uncompress(std::span<uint8_t> dst_buf,
+                     std::span<const uint8_t> src_buf,
+                     const WOFF2Dictionary* dictionary,
+                     BrotliMemoryPool* pool) {
+  BrotliDecoderState* state = pool->CreateDecoder(dictionary);
+  if (PREDICT_FALSE(state == NULL)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  size_t available_in = src_buf.size();
+  const uint8_t* next_in = src_buf.data();
+  size_t available_out = dst_buf.size_bytes();
+  uint8_t* next_out = dst_buf.data();
+  BrotliDecoderResult result = BrotliDecoderDecompressStream(
+      state, &available_in, &next_in, &available_out, &next_out, NULL);
+  BrotliDecoderDestroyInstance(state);
+  if (PREDICT_FALSE(result != BROTLI_DECODER_RESULT_SUCCESS ||
+                    available_out != 0)) {
     return FONT_COMPRESSION_FAILURE();
   }
-
   return true;
 }
 
-bool Woff2Uncompress(std::span<uint8_t> dst_buf,
-                     std::span<const uint8_t> src_buf) {
-  size_t uncompressed_size = dst_buf.size_bytes();
-  BrotliDecoderResult result = BrotliDecoderDecompress(
-      src_buf.size(), src_buf.data(), &uncompressed_size, dst_buf.data());
-  if (PREDICT_FALSE(result != BROTLI_DECODER_RESULT_SUCCESS ||
-                    uncompressed_size != dst_buf.size_bytes())) {
+// Decompresses the first dst_buf.size() bytes of the stream in src_buf,
+// leaving the rest of it alone.
+bool Woff2UncompressPrefix(std::span<uint8_t> dst_buf,
+                           std::span<const uint8_t> src_buf,
+                           const WOFF2Dictionary* dictionary,
+                           BrotliMemoryPool* pool) {
+  BrotliDecoderState* state = pool->CreateDecoder(dictionary);
+  if (PREDICT_FALSE(state == NULL)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  size_t available_in = src_buf.size();
+  const uint8_t* next_in = src_buf.data();
+  size_t available_out = dst_buf.size_bytes();
+  uint8_t* next_out = dst_buf.data();
+  // Runs until the output is full, unless the stream is corrupt or ends
+  // too early.
+  BrotliDecoderResult result = BrotliDecoderDecompressStream(
+      state, &available_in, &next_in, &available_out, &next_out, NULL);
+  BrotliDecoderDestroyInstance(state);
+  if (PREDICT_FALSE(result == BROTLI_DECODER_RESULT_ERROR ||
+                    available_out != 0)) {
     return FONT_COMPRESSION_FAILURE();
   }
   return true;
 }
 
+/**
+ * Supplies the uncompressed (but possibly transformed) data of each table to
+ * ReconstructFont.
+ */
+class TableSource {
+ public:
+  virtual ~TableSource() {}
+
+  // Makes the complete data of table available in *data. The data stays valid
+  // until the next call on this source.
+  virtual bool ReadTable(const Table& table,
+                         std::span<const uint8_t>* data) = 0;
+
+  // Writes the data of table to out, adding its checksum to *checksum.
+  virtual bool CopyTable(const Table& table, uint32_t* checksum,
+                         WOFF2Out* out) = 0;
+};
+
+// Serves tables from the fully decompressed font data stream.
+class BufferedTableSource : public TableSource {
+ public:
+  explicit BufferedTableSource(std::span<const uint8_t> uncompressed_buf)
+      : uncompressed_buf_(uncompressed_buf) {}
+
+  bool ReadTable(const Table& table,
+                 std::span<const uint8_t>* data) override {
+    // TODO(user) a collection with optimized hmtx that reused glyf/loca
+    // would fail. We don't optimize hmtx for collections yet.
+    if (PREDICT_FALSE(static_cast<uint64_t>(table.src_offset) + table.src_length
+        > uncompressed_buf_.size())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    *data = uncompressed_buf_.subspan(table.src_offset, table.src_length);
+    return true;
+  }
+
+  bool CopyTable(const Table& table, uint32_t* checksum,
+                 WOFF2Out* out) override {
+    std::span<const uint8_t> data;
+    if (PREDICT_FALSE(!ReadTable(table, &data))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (PREDICT_FALSE(
+            !out->WriteWithChecksum(data.data(), data.size_bytes(), checksum))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    return true;
+  }
+
+ private:
+  std::span<const uint8_t> uncompressed_buf_;
+};
+
+// Decompresses the font data stream incrementally, as tables are requested.
+// Tables must be requested in the order they are stored in the stream, which
+// is the case for everything but collections. Only the table currently being
+// reconstructed is held in memory, and tables that are not transformed are
+// passed through to the output in fixed size chunks.
+class StreamingTableSource : public TableSource {
+ public:
+  StreamingTableSource(std::span<const uint8_t> compressed_buf,
+                       uint32_t uncompressed_size,
+                       const WOFF2Dictionary* dictionary,
+                       DecodeScratch* scratch, StatsRecorder* recorder)
+      : state_(scratch->brotli_pool.CreateDecoder(dictionary)),
+        next_in_(compressed_buf.data()),
+        available_in_(compressed_buf.size()),
+        uncompressed_size_(uncompressed_size),
+        position_(0),
+        table_buf_(scratch->table_buf),
+        chunk_buf_(scratch->chunk_buf),
+        budget_(scratch->budget),
+        table_charged_(scratch->table_charged),
+        chunk_charged_(scratch->chunk_charged),
+        recorder_(recorder) {}
+
+  ~StreamingTableSource() override {
+    if (state_) {
+      BrotliDecoderDestroyInstance(state_);
+    }
+  }
+
+  bool ReadTable(const Table& table,
+                 std::span<const uint8_t>* data) override {
+    if (PREDICT_FALSE(table.src_offset != position_)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (PREDICT_FALSE(!budget_.ChargeUpTo(table.src_length,
+                                          &table_charged_))) {
+      recorder_->Fail(WOFF2Failure::kMemoryLimit, table.tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (table_buf_.size() < table.src_length) {
+      recorder_->Grew(WOFF2Buffer::kTable, table_buf_.size(),
+                      table.src_length);
+      table_buf_.resize(table.src_length);
+    }
+    std::span<uint8_t> table_data =
+        std::span(table_buf_).first(table.src_length);
+    *data = table_data;
+    return Decompress(table_data);
+  }
+
+  bool CopyTable(const Table& table, uint32_t* checksum,
+                 WOFF2Out* out) override {
+    if (PREDICT_FALSE(table.src_offset != position_)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    // Every chunk but the last is a multiple of 4 long, so summing the chunks
+    // gives the checksum of the whole table.
+    uint32_t remaining = table.src_length;
+    if (remaining > 0 && PREDICT_FALSE(!budget_.ChargeUpTo(kStreamChunkSize,
+                                                           &chunk_charged_))) {
+      recorder_->Fail(WOFF2Failure::kMemoryLimit, table.tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (remaining > 0 && chunk_buf_.size() < kStreamChunkSize) {
+      chunk_buf_.resize(kStreamChunkSize);
+    }
+    while (remaining > 0) {
+      std::span<uint8_t> chunk(chunk_buf_.data(),
+                               std::min<uint32_t>(remaining, kStreamChunkSize));
+      if (PREDICT_FALSE(!Decompress(chunk))) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      if (PREDICT_FALSE(!out->WriteWithChecksum(chunk.data(),
+                                                chunk.size_bytes(),
+                                                checksum))) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      remaining -= chunk.size();
+    }
+    return true;
+  }
+
+  // Returns true if the whole stream was consumed, and it held exactly the
+  // announced amount of data.
+  bool Finish() {
+    ScopedPhase phase(recorder_, WOFF2Phase::kBrotli);
+    size_t available_out = 0;
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(
+        state_, &available_in_, &next_in_, &available_out, NULL, NULL);
+    if (PREDICT_FALSE(result != BROTLI_DECODER_RESULT_SUCCESS ||
+                      position_ != uncompressed_size_)) {
+      recorder_->Fail(BrotliFailure(budget_));
+      return FONT_COMPRESSION_FAILURE();
+    }
+    return true;
+  }
+
+ private:
+  bool Decompress(std::span<uint8_t> dst) {
+    ScopedPhase phase(recorder_, WOFF2Phase::kBrotli);
+    if (PREDICT_FALSE(state_ == NULL ||
+                      dst.size() > uncompressed_size_ - position_)) {
+      recorder_->Fail(BrotliFailure(budget_));
+      return FONT_COMPRESSION_FAILURE();
+    }
+    uint8_t* next_out = dst.data();
+    size_t available_out = dst.size();
+    while (available_out > 0) {
+      BrotliDecoderResult result = BrotliDecoderDecompressStream(
+          state_, &available_in_, &next_in_, &available_out, &next_out, NULL);
+      // We have all the input there is, so needing more is an error too.
+      if (PREDICT_FALSE(result == BROTLI_DECODER_RESULT_ERROR ||
+                        result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT ||
+                        (result == BROTLI_DECODER_RESULT_SUCCESS &&
+                         available_out > 0))) {
+        recorder_->Fail(BrotliFailure(budget_));
+        return FONT_COMPRESSION_FAILURE();
+      }
+    }
+    position_ += dst.size();
+    return true;
+  }
+
+  BrotliDecoderState* state_;
+  const uint8_t* next_in_;
+  size_t available_in_;
+  const uint32_t uncompressed_size_;
+  uint32_t position_;
+  std::vector<uint8_t>& table_buf_;
+  std::vector<uint8_t>& chunk_buf_;
+  MemoryBudget& budget_;
+  size_t& table_charged_;
+  size_t& chunk_charged_;
+  StatsRecorder* recorder_;
+};
+
+// If entries is set, the directory is also added to it as it is in the file.
 bool ReadTableDirectory(Buffer* file, std::vector<Table>* tables,
-    size_t num_tables) {
+    size_t num_tables, std::vector<Woff2Directory::Table>* entries = NULL) {
   uint32_t src_offset = 0;
   for (size_t i = 0; i < num_tables; ++i) {
     Table* table = &(*tables)[i];
+    const size_t entry_offset = file->offset();
     uint8_t flag_byte;
     if (PREDICT_FALSE(!file->ReadU8(&flag_byte))) {
       return FONT_COMPRESSION_FAILURE();
@@ -859,6 +1530,18 @@ bool ReadTableDirectory(Buffer* file, std::vector<Table>* tables,
     table->flags = flags;
     table->transform_length = transform_length;
     table->dst_length = dst_length;
+
+    if (entries) {
+      Woff2Directory::Table entry;
+      entry.tag = tag;
+      entry.flags = flag_byte;
+      entry.transformed = (flags & kWoff2FlagsTransform) != 0;
+      entry.orig_length = dst_length;
+      entry.stream_offset = table->src_offset;
+      entry.stream_length = transform_length;
+      entry.entry_offset = entry_offset;
+      entries->push_back(entry);
+    }
   }
   return true;
 }
@@ -903,6 +1586,18 @@ uint64_t ComputeOffsetToFirstTable(const WOFF2Header& hdr) {
   return offset;
 }
 
+// Size of the decoded font: the headers, then each table once, padded to a
+// multiple of 4. The length of a transformed 'glyf' is taken from the
+// directory too, which is exact if the encoder laid out its glyphs as the
+// decoder does, as this library and most others do.
+uint64_t ComputeDecodedSize(const WOFF2Header& hdr) {
+  uint64_t size = ComputeOffsetToFirstTable(hdr);
+  for (const Table& table : hdr.tables) {
+    size += Round4(static_cast<uint64_t>(table.dst_length));
+  }
+  return size;
+}
+
 std::vector<Table*> Tables(WOFF2Header* hdr, size_t font_index) {
   std::vector<Table*> tables;
   if (PREDICT_FALSE(hdr->header_version)) {
@@ -917,21 +1612,10 @@ std::vector<Table*> Tables(WOFF2Header* hdr, size_t font_index) {
   return tables;
 }
 
-// Offset tables assumed to have been written in with 0's initially.
-// WOFF2Header isn't const so we can use [] instead of at() (which upsets FF)
-bool ReconstructFont(std::span<uint8_t> transformed_buf,
-                     RebuildMetadata* metadata,
-                     WOFF2Header* hdr,
-                     size_t font_index,
-                     WOFF2Out* out) {
-  size_t dest_offset = out->Size();
-  std::array<uint8_t, 12> table_entry;
-  WOFF2FontInfo* info = &metadata->font_infos[font_index];
-  std::vector<Table*> tables = Tables(hdr, font_index);
-
+bool CheckGlyfAndLoca(std::vector<Table*>* tables) {
   // 'glyf' without 'loca' doesn't make sense
-  const Table* glyf_table = FindTable(&tables, kGlyfTableTag);
-  const Table* loca_table = FindTable(&tables, kLocaTableTag);
+  const Table* glyf_table = FindTable(tables, kGlyfTableTag);
+  const Table* loca_table = FindTable(tables, kLocaTableTag);
   if (PREDICT_FALSE(static_cast<bool>(glyf_table) !=
                     static_cast<bool>(loca_table))) {
 #ifdef FONT_COMPRESSION_BIN
@@ -949,113 +1633,166 @@ bool ReconstructFont(std::span<uint8_t> transformed_buf,
       return FONT_COMPRESSION_FAILURE();
     }
   }
+  return true;
+}
 
-  uint32_t font_checksum = metadata->header_checksum;
-  if (hdr->header_version) {
-    font_checksum = hdr->ttc_fonts[font_index].header_checksum;
+bool IsTransformed(const Table& table) {
+  return (table.flags & kWoff2FlagsTransform) == kWoff2FlagsTransform;
+}
+
+// The phase that reconstructing table is charged to.
+WOFF2Phase TablePhase(const Table& table) {
+  if (!IsTransformed(table)) {
+    return WOFF2Phase::kTables;
   }
+  return table.tag == kHmtxTableTag ? WOFF2Phase::kHmtx : WOFF2Phase::kGlyf;
+}
 
-  uint32_t loca_checksum = 0;
-  for (size_t i = 0; i < tables.size(); i++) {
-    Table& table = *tables[i];
+// The reason reported when table can't be reconstructed.
+WOFF2Failure TableFailure(const Table& table) {
+  if (table.tag == kGlyfTableTag || table.tag == kLocaTableTag) {
+    return WOFF2Failure::kInvalidGlyf;
+  }
+  if (table.tag == kHmtxTableTag) {
+    return WOFF2Failure::kInvalidHmtx;
+  }
+  return WOFF2Failure::kInvalidTable;
+}
 
-    std::pair<uint32_t, uint32_t> checksum_key = {table.tag, table.src_offset};
-    bool reused = metadata->checksums.find(checksum_key)
-               != metadata->checksums.end();
-    if (PREDICT_FALSE(font_index == 0 && reused)) {
+// Sizes of the buffers of a TableScratch before a decode, to tell how much
+// they grew during it.
+struct TableScratchSizes {
+  explicit TableScratchSizes(const TableScratch& scratch)
+      : glyph(std::max(scratch.glyph.size(), kDefaultGlyphBuf)),
+        points(scratch.points.size()) {}
+
+  void RecordGrowth(const TableScratch& scratch,
+                    StatsRecorder* recorder) const {
+    recorder->Grew(WOFF2Buffer::kGlyph, glyph, scratch.glyph.size());
+    recorder->Grew(WOFF2Buffer::kPoints, points, scratch.points.size());
+  }
+
+  size_t glyph;
+  size_t points;
+};
+
+// Fetches the data of the tables we need to look at as a whole, and picks up
+// numberOfHMetrics from 'hhea' even when it is shared. Everything else is just
+// copied by ReconstructTable.
+bool PrepareTable(TableSource* source, const Table& table, bool reused,
+                  WOFF2FontInfo* info,
+                  std::span<const uint8_t>* table_data) {
+  if (table.tag == kHheaTableTag ||
+      (!reused && (IsTransformed(table) || table.tag == kHeadTableTag))) {
+    if (PREDICT_FALSE(!source->ReadTable(table, table_data))) {
       return FONT_COMPRESSION_FAILURE();
     }
+  }
 
-    // TODO(user) a collection with optimized hmtx that reused glyf/loca
-    // would fail. We don't optimize hmtx for collections yet.
-    if (PREDICT_FALSE(static_cast<uint64_t>(table.src_offset) + table.src_length
-        > transformed_buf.size())) {
+  if (table.tag == kHheaTableTag) {
+    if (!ReadNumHMetrics(*table_data, &info->num_hmetrics)) {
       return FONT_COMPRESSION_FAILURE();
     }
+  }
+  return true;
+}
 
-    std::span<uint8_t> transformed_table =
-        transformed_buf.subspan(table.src_offset, table.src_length);
-
-    if (table.tag == kHheaTableTag) {
-      if (!ReadNumHMetrics(
-              transformed_table,
-              &info->num_hmetrics)) {
+// Writes a table that hasn't been written before to out, at table->dst_offset.
+// A transformed 'glyf' is written together with its 'loca', whose checksum is
+// stored in *loca_checksum; the transformed 'loca' itself writes nothing.
+bool ReconstructTable(TableSource* source,
+                      std::span<const uint8_t> table_data,
+                      std::vector<Table*>* tables, Table* table,
+                      WOFF2FontInfo* info, TableScratch* scratch,
+                      uint32_t* checksum, uint32_t* loca_checksum,
+                      WOFF2Out* out) {
+  *checksum = 0;
+  if (!IsTransformed(*table)) {
+    if (table->tag == kHeadTableTag) {
+      if (PREDICT_FALSE(table->src_length < 12)) {
         return FONT_COMPRESSION_FAILURE();
       }
-    }
-
-    uint32_t checksum = 0;
-    if (!reused) {
-      if ((table.flags & kWoff2FlagsTransform) != kWoff2FlagsTransform) {
-        if (table.tag == kHeadTableTag) {
-          if (PREDICT_FALSE(table.src_length < 12)) {
-            return FONT_COMPRESSION_FAILURE();
-          }
-          // checkSumAdjustment = 0
-          StoreU32(transformed_table, 8, 0);
-        }
-        table.dst_offset = dest_offset;
-        checksum = ComputeULongSum(transformed_table);
-        if (PREDICT_FALSE(!out->Write(transformed_table.data(),
-                                      transformed_table.size_bytes()))) {
-          return FONT_COMPRESSION_FAILURE();
-        }
-      } else {
-        if (table.tag == kGlyfTableTag) {
-          table.dst_offset = dest_offset;
-
-          Table* loca_table = FindTable(&tables, kLocaTableTag);
-          if (PREDICT_FALSE(!ReconstructGlyf(transformed_table, &table,
-                                             &checksum, loca_table,
-                                             &loca_checksum, info, out))) {
-            return FONT_COMPRESSION_FAILURE();
-          }
-        } else if (table.tag == kLocaTableTag) {
-          // All the work was done by ReconstructGlyf. We already know checksum.
-          checksum = loca_checksum;
-        } else if (table.tag == kHmtxTableTag) {
-          table.dst_offset = dest_offset;
-          // Tables are sorted so all the info we need has been gathered.
-          if (PREDICT_FALSE(!ReconstructTransformedHmtx(
-                  transformed_table, info->num_glyphs, info->num_hmetrics,
-                  info->x_mins, &checksum, out))) {
-            return FONT_COMPRESSION_FAILURE();
-          }
-        } else {
-          return FONT_COMPRESSION_FAILURE();  // transform unknown
-        }
+      // checkSumAdjustment = 0. The source data is left alone, as it may be
+      // shared; the pieces start at multiples of 4 so their sums add up.
+      const uint8_t zeroes[4] = {0};
+      if (PREDICT_FALSE(
+              !out->WriteWithChecksum(table_data.data(), 8, checksum) ||
+              !out->WriteWithChecksum(zeroes, 4, checksum) ||
+              !out->WriteWithChecksum(table_data.data() + 12,
+                                      table_data.size_bytes() - 12,
+                                      checksum))) {
+        return FONT_COMPRESSION_FAILURE();
       }
-      metadata->checksums[checksum_key] = checksum;
-    } else {
-      checksum = metadata->checksums[checksum_key];
-    }
-    font_checksum += checksum;
-
-    // update the table entry with real values.
-    StoreU32(table_entry, 0, checksum);
-    StoreU32(table_entry, 4, table.dst_offset);
-    StoreU32(table_entry, 8, table.dst_length);
-    if (PREDICT_FALSE(!out->Write(table_entry.data(),
-        info->table_entry_by_tag[table.tag] + 4, table_entry.size()))) {
+    } else if (table->tag == kHheaTableTag) {
+      if (PREDICT_FALSE(!out->WriteWithChecksum(table_data.data(),
+                                                table_data.size_bytes(),
+                                                checksum))) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+    } else if (PREDICT_FALSE(!source->CopyTable(*table, checksum, out))) {
       return FONT_COMPRESSION_FAILURE();
     }
-
-    // We replaced 0's. Update overall checksum.
-    font_checksum += ComputeULongSum(table_entry);
-
-    if (PREDICT_FALSE(!Pad4(out))) {
+  } else if (table->tag == kGlyfTableTag) {
+    Table* loca_table = FindTable(tables, kLocaTableTag);
+    if (PREDICT_FALSE(!ReconstructGlyf(table_data, table, checksum, loca_table,
+                                       loca_checksum, info, scratch, out))) {
       return FONT_COMPRESSION_FAILURE();
     }
-
-    if (PREDICT_FALSE(static_cast<uint64_t>(table.dst_offset + table.dst_length)
-        > out->Size())) {
+  } else if (table->tag == kLocaTableTag) {
+    // All the work was done by ReconstructGlyf. We already know checksum.
+    *checksum = *loca_checksum;
+  } else if (table->tag == kHmtxTableTag) {
+    // Tables are sorted so all the info we need has been gathered.
+    if (PREDICT_FALSE(!ReconstructTransformedHmtx(
+            table_data, info->num_glyphs, info->num_hmetrics,
+            info->x_mins, scratch, checksum, out))) {
       return FONT_COMPRESSION_FAILURE();
     }
-    dest_offset = out->Size();
+  } else {
+    return FONT_COMPRESSION_FAILURE();  // transform unknown
+  }
+  return true;
+}
+
+// Fills in the table entry for table, pads the table and adds the checksums
+// to *font_checksum.
+bool FinishTable(const Table& table, uint32_t checksum,
+                 const WOFF2FontInfo& info, uint32_t* font_checksum,
+                 WOFF2Out* out) {
+  auto entry_offset = info.table_entry_by_tag.find(table.tag);
+  if (PREDICT_FALSE(entry_offset == info.table_entry_by_tag.end())) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  std::array<uint8_t, 12> table_entry;
+  *font_checksum += checksum;
+
+  // update the table entry with real values.
+  StoreU32(table_entry, 0, checksum);
+  StoreU32(table_entry, 4, table.dst_offset);
+  StoreU32(table_entry, 8, table.dst_length);
+  if (PREDICT_FALSE(!out->Write(table_entry.data(),
+      entry_offset->second + 4, table_entry.size()))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // We replaced 0's. Update overall checksum.
+  *font_checksum += ComputeULongSum(table_entry);
+
+  if (PREDICT_FALSE(!Pad4(out))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  if (PREDICT_FALSE(static_cast<uint64_t>(table.dst_offset + table.dst_length)
+      > out->Size())) {
+    return FONT_COMPRESSION_FAILURE();
   }
+  return true;
+}
 
-  // Update 'head' checkSumAdjustment. We already set it to 0 and summed font.
-  Table* head_table = FindTable(&tables, kHeadTableTag);
+// Update 'head' checkSumAdjustment. We already set it to 0 and summed font.
+bool WriteCheckSumAdjustment(std::vector<Table*>* tables,
+                             uint32_t font_checksum, WOFF2Out* out) {
+  Table* head_table = FindTable(tables, kHeadTableTag);
   if (head_table) {
     if (PREDICT_FALSE(head_table->dst_length < 12)) {
       return FONT_COMPRESSION_FAILURE();
@@ -1068,89 +1805,401 @@ bool ReconstructFont(std::span<uint8_t> transformed_buf,
       return FONT_COMPRESSION_FAILURE();
     }
   }
-
   return true;
 }
 
-bool ReadWOFF2Header(std::span<const uint8_t> input_data, WOFF2Header* hdr) {
-  Buffer file(input_data);
-
-  uint32_t signature;
-  if (PREDICT_FALSE(!file.ReadU32(&signature) || signature != kWoff2Signature ||
-      !file.ReadU32(&hdr->flavor))) {
-    return FONT_COMPRESSION_FAILURE();
+uint32_t InitialFontChecksum(const RebuildMetadata& metadata,
+                             const WOFF2Header& hdr, size_t font_index) {
+  if (hdr.header_version) {
+    return hdr.ttc_fonts[font_index].header_checksum;
   }
+  return metadata.header_checksum;
+}
 
-  // TODO(user): Should call IsValidVersionTag() here.
+// How far the reconstruction of a font has got.
+struct FontRebuild {
+  size_t font_index;
+  std::vector<Table*> tables;
+  // The next of tables to reconstruct.
+  size_t next_table;
+  uint32_t font_checksum;
+  uint32_t loca_checksum;
+};
 
-  uint32_t reported_length;
-  if (PREDICT_FALSE(!file.ReadU32(&reported_length) ||
-                    input_data.size() != reported_length)) {
+// Prepares *rebuild for reconstructing the tables of font_index one by one.
+bool StartFont(const RebuildMetadata& metadata, WOFF2Header* hdr,
+               size_t font_index, StatsRecorder* recorder,
+               FontRebuild* rebuild) {
+  rebuild->font_index = font_index;
+  rebuild->tables = Tables(hdr, font_index);
+  rebuild->next_table = 0;
+  rebuild->font_checksum = InitialFontChecksum(metadata, *hdr, font_index);
+  rebuild->loca_checksum = 0;
+  if (PREDICT_FALSE(!CheckGlyfAndLoca(&rebuild->tables))) {
+    recorder->Fail(WOFF2Failure::kInvalidGlyf, kGlyfTableTag);
     return FONT_COMPRESSION_FAILURE();
   }
-  if (PREDICT_FALSE(!file.ReadU16(&hdr->num_tables) || !hdr->num_tables)) {
+  return true;
+}
+
+// Reconstructs the next table of the font, or takes its checksum from the
+// font that already did, and fills in its table entry.
+// Offset tables assumed to have been written in with 0's initially.
+bool ReconstructNextTable(TableSource* source, RebuildMetadata* metadata,
+                          TableScratch* scratch, StatsRecorder* recorder,
+                          FontRebuild* rebuild, WOFF2Out* out) {
+  const size_t font_index = rebuild->font_index;
+  WOFF2FontInfo* info = &metadata->font_infos[font_index];
+  Table& table = *rebuild->tables[rebuild->next_table++];
+
+  // The checksum is filled in below by the first font to write the table.
+  auto known = metadata->checksums.insert({{table.tag, table.src_offset}, 0});
+  uint32_t* known_checksum = &known.first->second;
+  bool reused = !known.second;
+  if (PREDICT_FALSE(font_index == 0 && reused)) {
+    recorder->Fail(WOFF2Failure::kInvalidHeader, table.tag);
     return FONT_COMPRESSION_FAILURE();
   }
 
-  // We don't care about these fields of the header:
-  //   uint16_t reserved
-  //   uint32_t total_sfnt_size, we don't believe this, will compute later
-  if (PREDICT_FALSE(!file.Skip(6))) {
+  ScopedPhase table_phase(recorder, TablePhase(table));
+  std::span<const uint8_t> table_data;
+  if (PREDICT_FALSE(!PrepareTable(source, table, reused, info,
+                                  &table_data))) {
+    recorder->Fail(TableFailure(table), table.tag);
     return FONT_COMPRESSION_FAILURE();
   }
-  uint32_t compressed_length;
-  if (PREDICT_FALSE(!file.ReadU32(&compressed_length))) {
-    return FONT_COMPRESSION_FAILURE();
+
+  uint32_t checksum = 0;
+  if (!reused) {
+    if (table.tag != kLocaTableTag || !IsTransformed(table)) {
+      table.dst_offset = out->Size();
+    }
+    if (PREDICT_FALSE(!ReconstructTable(source, table_data, &rebuild->tables,
+                                        &table, info, scratch, &checksum,
+                                        &rebuild->loca_checksum, out))) {
+      recorder->Fail(TableFailure(table), table.tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (PREDICT_FALSE(!ChargeScratch(scratch, *info))) {
+      recorder->Fail(WOFF2Failure::kMemoryLimit, table.tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    *known_checksum = checksum;
+  } else {
+    checksum = *known_checksum;
   }
-  // We don't care about these fields of the header:
-  //   uint16_t major_version, minor_version
-  if (PREDICT_FALSE(!file.Skip(2 * 2))) {
+
+  ScopedPhase checksum_phase(recorder, WOFF2Phase::kChecksum);
+  if (PREDICT_FALSE(!FinishTable(table, checksum, *info,
+                                 &rebuild->font_checksum, out))) {
+    recorder->Fail(WOFF2Failure::kInvalidTable, table.tag);
     return FONT_COMPRESSION_FAILURE();
   }
-  uint32_t meta_offset;
-  uint32_t meta_length;
-  uint32_t meta_length_orig;
-  if (PREDICT_FALSE(!file.ReadU32(&meta_offset) ||
-      !file.ReadU32(&meta_length) ||
-      !file.ReadU32(&meta_length_orig))) {
+  return true;
+}
+
+// Writes the checksum adjustment of a font whose tables are all done.
+bool FinishFont(FontRebuild* rebuild, StatsRecorder* recorder,
+                WOFF2Out* out) {
+  ScopedPhase checksum_phase(recorder, WOFF2Phase::kChecksum);
+  if (PREDICT_FALSE(!WriteCheckSumAdjustment(&rebuild->tables,
+                                             rebuild->font_checksum, out))) {
+    recorder->Fail(WOFF2Failure::kInvalidTable, kHeadTableTag);
     return FONT_COMPRESSION_FAILURE();
   }
-  if (meta_offset) {
-    if (PREDICT_FALSE(meta_offset >= input_data.size() ||
-                      input_data.size() - meta_offset < meta_length)) {
-      return FONT_COMPRESSION_FAILURE();
-    }
-  }
-  uint32_t priv_offset;
-  uint32_t priv_length;
-  if (PREDICT_FALSE(!file.ReadU32(&priv_offset) ||
-      !file.ReadU32(&priv_length))) {
+  return true;
+}
+
+// WOFF2Header isn't const so we can use [] instead of at() (which upsets FF)
+bool ReconstructFont(TableSource* source,
+                     RebuildMetadata* metadata,
+                     WOFF2Header* hdr,
+                     size_t font_index,
+                     TableScratch* scratch,
+                     StatsRecorder* recorder,
+                     WOFF2Out* out) {
+  FontRebuild rebuild;
+  if (PREDICT_FALSE(!StartFont(*metadata, hdr, font_index, recorder,
+                               &rebuild))) {
     return FONT_COMPRESSION_FAILURE();
   }
-  if (priv_offset) {
-    if (PREDICT_FALSE(priv_offset >= input_data.size() ||
-                      input_data.size() - priv_offset < priv_length)) {
+  while (rebuild.next_table < rebuild.tables.size()) {
+    if (PREDICT_FALSE(!ReconstructNextTable(source, metadata, scratch,
+                                            recorder, &rebuild, out))) {
       return FONT_COMPRESSION_FAILURE();
     }
   }
-  hdr->tables.resize(hdr->num_tables);
-  if (PREDICT_FALSE(!ReadTableDirectory(
-          &file, &hdr->tables, hdr->num_tables))) {
-    return FONT_COMPRESSION_FAILURE();
-  }
+  return FinishFont(&rebuild, recorder, out);
+}
 
-  // Before we sort for output the last table end is the uncompressed size.
-  Table& last_table = hdr->tables.back();
-  hdr->uncompressed_size = last_table.src_offset + last_table.src_length;
-  if (PREDICT_FALSE(hdr->uncompressed_size < last_table.src_offset)) {
+// A table reconstructed on its own, before being placed in the output.
+struct ReconstructedTable {
+  // For a transformed 'glyf' this is followed by the 'loca' data.
+  std::string data;
+  uint32_t checksum;
+};
+
+// Identifies the first use of each table, as the font and the position in
+// its table list. Later uses, in the same font or in later ones, get to
+// reuse its data.
+typedef FlatMap<std::pair<uint32_t, uint32_t>, std::pair<size_t, size_t>>
+    TableOwnerMap;
+
+size_t TableIndex(const WOFF2Header& hdr, const Table* table) {
+  return table - hdr.tables.data();
+}
+
+// Reconstructs the tables of font_index that no earlier font uses into their
+// own entries of *slots, with offsets relative to the start of each entry.
+// The entries are charged to budget, and *slot_bytes receives how much they
+// were charged. Safe to run for several fonts of a collection concurrently.
+bool ReconstructFontTables(TableSource* source, WOFF2Header* hdr,
+                           size_t font_index, const TableOwnerMap& owners,
+                           WOFF2FontInfo* info,
+                           std::vector<ReconstructedTable>* slots,
+                           MemoryBudget* budget, size_t* slot_bytes,
+                           StatsRecorder* recorder) {
+  std::vector<Table*> tables = Tables(hdr, font_index);
+
+  if (PREDICT_FALSE(!CheckGlyfAndLoca(&tables))) {
+    recorder->Fail(WOFF2Failure::kInvalidGlyf, kGlyfTableTag);
     return FONT_COMPRESSION_FAILURE();
   }
 
-  hdr->header_version = 0;
-
-  if (hdr->flavor == kTtcFontFlavor) {
-    if (PREDICT_FALSE(!file.ReadU32(&hdr->header_version))) {
-      return FONT_COMPRESSION_FAILURE();
+  TableScratch scratch;
+  scratch.budget = budget;
+  const TableScratchSizes initial_sizes(scratch);
+  uint32_t loca_checksum = 0;
+  bool glyf_reused = false;
+  for (size_t i = 0; i < tables.size(); i++) {
+    Table* table = tables[i];
+    size_t table_index = TableIndex(*hdr, table);
+    bool reused = owners.at({table->tag, table->src_offset}) !=
+        std::make_pair(font_index, i);
+    if (PREDICT_FALSE(font_index == 0 && reused)) {
+      recorder->Fail(WOFF2Failure::kInvalidHeader, table->tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    // A transformed 'loca' is written by its 'glyf', so the two have to be
+    // owned by the same font for the fonts to be independent.
+    if (table->tag == kGlyfTableTag) {
+      glyf_reused = reused;
+    } else if (table->tag == kLocaTableTag && IsTransformed(*table) &&
+               PREDICT_FALSE(reused != glyf_reused)) {
+      recorder->Fail(WOFF2Failure::kInvalidHeader, table->tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+
+    ScopedPhase table_phase(recorder, TablePhase(*table));
+    std::span<const uint8_t> table_data;
+    if (PREDICT_FALSE(!PrepareTable(source, *table, reused, info,
+                                    &table_data))) {
+      recorder->Fail(TableFailure(*table), table->tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (reused) {
+      continue;
+    }
+
+    ReconstructedTable& slot = (*slots)[table_index];
+    WOFF2StringOut slot_out(&slot.data);
+    slot_out.SetMaxSize(std::numeric_limits<size_t>::max());
+    if (table->tag != kLocaTableTag || !IsTransformed(*table)) {
+      table->dst_offset = 0;
+    }
+    if (PREDICT_FALSE(!ReconstructTable(source, table_data, &tables, table,
+                                        info, &scratch, &slot.checksum,
+                                        &loca_checksum, &slot_out))) {
+      recorder->Fail(TableFailure(*table), table->tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (PREDICT_FALSE(!ChargeScratch(&scratch, *info) ||
+                      !budget->Charge(slot.data.capacity()))) {
+      recorder->Fail(WOFF2Failure::kMemoryLimit, table->tag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    *slot_bytes += slot.data.capacity();
+  }
+  initial_sizes.RecordGrowth(scratch, recorder);
+  budget->Release(scratch.charged);
+  return true;
+}
+
+// Reconstructs the fonts of a collection on several threads, then lays out
+// the tables exactly as ReconstructFont would have done one font at a time.
+bool ReconstructCollection(TableSource* source, RebuildMetadata* metadata,
+                           WOFF2Header* hdr, int num_threads,
+                           MemoryBudget* budget, StatsRecorder* recorder,
+                           WOFF2Out* out) {
+  const size_t num_fonts = hdr->ttc_fonts.size();
+  TableOwnerMap owners;
+  for (size_t i = 0; i < num_fonts; i++) {
+    std::vector<Table*> tables = Tables(hdr, i);
+    for (size_t j = 0; j < tables.size(); j++) {
+      owners.insert({{tables[j]->tag, tables[j]->src_offset}, {i, j}});
+    }
+  }
+
+  std::vector<ReconstructedTable> slots(hdr->tables.size());
+  // Each font records on its own thread, into its own recorder.
+  std::vector<StatsRecorder> font_recorders(num_fonts,
+                                            StatsRecorder(recorder->stats()));
+  std::vector<size_t> slot_bytes(num_fonts);
+  bool ok = ParallelFor(num_fonts, num_threads, [&](size_t i) {
+    return ReconstructFontTables(source, hdr, i, owners,
+                                 &metadata->font_infos[i], &slots, budget,
+                                 &slot_bytes[i], &font_recorders[i]);
+  });
+  for (const StatsRecorder& font_recorder : font_recorders) {
+    recorder->Merge(font_recorder);
+  }
+  if (PREDICT_FALSE(!ok)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  ScopedPhase output_phase(recorder, WOFF2Phase::kOutput);
+  std::vector<bool> written(hdr->tables.size());
+  for (size_t i = 0; i < num_fonts; i++) {
+    const WOFF2FontInfo& info = metadata->font_infos[i];
+    std::vector<Table*> tables = Tables(hdr, i);
+    uint32_t font_checksum = InitialFontChecksum(*metadata, *hdr, i);
+    for (Table* table : tables) {
+      std::pair<size_t, size_t> owner_pos =
+          owners.at({table->tag, table->src_offset});
+      size_t owner =
+          hdr->ttc_fonts[owner_pos.first].table_indices[owner_pos.second];
+      Table& owner_table = hdr->tables[owner];
+      const ReconstructedTable& slot = slots[owner];
+      if (!written[owner]) {
+        written[owner] = true;
+        if (table->tag == kGlyfTableTag && IsTransformed(*table)) {
+          // Place the 'loca' that was reconstructed along with 'glyf'.
+          Table* loca_table = FindTable(&tables, kLocaTableTag);
+          loca_table->dst_offset += out->Size();
+        }
+        if (table->tag != kLocaTableTag || !IsTransformed(*table)) {
+          owner_table.dst_offset = out->Size();
+          if (PREDICT_FALSE(!out->Write(slot.data.data(), slot.data.size()))) {
+            return FONT_COMPRESSION_FAILURE();
+          }
+        }
+      }
+      ScopedPhase checksum_phase(recorder, WOFF2Phase::kChecksum);
+      if (PREDICT_FALSE(!FinishTable(owner_table, slot.checksum, info,
+                                     &font_checksum, out))) {
+        recorder->Fail(WOFF2Failure::kInvalidTable, table->tag);
+        return FONT_COMPRESSION_FAILURE();
+      }
+    }
+    ScopedPhase checksum_phase(recorder, WOFF2Phase::kChecksum);
+    if (PREDICT_FALSE(!WriteCheckSumAdjustment(&tables, font_checksum, out))) {
+      recorder->Fail(WOFF2Failure::kInvalidTable, kHeadTableTag);
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  // The slots go once the fonts are laid out.
+  for (size_t bytes : slot_bytes) {
+    budget->Release(bytes);
+  }
+  return true;
+}
+
+// If directory is set, it also receives all the fields of the directories.
+// Reads the header and the directories of a file of file_length bytes, of
+// which input_data holds at least the start. compressed_buf only covers what
+// input_data holds of the compressed data.
+bool ReadWOFF2Header(std::span<const uint8_t> input_data, size_t file_length,
+                     WOFF2Header* hdr, Woff2Directory* directory = NULL) {
+  Buffer file(input_data);
+
+  uint32_t signature;
+  if (PREDICT_FALSE(!file.ReadU32(&signature) || signature != kWoff2Signature ||
+      !file.ReadU32(&hdr->flavor))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // TODO(user): Should call IsValidVersionTag() here.
+
+  uint32_t reported_length;
+  if (PREDICT_FALSE(!file.ReadU32(&reported_length) ||
+                    file_length != reported_length)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (PREDICT_FALSE(!file.ReadU16(&hdr->num_tables) || !hdr->num_tables)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // The decode doesn't care about these fields of the header:
+  //   uint16_t reserved, except as the id of a shared dictionary
+  //   uint32_t total_sfnt_size, we don't believe this, will compute later
+  uint16_t reserved;
+  uint32_t total_sfnt_size;
+  if (PREDICT_FALSE(!file.ReadU16(&reserved) ||
+                    !file.ReadU32(&total_sfnt_size))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  hdr->dictionary_id = reserved;
+  uint32_t compressed_length;
+  if (PREDICT_FALSE(!file.ReadU32(&compressed_length))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  // Nor about these:
+  //   uint16_t major_version, minor_version
+  uint16_t major_version;
+  uint16_t minor_version;
+  if (PREDICT_FALSE(!file.ReadU16(&major_version) ||
+                    !file.ReadU16(&minor_version))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  uint32_t meta_offset;
+  uint32_t meta_length;
+  uint32_t meta_length_orig;
+  if (PREDICT_FALSE(!file.ReadU32(&meta_offset) ||
+      !file.ReadU32(&meta_length) ||
+      !file.ReadU32(&meta_length_orig))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (meta_offset) {
+    if (PREDICT_FALSE(meta_offset >= file_length ||
+                      file_length - meta_offset < meta_length)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  uint32_t priv_offset;
+  uint32_t priv_length;
+  if (PREDICT_FALSE(!file.ReadU32(&priv_offset) ||
+      !file.ReadU32(&priv_length))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (priv_offset) {
+    if (PREDICT_FALSE(priv_offset >= file_length ||
+                      file_length - priv_offset < priv_length)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  hdr->tables.resize(hdr->num_tables);
+  if (directory) {
+    directory->tables.clear();
+    directory->tables.reserve(hdr->num_tables);
+  }
+  if (PREDICT_FALSE(!ReadTableDirectory(
+          &file, &hdr->tables, hdr->num_tables,
+          directory ? &directory->tables : NULL))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // Before we sort for output the last table end is the uncompressed size.
+  Table& last_table = hdr->tables.back();
+  hdr->uncompressed_size = last_table.src_offset + last_table.src_length;
+  if (PREDICT_FALSE(hdr->uncompressed_size < last_table.src_offset)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  hdr->header_version = 0;
+
+  if (hdr->flavor == kTtcFontFlavor) {
+    if (PREDICT_FALSE(!file.ReadU32(&hdr->header_version))) {
+      return FONT_COMPRESSION_FAILURE();
     }
     if (PREDICT_FALSE(hdr->header_version != 0x00010000
                    && hdr->header_version != 0x00020000)) {
@@ -1216,16 +2265,20 @@ bool ReadWOFF2Header(std::span<const uint8_t> input_data, WOFF2Header* hdr) {
                     std::numeric_limits<uint32_t>::max())) {
     return FONT_COMPRESSION_FAILURE();
   }
-  hdr->compressed_buf =
-      input_data.subspan(compressed_offset, compressed_length);
+  hdr->compressed_offset = compressed_offset;
+  hdr->compressed_length = compressed_length;
+  hdr->compressed_buf = input_data.subspan(
+      compressed_offset,
+      std::min<uint64_t>(compressed_length,
+                         input_data.size() - compressed_offset));
   uint64_t src_offset = Round4(compressed_offset + compressed_length);
 
-  if (PREDICT_FALSE(src_offset > input_data.size())) {
+  if (PREDICT_FALSE(src_offset > file_length)) {
 #ifdef FONT_COMPRESSION_BIN
     uint64_t dst_offset = first_table_offset;
     fprintf(stderr, "offset fail; src_offset %" PRIu64 " length %lu "
       "dst_offset %" PRIu64 "\n",
-      src_offset, input_data.size(), dst_offset);
+      src_offset, file_length, dst_offset);
 #endif
     return FONT_COMPRESSION_FAILURE();
   }
@@ -1249,29 +2302,67 @@ bool ReadWOFF2Header(std::span<const uint8_t> input_data, WOFF2Header* hdr) {
     }
   }
 
-  if (PREDICT_FALSE(src_offset != Round4(input_data.size()))) {
+  if (PREDICT_FALSE(src_offset != Round4(file_length))) {
     return FONT_COMPRESSION_FAILURE();
   }
 
+  if (directory) {
+    directory->flavor = hdr->flavor;
+    directory->length = reported_length;
+    directory->num_tables = hdr->num_tables;
+    directory->reserved = reserved;
+    directory->total_sfnt_size = total_sfnt_size;
+    directory->total_compressed_size = compressed_length;
+    directory->major_version = major_version;
+    directory->minor_version = minor_version;
+    directory->meta_offset = meta_offset;
+    directory->meta_length = meta_length;
+    directory->meta_orig_length = meta_length_orig;
+    directory->priv_offset = priv_offset;
+    directory->priv_length = priv_length;
+    directory->collection_version = hdr->header_version;
+    directory->fonts.resize(hdr->ttc_fonts.size());
+    for (size_t i = 0; i < hdr->ttc_fonts.size(); ++i) {
+      directory->fonts[i].flavor = hdr->ttc_fonts[i].flavor;
+      directory->fonts[i].table_indices = hdr->ttc_fonts[i].table_indices;
+    }
+    directory->compressed_offset = compressed_offset;
+    directory->stream_length = hdr->uncompressed_size;
+  }
+
   return true;
 }
 
+bool ReadWOFF2Header(std::span<const uint8_t> input_data, WOFF2Header* hdr,
+                     Woff2Directory* directory = NULL) {
+  return ReadWOFF2Header(input_data, input_data.size(), hdr, directory);
+}
+
 // Write everything before the actual table data
-bool WriteHeaders(RebuildMetadata* metadata, WOFF2Header* hdr, WOFF2Out* out) {
-  std::vector<uint8_t> output(ComputeOffsetToFirstTable(*hdr), 0);
+bool WriteHeaders(RebuildMetadata* metadata, WOFF2Header* hdr,
+                  DecodeScratch* scratch, WOFF2Out* out) {
+  std::vector<uint8_t>& output = scratch->header_buf;
+  output.assign(ComputeOffsetToFirstTable(*hdr), 0);
 
   // Re-order tables in output (OTSpec) order
-  std::vector<Table> sorted_tables(hdr->tables);
+  std::vector<Table>& sorted_tables = scratch->sorted_tables;
+  sorted_tables.assign(hdr->tables.begin(), hdr->tables.end());
   if (hdr->header_version) {
     // collection; we have to sort the table offset vector in each font
     for (auto& ttc_font : hdr->ttc_fonts) {
-      std::map<uint32_t, uint16_t> sorted_index_by_tag;
-      for (auto table_index : ttc_font.table_indices) {
-        sorted_index_by_tag[hdr->tables[table_index].tag] = table_index;
-      }
-      uint16_t index = 0;
-      for (auto& i : sorted_index_by_tag) {
-        ttc_font.table_indices[index++] = i.second;
+      std::sort(ttc_font.table_indices.begin(), ttc_font.table_indices.end(),
+                [hdr](uint16_t a, uint16_t b) {
+                  return hdr->tables[a].tag < hdr->tables[b].tag;
+                });
+      // A font can't have two tables with the same tag.
+      auto same_tag = [hdr](uint16_t a, uint16_t b) {
+        return hdr->tables[a].tag == hdr->tables[b].tag;
+      };
+      if (PREDICT_FALSE(std::adjacent_find(ttc_font.table_indices.begin(),
+                                           ttc_font.table_indices.end(),
+                                           same_tag) !=
+                        ttc_font.table_indices.end())) {
+        return FONT_COMPRESSION_FAILURE();
       }
     }
   } else {
@@ -1337,8 +2428,467 @@ bool WriteHeaders(RebuildMetadata* metadata, WOFF2Header* hdr, WOFF2Out* out) {
   return true;
 }
 
+// Clears what an earlier decode left in scratch, keeping the memory.
+void ResetScratch(DecodeScratch* scratch) {
+  scratch->hdr.tables.clear();
+  scratch->hdr.ttc_fonts.clear();
+  RebuildMetadata& metadata = scratch->metadata;
+  metadata.header_checksum = 0;
+  for (WOFF2FontInfo& info : metadata.font_infos) {
+    info.num_glyphs = 0;
+    info.index_format = 0;
+    info.num_hmetrics = 0;
+    info.x_mins.clear();
+    info.table_entry_by_tag.clear();
+  }
+  metadata.checksums.clear();
+  // These are sized for each font, so they only count as far as it uses them.
+  scratch->tables.loca_values.clear();
+  scratch->tables.loca.clear();
+  scratch->tables.hmtx.clear();
+}
+
+// Starts charging what a decode takes to scratch->budget, held to
+// memory_limit unless it is 0. A decode that is done in two passes starts
+// once, so that the buffers both use are charged once.
+void StartBudget(DecodeScratch* scratch, size_t memory_limit) {
+  scratch->budget.Reset(memory_limit);
+  scratch->brotli_pool.set_budget(&scratch->budget);
+  scratch->tables.budget = &scratch->budget;
+  scratch->tables.charged = 0;
+  scratch->uncompressed_charged = 0;
+  scratch->table_charged = 0;
+  scratch->chunk_charged = 0;
+}
+
+// The least memory that decoding hdr takes at once, as its directory tells:
+// the font data stream if it is held whole, or else the largest table read
+// as a whole, along with the 'loca' and 'hmtx' rebuilt from transformed
+// data, which are kept until the font is done.
+uint64_t MinDecodeMemory(const WOFF2Header& hdr, bool whole_stream) {
+  uint64_t largest = 0;
+  uint64_t rebuilt = 0;
+  for (const Table& table : hdr.tables) {
+    if (IsTransformed(table) || table.tag == kHeadTableTag ||
+        table.tag == kHheaTableTag) {
+      largest = std::max<uint64_t>(largest, table.src_length);
+    }
+    if (IsTransformed(table) &&
+        (table.tag == kLocaTableTag || table.tag == kHmtxTableTag)) {
+      rebuilt += table.dst_length;
+    }
+  }
+  return (whole_stream ? hdr.uncompressed_size : largest) + rebuilt;
+}
+
+// Passes writes on to out, charging them to WOFF2Phase::kOutput and noting
+// when out refuses one.
+class StatsOut : public WOFF2Out {
+ public:
+  StatsOut(WOFF2Out* out, StatsRecorder* recorder)
+      : out_(out), recorder_(recorder) {}
+
+  bool Write(const void *buf, size_t n) override {
+    ScopedPhase phase(recorder_, WOFF2Phase::kOutput);
+    return Check(out_->Write(buf, n));
+  }
+
+  bool Write(const void *buf, size_t offset, size_t n) override {
+    ScopedPhase phase(recorder_, WOFF2Phase::kOutput);
+    return Check(out_->Write(buf, offset, n));
+  }
+
+  bool WriteWithChecksum(const void *buf, size_t n,
+                         uint32_t *checksum) override {
+    ScopedPhase phase(recorder_, WOFF2Phase::kOutput);
+    return Check(out_->WriteWithChecksum(buf, n, checksum));
+  }
+
+  size_t Size() override { return out_->Size(); }
+
+  void SizeHint(size_t size) override { out_->SizeHint(size); }
+
+ private:
+  bool Check(bool ok) {
+    if (PREDICT_FALSE(!ok)) {
+      recorder_->Fail(WOFF2Failure::kOutput);
+    }
+    return ok;
+  }
+
+  WOFF2Out* out_;
+  StatsRecorder* recorder_;
+};
+
+// A write that fills in data behind the end of the output.
+struct OutPatch {
+  size_t offset;
+  std::vector<uint8_t> data;
+};
+
+// Discards what is written to it but for the writes behind its end, which
+// fill in headers and checksums once the data they cover is known.
+class PrepassOut : public WOFF2Out {
+ public:
+  PrepassOut() : size_(0) {}
+
+  bool Write(const void* /* buf */, size_t n) override {
+    size_ += n;
+    return true;
+  }
+
+  bool Write(const void *buf, size_t offset, size_t n) override {
+    if (offset == size_) {
+      return Write(buf, n);
+    }
+    if (PREDICT_FALSE(offset > size_ || n > size_ - offset)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    const uint8_t* data = static_cast<const uint8_t*>(buf);
+    patches_.push_back({offset, std::vector<uint8_t>(data, data + n)});
+    return true;
+  }
+
+  size_t Size() override { return size_; }
+
+  // The patches made, by offset.
+  std::vector<OutPatch> TakePatches() {
+    std::stable_sort(patches_.begin(), patches_.end(),
+                     [](const OutPatch& a, const OutPatch& b) {
+                       return a.offset < b.offset;
+                     });
+    return std::move(patches_);
+  }
+
+ private:
+  size_t size_;
+  std::vector<OutPatch> patches_;
+};
+
+// Discards what is written to it and only counts it, for ValidateWOFF2():
+// nothing is copied, and WriteWithChecksum() doesn't compute the checksum.
+class NullOut : public WOFF2Out {
+ public:
+  NullOut() : size_(0) {}
+
+  bool Write(const void* /* buf */, size_t n) override {
+    size_ += n;
+    return true;
+  }
+
+  bool Write(const void *buf, size_t offset, size_t n) override {
+    if (offset == size_) {
+      return Write(buf, n);
+    }
+    return offset < size_ && n <= size_ - offset;
+  }
+
+  // *checksum is deliberately left as the caller zeroed it: validation
+  // doesn't need the checksums, and skipping them is much of its speedup.
+  bool WriteWithChecksum(const void* buf, size_t n,
+                         uint32_t* /* checksum */) override {
+    return Write(buf, n);
+  }
+
+  size_t Size() override { return size_; }
+
+ private:
+  size_t size_;
+};
+
+// Keeps the failure reported to it.
+class ValidationStats : public WOFF2Stats {
+ public:
+  explicit ValidationStats(WOFF2Validation* validation)
+      : validation_(validation) {}
+
+  void OnFailure(WOFF2Failure reason, uint32_t tag) override {
+    validation_->failure = reason;
+    validation_->tag = tag;
+  }
+
+ private:
+  WOFF2Validation* validation_;
+};
+
+// Appends to out what is written to it, with the patches found by a
+// PrepassOut applied as the bytes they cover go by. The writes behind the end
+// that made the patches are made again, and ignored.
+class PatchingOut : public WOFF2Out {
+ public:
+  PatchingOut(WOFF2Out* out, std::vector<OutPatch> patches)
+      : out_(out), patches_(std::move(patches)), next_patch_(0), size_(0) {}
+
+  bool Write(const void *buf, size_t n) override {
+    const uint8_t* data = static_cast<const uint8_t*>(buf);
+    const size_t end = size_ + n;
+    if (next_patch_ < patches_.size() &&
+        patches_[next_patch_].offset < end) {
+      chunk_.assign(data, data + n);
+      while (next_patch_ < patches_.size() &&
+             patches_[next_patch_].offset < end) {
+        const OutPatch& patch = patches_[next_patch_];
+        size_t patch_end = patch.offset + patch.data.size();
+        size_t from = std::max(patch.offset, size_);
+        size_t to = std::min(patch_end, end);
+        if (from < to) {
+          std::memcpy(&chunk_[from - size_], &patch.data[from - patch.offset],
+                      to - from);
+        }
+        if (patch_end > end) break;  // the rest is in the next write
+        ++next_patch_;
+      }
+      data = chunk_.data();
+    }
+    if (PREDICT_FALSE(!out_->Write(data, n))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    size_ = end;
+    return true;
+  }
+
+  bool Write(const void *buf, size_t offset, size_t n) override {
+    if (offset == size_) {
+      return Write(buf, n);
+    }
+    return offset <= size_ && n <= size_ - offset;
+  }
+
+  size_t Size() override { return size_; }
+
+  void SizeHint(size_t size) override { out_->SizeHint(size); }
+
+ private:
+  WOFF2Out* out_;
+  std::vector<OutPatch> patches_;
+  size_t next_patch_;
+  std::vector<uint8_t> chunk_;
+  size_t size_;
+};
+
+// Hands the sizes of the tables and the glyph counts of a successful decode to
+// stats.
+void ReportTables(WOFF2Header* hdr, const RebuildMetadata& metadata,
+                  WOFF2Stats* stats) {
+  for (const Table& table : hdr->tables) {
+    stats->OnTable(table.tag, table.src_length, table.dst_length);
+  }
+  // Only the first font using a transformed 'glyf' counts its glyphs.
+  std::vector<uint32_t> glyphs_by_table(hdr->tables.size());
+  for (size_t i = 0; i < metadata.font_infos.size(); ++i) {
+    std::vector<Table*> tables = Tables(hdr, i);
+    const Table* glyf_table = FindTable(&tables, kGlyfTableTag);
+    if (glyf_table != NULL && IsTransformed(*glyf_table)) {
+      uint32_t& num_glyphs = glyphs_by_table[TableIndex(*hdr, glyf_table)];
+      num_glyphs = std::max<uint32_t>(num_glyphs,
+                                      metadata.font_infos[i].num_glyphs);
+      stats->OnGlyphs(i, num_glyphs);
+    }
+  }
+}
+
+// Sets *dictionary to the dictionary the font data stream of hdr needs,
+// which is given if it needs one. Returns false if given is not the one.
+bool FindDictionary(const WOFF2Header& hdr, const WOFF2Dictionary* given,
+                    const WOFF2Dictionary** dictionary) {
+  *dictionary = NULL;
+  if (hdr.dictionary_id == 0) {
+    return true;
+  }
+  if (PREDICT_FALSE(given == NULL || given->id != hdr.dictionary_id)) {
+#ifdef FONT_COMPRESSION_BIN
+    fprintf(stderr, "Dictionary %04x is needed\n", hdr.dictionary_id);
+#endif
+    return FONT_COMPRESSION_FAILURE();
+  }
+  *dictionary = given;
+  return true;
+}
+
+// Decodes input_data to out. stream is its font data stream if that has
+// already been decompressed, or empty.
+bool Decode(std::span<const uint8_t> input_data,
+            std::span<const uint8_t> stream, int num_threads,
+            const WOFF2Dictionary* given_dictionary, DecodeScratch* scratch,
+            StatsRecorder* recorder, WOFF2Out* out) {
+  ResetScratch(scratch);
+  RebuildMetadata& metadata = scratch->metadata;
+  WOFF2Header& hdr = scratch->hdr;
+  const WOFF2Dictionary* dictionary;
+  {
+    ScopedPhase phase(recorder, WOFF2Phase::kHeader);
+    if (!ReadWOFF2Header(input_data, &hdr)) {
+      recorder->Fail(WOFF2Failure::kInvalidHeader);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (!FindDictionary(hdr, given_dictionary, &dictionary)) {
+      recorder->Fail(WOFF2Failure::kDictionary);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    // Let the output make room for the whole font before the first write,
+    // unless the directory claims an implausible size.
+    const uint64_t decoded_size = ComputeDecodedSize(hdr);
+    if (decoded_size <= kMaxPlausibleCompressionRatio * input_data.size()) {
+      out->SizeHint(decoded_size);
+    }
+
+    if (!WriteHeaders(&metadata, &hdr, scratch, out)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+
+  const float compression_ratio =
+      (float) hdr.uncompressed_size / input_data.size();
+  if (compression_ratio > kMaxPlausibleCompressionRatio) {
+#ifdef FONT_COMPRESSION_BIN
+    fprintf(stderr, "Implausible compression ratio %.01f\n", compression_ratio);
+#endif
+    recorder->Fail(WOFF2Failure::kImplausibleSize);
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  if (PREDICT_FALSE(hdr.uncompressed_size < 1)) {
+    recorder->Fail(WOFF2Failure::kImplausibleSize);
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // Give up before decompressing anything if the font can't fit. A stream
+  // that is given is not ours to count.
+  if (PREDICT_FALSE(stream.empty() &&
+                    !scratch->budget.Allows(
+                        MinDecodeMemory(hdr, hdr.header_version != 0)))) {
+    recorder->Fail(WOFF2Failure::kMemoryLimit);
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  if (!hdr.header_version && stream.empty()) {
+    // A single font uses its tables in stream order, so we can reconstruct
+    // each table as soon as it has been decompressed.
+    const TableScratchSizes initial_sizes(scratch->tables);
+    StreamingTableSource source(hdr.compressed_buf, hdr.uncompressed_size,
+                                dictionary, scratch, recorder);
+    if (PREDICT_FALSE(!ReconstructFont(&source, &metadata, &hdr, 0,
+                                       &scratch->tables, recorder, out) ||
+                      !source.Finish())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    initial_sizes.RecordGrowth(scratch->tables, recorder);
+    return true;
+  }
+
+  std::span<const uint8_t> uncompressed_buf_view = stream;
+  if (!stream.empty()) {
+    if (PREDICT_FALSE(stream.size() != hdr.uncompressed_size)) {
+      recorder->Fail(WOFF2Failure::kBrotli);
+      return FONT_COMPRESSION_FAILURE();
+    }
+  } else {
+    // Fonts in a collection may share tables in any order; decompress it all.
+    std::vector<uint8_t>& uncompressed_buf = scratch->uncompressed_buf;
+    if (PREDICT_FALSE(!scratch->budget.ChargeUpTo(
+            hdr.uncompressed_size, &scratch->uncompressed_charged))) {
+      recorder->Fail(WOFF2Failure::kMemoryLimit);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    recorder->Grew(WOFF2Buffer::kStream, uncompressed_buf.size(),
+                   hdr.uncompressed_size);
+    uncompressed_buf.resize(hdr.uncompressed_size);
+    ScopedPhase phase(recorder, WOFF2Phase::kBrotli);
+    if (PREDICT_FALSE(!Woff2Uncompress(std::span(uncompressed_buf),
+                                       hdr.compressed_buf, dictionary,
+                                       &scratch->brotli_pool))) {
+      recorder->Fail(BrotliFailure(scratch->budget));
+      return FONT_COMPRESSION_FAILURE();
+    }
+    uncompressed_buf_view = uncompressed_buf;
+  }
+
+  BufferedTableSource source(uncompressed_buf_view);
+  if (hdr.header_version && num_threads > 1) {
+    return ReconstructCollection(&source, &metadata, &hdr, num_threads,
+                                 &scratch->budget, recorder, out);
+  }
+  const TableScratchSizes initial_sizes(scratch->tables);
+  for (size_t i = 0; i < metadata.font_infos.size(); i++) {
+    if (PREDICT_FALSE(!ReconstructFont(&source, &metadata, &hdr, i,
+                                       &scratch->tables, recorder, out))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  initial_sizes.RecordGrowth(scratch->tables, recorder);
+
+  return true;
+}
+
+// Decodes like Decode, but only ever appends to out. A first decode to a
+// PrepassOut finds what the headers and checksums are to be, and the second
+// one writes them in order.
+bool DecodeSequentially(std::span<const uint8_t> input_data,
+                        std::span<const uint8_t> stream, int num_threads,
+                        const WOFF2Dictionary* dictionary,
+                        DecodeScratch* scratch, StatsRecorder* recorder,
+                        WOFF2Out* out) {
+  PrepassOut prepass;
+  if (PREDICT_FALSE(!Decode(input_data, stream, num_threads, dictionary,
+                            scratch, recorder, &prepass))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  // The stream of a collection has been decompressed as a whole already.
+  if (stream.empty() && scratch->hdr.header_version) {
+    stream = scratch->uncompressed_buf;
+  }
+  PatchingOut patching(out, prepass.TakePatches());
+  if (PREDICT_FALSE(!Decode(input_data, stream, num_threads, dictionary,
+                            scratch, recorder, &patching) ||
+                    patching.Size() != prepass.Size())) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  return true;
+}
+
+// The index of a Woff2GlyphReader, big-endian: this signature, a uint16
+// version and flags, then uint32s for num_glyphs, the length of the stream
+// and the offset and length of 'glyf' in it. For a transformed 'glyf', the
+// positions of each glyph in the kNumSubStreams substreams follow, and then
+// the num_glyphs + 1 entries of the decoded 'loca'.
+const uint32_t kGlyphIndexSignature = 0x77326769;  // 'w2gi'
+const uint16_t kGlyphIndexVersion = 1;
+const uint16_t kGlyphIndexTransformed = 1 << 0;
+const size_t kGlyphIndexHeaderSize = 24;
+
+size_t GlyphIndexSize(bool transformed, uint32_t num_glyphs) {
+  return kGlyphIndexHeaderSize +
+         (transformed ? 4 * kNumSubStreams * num_glyphs : 0) +
+         4 * (num_glyphs + 1);
+}
+
 }  // namespace
 
+struct DecodeContext::Buffers {
+  DecodeScratch scratch;
+};
+
+DecodeContext::DecodeContext() : buffers_(new Buffers) {}
+
+DecodeContext::~DecodeContext() {}
+
+void DecodeContext::Clear() {
+  buffers_.reset(new Buffers);
+}
+
+DecodeContext::Buffers* GetBuffers(DecodeContext* context) {
+  return context->buffers_.get();
+}
+
+size_t ComputeWOFF2DecodedSize(const uint8_t* data, size_t length) {
+  WOFF2Header hdr;
+  if (!ReadWOFF2Header(std::span(data, length), &hdr)) {
+    return 0;
+  }
+  const uint64_t size = ComputeDecodedSize(hdr);
+  return size <= std::numeric_limits<size_t>::max() ? size : 0;
+}
+
 size_t ComputeWOFF2FinalSize(const uint8_t* data, size_t length) {
   Buffer file(data, length);
   uint32_t total_length;
@@ -1358,43 +2908,768 @@ bool ConvertWOFF2ToTTF(uint8_t *result, size_t result_length,
 
 bool ConvertWOFF2ToTTF(const uint8_t* data, size_t length,
                        WOFF2Out* out) {
+  WOFF2DecodeParams params;
+  return ConvertWOFF2ToTTF(data, length, out, params);
+}
+
+bool ConvertWOFF2ToTTF(const uint8_t* data, size_t length,
+                       WOFF2Out* out, const WOFF2DecodeParams& params) {
+  return ConvertWOFF2ToTTFFromStream(data, length, std::span<const uint8_t>(),
+                                     out, params);
+}
+
+bool ConvertWOFF2ToTTFBatch(const WOFF2Input* inputs, WOFF2Out* const* outs,
+                            size_t count, const WOFF2DecodeParams& params,
+                            bool* results) {
+  // Largest first, so that the fonts left for the end are the small ones.
+  std::vector<size_t> order(count);
+  for (size_t i = 0; i < count; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [inputs](size_t a, size_t b) {
+    return inputs[a].length > inputs[b].length;
+  });
+
+  // Each thread decodes all its fonts with the same context.
+  std::vector<std::unique_ptr<DecodeContext>> contexts(
+      std::max(params.num_threads, 1));
+  std::vector<char> decoded(count, 0);
+  ParallelForWorkers(count, params.num_threads, [&](size_t worker, size_t k) {
+    WOFF2DecodeParams font_params = params;
+    font_params.num_threads = 1;
+    font_params.stats = NULL;
+    if (worker != 0 || params.context == NULL) {
+      if (!contexts[worker]) {
+        contexts[worker].reset(new DecodeContext);
+      }
+      font_params.context = contexts[worker].get();
+    }
+    const size_t i = order[k];
+    decoded[i] = ConvertWOFF2ToTTF(inputs[i].data, inputs[i].length, outs[i],
+                                   font_params);
+    return true;
+  });
+
+  bool ok = true;
+  for (size_t i = 0; i < count; ++i) {
+    if (results != NULL) {
+      results[i] = decoded[i];
+    }
+    ok = ok && decoded[i];
+  }
+  return ok;
+}
+
+bool ValidateWOFF2(const uint8_t* data, size_t length,
+                   const WOFF2DecodeParams& params, WOFF2Validation* result) {
+  std::unique_ptr<DecodeContext> own_context;
+  DecodeContext* context = params.context;
+  if (context == NULL) {
+    own_context.reset(new DecodeContext);
+    context = own_context.get();
+  }
+  DecodeScratch* scratch = &GetBuffers(context)->scratch;
+  StartBudget(scratch, params.memory_limit);
+  WOFF2Validation validation;
+  ValidationStats stats(&validation);
+  StatsRecorder recorder(&stats);
+  NullOut out;
+  validation.valid = Decode(std::span(data, length), std::span<const uint8_t>(),
+                            params.num_threads, params.dictionary, scratch,
+                            &recorder, &out);
+  if (!validation.valid && !recorder.failed()) {
+    recorder.Fail(WOFF2Failure::kInvalidTable);
+  }
+  recorder.Report();
+  if (result != NULL) {
+    *result = validation;
+  }
+  return validation.valid;
+}
+
+bool ReadWOFF2Directory(const uint8_t* data, size_t length,
+                        Woff2Directory* directory) {
+  WOFF2Header hdr;
+  return ReadWOFF2Header(std::span(data, length), &hdr, directory);
+}
+
+bool DecompressWOFF2Stream(const uint8_t* data, size_t length,
+                           const WOFF2Dictionary* given_dictionary,
+                           std::vector<uint8_t>* stream) {
+  WOFF2Header hdr;
+  const WOFF2Dictionary* dictionary;
+  if (PREDICT_FALSE(!ReadWOFF2Header(std::span(data, length), &hdr) ||
+                    !FindDictionary(hdr, given_dictionary, &dictionary))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (PREDICT_FALSE(hdr.uncompressed_size < 1 ||
+                    static_cast<float>(hdr.uncompressed_size) / length >
+                        kMaxPlausibleCompressionRatio)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  stream->resize(hdr.uncompressed_size);
+  BrotliMemoryPool pool;
+  return Woff2Uncompress(std::span(*stream), hdr.compressed_buf, dictionary,
+                         &pool);
+}
+
+bool ConvertWOFF2ToTTFFromStream(const uint8_t* data, size_t length,
+                                 std::span<const uint8_t> stream,
+                                 WOFF2Out* out,
+                                 const WOFF2DecodeParams& params) {
+  std::unique_ptr<DecodeContext> own_context;
+  DecodeContext* context = params.context;
+  if (context == NULL) {
+    own_context.reset(new DecodeContext);
+    context = own_context.get();
+  }
+  DecodeScratch* scratch = &GetBuffers(context)->scratch;
+  StartBudget(scratch, params.memory_limit);
+  auto decode = params.sequential_output ? DecodeSequentially : Decode;
+  if (params.stats == NULL) {
+    StatsRecorder recorder(NULL);
+    return decode(std::span(data, length), stream, params.num_threads,
+                  params.dictionary, scratch, &recorder, out);
+  }
+
+  StatsRecorder recorder(params.stats);
+  StatsOut stats_out(out, &recorder);
+  bool ok = decode(std::span(data, length), stream, params.num_threads,
+                   params.dictionary, scratch, &recorder, &stats_out);
+  if (ok) {
+    ReportTables(&scratch->hdr, scratch->metadata, params.stats);
+  } else if (!recorder.failed()) {
+    recorder.Fail(WOFF2Failure::kInvalidTable);
+  }
+  recorder.PeakMemory(scratch->budget.peak());
+  recorder.Report();
+  return ok;
+}
+
+struct Woff2GlyphReader::State {
+  // Rebuilds glyph glyph_id of the transformed 'glyf' from its data at the
+  // read positions of streams, into scratch.glyph.
+  bool RebuildGlyph(unsigned int glyph_id, GlyfStreams* streams,
+                    size_t* glyph_size) {
+    uint16_t n_contours;
+    return glyf.overlap_bitmap.empty()
+        ? ReconstructGlyph<false>(glyf, glyph_id, streams, &scratch,
+                                  &n_contours, glyph_size)
+        : ReconstructGlyph<true>(glyf, glyph_id, streams, &scratch,
+                                 &n_contours, glyph_size);
+  }
+
+  // Fills loca_values for a transformed 'glyf', which takes the size of every
+  // glyph as the decoder pads it.
+  bool FindLocaValues() {
+    if (!loca_values.empty()) {
+      return true;
+    }
+    std::vector<uint32_t> values(num_glyphs + 1);
+    GlyfStreams streams(glyf);
+    uint64_t offset = 0;
+    for (unsigned int i = 0; i < num_glyphs; ++i) {
+      values[i] = offset;
+      size_t glyph_size;
+      if (PREDICT_FALSE(!RebuildGlyph(i, &streams, &glyph_size))) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      offset += Round4(glyph_size);
+      if (PREDICT_FALSE(offset > std::numeric_limits<uint32_t>::max())) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+    }
+    values[num_glyphs] = offset;
+    loca_values.swap(values);
+    return true;
+  }
+
+  // The font data stream, up to the end of the tables read from, unless the
+  // reader was opened from a cached one.
+  std::vector<uint8_t> stream;
+  // The stream that is read from, stream or the cached one, and where 'glyf' is
+  // in it.
+  std::span<const uint8_t> data;
+  uint32_t glyf_offset = 0;
+  uint32_t glyf_length = 0;
+  uint16_t num_glyphs = 0;
+  // If 'glyf' is transformed: its parts, and where the data of each glyph
+  // starts in its substreams.
+  bool transformed = false;
+  TransformedGlyf glyf;
+  std::vector<std::array<uint32_t, kNumSubStreams>> positions;
+  // Otherwise: the plain 'glyf'.
+  std::span<const uint8_t> glyf_data;
+  // The decoded 'loca': from the font if 'glyf' is not transformed, otherwise
+  // empty until FindLocaValues().
+  std::vector<uint32_t> loca_values;
+  TableScratch scratch;
+};
+
+Woff2GlyphReader::Woff2GlyphReader() {}
+
+Woff2GlyphReader::~Woff2GlyphReader() {}
+
+bool Woff2GlyphReader::Open(const uint8_t* data, size_t length,
+                            size_t font_index,
+                            const WOFF2Dictionary* given_dictionary) {
+  state_.reset();
   std::span<const uint8_t> input_data(data, length);
-  RebuildMetadata metadata;
   WOFF2Header hdr;
-  if (!ReadWOFF2Header(input_data, &hdr)) {
+  const WOFF2Dictionary* dictionary;
+  if (PREDICT_FALSE(!ReadWOFF2Header(input_data, &hdr) ||
+                    !FindDictionary(hdr, given_dictionary, &dictionary))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (PREDICT_FALSE(hdr.header_version ? font_index >= hdr.ttc_fonts.size()
+                                       : font_index != 0)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  std::vector<Table*> tables = Tables(&hdr, font_index);
+  const Table* glyf_table = FindTable(&tables, kGlyfTableTag);
+  const Table* loca_table = FindTable(&tables, kLocaTableTag);
+  const Table* head_table = FindTable(&tables, kHeadTableTag);
+  if (PREDICT_FALSE(glyf_table == NULL || !CheckGlyfAndLoca(&tables))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  bool transformed = IsTransformed(*glyf_table);
+  if (PREDICT_FALSE(!transformed && head_table == NULL)) {
     return FONT_COMPRESSION_FAILURE();
   }
 
-  if (!WriteHeaders(&metadata, &hdr, out)) {
+  // Tables are laid out in the stream one after the other, so only the
+  // stream up to the last of them is needed.
+  uint32_t end = glyf_table->src_offset + glyf_table->src_length;
+  if (!transformed) {
+    for (const Table* table : {loca_table, head_table}) {
+      end = std::max(end, table->src_offset + table->src_length);
+    }
+  }
+  if (PREDICT_FALSE(end > hdr.uncompressed_size ||
+                    static_cast<float>(end) / length >
+                        kMaxPlausibleCompressionRatio)) {
     return FONT_COMPRESSION_FAILURE();
   }
 
-  const float compression_ratio = (float) hdr.uncompressed_size / length;
-  if (compression_ratio > kMaxPlausibleCompressionRatio) {
-#ifdef FONT_COMPRESSION_BIN
-    fprintf(stderr, "Implausible compression ratio %.01f\n", compression_ratio);
-#endif
+  std::unique_ptr<State> state(new State);
+  state->stream.resize(end);
+  BrotliMemoryPool pool;
+  if (PREDICT_FALSE(!Woff2UncompressPrefix(std::span(state->stream),
+                                           hdr.compressed_buf, dictionary,
+                                           &pool))) {
     return FONT_COMPRESSION_FAILURE();
   }
+  std::span<const uint8_t> stream(state->stream);
+  state->data = stream;
+  state->glyf_offset = glyf_table->src_offset;
+  state->glyf_length = glyf_table->src_length;
+
+  state->transformed = transformed;
+  if (transformed) {
+    TransformedGlyf& glyf = state->glyf;
+    if (PREDICT_FALSE(!ReadTransformedGlyf(
+            stream.subspan(glyf_table->src_offset, glyf_table->src_length),
+            &glyf))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    state->num_glyphs = glyf.num_glyphs;
+    state->positions.resize(glyf.num_glyphs);
+    GlyfStreams streams(glyf);
+    for (unsigned int i = 0; i < glyf.num_glyphs; ++i) {
+      state->positions[i] = streams.Positions();
+      if (PREDICT_FALSE(!SkipGlyph(glyf, i, &streams))) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+    }
+  } else {
+    Buffer head(stream.subspan(head_table->src_offset, head_table->src_length));
+    int16_t index_format;
+    if (PREDICT_FALSE(!head.Skip(50) || !head.ReadS16(&index_format))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    size_t offset_size = index_format ? 4 : 2;
+    size_t loca_entries = loca_table->src_length / offset_size;
+    if (PREDICT_FALSE(loca_entries < 1 || loca_entries > 0x10000)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    Buffer loca(stream.subspan(loca_table->src_offset, loca_table->src_length));
+    state->loca_values.resize(loca_entries);
+    for (uint32_t& value : state->loca_values) {
+      uint16_t short_value;
+      if (index_format ? !loca.ReadU32(&value)
+                       : !loca.ReadU16(&short_value)) {
+        return FONT_COMPRESSION_FAILURE();
+      }
+      if (!index_format) {
+        value = static_cast<uint32_t>(short_value) << 1;
+      }
+    }
+    state->num_glyphs = loca_entries - 1;
+    state->glyf_data =
+        stream.subspan(glyf_table->src_offset, glyf_table->src_length);
+  }
+  state_ = std::move(state);
+  return true;
+}
 
-  std::vector<uint8_t> uncompressed_buf(hdr.uncompressed_size);
-  std::span<uint8_t> uncompressed_buf_view(uncompressed_buf);
-  if (PREDICT_FALSE(hdr.uncompressed_size < 1)) {
+bool Woff2GlyphReader::OpenCached(const uint8_t* stream, size_t stream_length,
+                                  const uint8_t* index, size_t index_length) {
+  state_.reset();
+  Buffer file(index, index_length);
+  uint32_t signature;
+  uint16_t version;
+  uint16_t flags;
+  uint32_t num_glyphs;
+  uint32_t indexed_stream_length;
+  std::unique_ptr<State> state(new State);
+  if (PREDICT_FALSE(!file.ReadU32(&signature) ||
+                    signature != kGlyphIndexSignature ||
+                    !file.ReadU16(&version) || version != kGlyphIndexVersion ||
+                    !file.ReadU16(&flags) ||
+                    (flags & ~kGlyphIndexTransformed) != 0 ||
+                    !file.ReadU32(&num_glyphs) || num_glyphs > 0xFFFF ||
+                    !file.ReadU32(&indexed_stream_length) ||
+                    indexed_stream_length != stream_length ||
+                    !file.ReadU32(&state->glyf_offset) ||
+                    !file.ReadU32(&state->glyf_length))) {
     return FONT_COMPRESSION_FAILURE();
   }
-  if (PREDICT_FALSE(
-          !Woff2Uncompress(uncompressed_buf_view, hdr.compressed_buf))) {
+  const bool transformed = (flags & kGlyphIndexTransformed) != 0;
+  if (PREDICT_FALSE(static_cast<uint64_t>(state->glyf_offset) +
+                        state->glyf_length > stream_length ||
+                    index_length != GlyphIndexSize(transformed,
+                                                   num_glyphs))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  state->data = std::span(stream, stream_length);
+  std::span<const uint8_t> glyf_data =
+      state->data.subspan(state->glyf_offset, state->glyf_length);
+  state->num_glyphs = num_glyphs;
+  state->transformed = transformed;
+
+  // The sizes were checked above, so the reads below can't fail.
+  if (transformed) {
+    TransformedGlyf& glyf = state->glyf;
+    if (PREDICT_FALSE(!ReadTransformedGlyf(glyf_data, &glyf) ||
+                      glyf.num_glyphs != num_glyphs)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    state->positions.resize(num_glyphs);
+    for (std::array<uint32_t, kNumSubStreams>& positions : state->positions) {
+      for (int i = 0; i < kNumSubStreams; ++i) {
+        file.ReadU32(&positions[i]);
+        if (PREDICT_FALSE(positions[i] > glyf.substreams[i].size())) {
+          return FONT_COMPRESSION_FAILURE();
+        }
+      }
+    }
+  } else {
+    state->glyf_data = glyf_data;
+  }
+  state->loca_values.resize(num_glyphs + 1);
+  for (uint32_t& value : state->loca_values) {
+    file.ReadU32(&value);
+  }
+  state_ = std::move(state);
+  return true;
+}
+
+uint16_t Woff2GlyphReader::num_glyphs() const {
+  return state_ ? state_->num_glyphs : 0;
+}
+
+const uint8_t* Woff2GlyphReader::stream_data() const {
+  return state_ ? state_->data.data() : NULL;
+}
+
+size_t Woff2GlyphReader::stream_length() const {
+  return state_ ? state_->data.size() : 0;
+}
+
+bool Woff2GlyphReader::SaveIndex(std::string* index) {
+  if (PREDICT_FALSE(!state_ ||
+                    (state_->transformed && !state_->FindLocaValues()))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  const State& state = *state_;
+  std::vector<uint8_t> buf(GlyphIndexSize(state.transformed,
+                                          state.num_glyphs));
+  std::span<uint8_t> dst(buf);
+  size_t offset = 0;
+  StoreU32(kGlyphIndexSignature, &offset, dst);
+  Store16(kGlyphIndexVersion, &offset, dst);
+  Store16(state.transformed ? kGlyphIndexTransformed : 0, &offset, dst);
+  StoreU32(state.num_glyphs, &offset, dst);
+  StoreU32(state.data.size(), &offset, dst);
+  StoreU32(state.glyf_offset, &offset, dst);
+  StoreU32(state.glyf_length, &offset, dst);
+  for (const std::array<uint32_t, kNumSubStreams>& positions :
+       state.positions) {
+    for (uint32_t position : positions) {
+      StoreU32(position, &offset, dst);
+    }
+  }
+  for (uint32_t value : state.loca_values) {
+    StoreU32(value, &offset, dst);
+  }
+  index->assign(reinterpret_cast<const char*>(buf.data()), buf.size());
+  return true;
+}
+
+bool Woff2GlyphReader::GlyphOffset(uint32_t glyph_id, uint32_t* offset) {
+  if (PREDICT_FALSE(!state_ || glyph_id > state_->num_glyphs ||
+                    (state_->transformed && !state_->FindLocaValues()))) {
     return FONT_COMPRESSION_FAILURE();
   }
+  *offset = state_->loca_values[glyph_id];
+  return true;
+}
 
-  for (size_t i = 0; i < metadata.font_infos.size(); i++) {
-    if (PREDICT_FALSE(!ReconstructFont(uncompressed_buf_view,
-                                       &metadata, &hdr, i, out))) {
+bool Woff2GlyphReader::ReadGlyph(uint16_t glyph_id, std::string* glyph) {
+  if (PREDICT_FALSE(!state_ || glyph_id >= state_->num_glyphs)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  State& state = *state_;
+  if (!state.transformed) {
+    uint32_t start = state.loca_values[glyph_id];
+    uint32_t end = state.loca_values[glyph_id + 1];
+    if (PREDICT_FALSE(start > end || end > state.glyf_data.size())) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    glyph->assign(reinterpret_cast<const char*>(state.glyf_data.data()) +
+                  start, end - start);
+    return true;
+  }
+
+  GlyfStreams streams(state.glyf);
+  streams.SetPositions(state.positions[glyph_id]);
+  size_t glyph_size;
+  if (PREDICT_FALSE(!state.RebuildGlyph(glyph_id, &streams, &glyph_size))) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  glyph->assign(reinterpret_cast<const char*>(state.scratch.glyph.data()),
+                glyph_size);
+  return true;
+}
+
+bool Woff2GlyphReader::ReadGlyphs(uint16_t first_glyph, uint32_t count,
+                                  std::string* glyphs) {
+  if (PREDICT_FALSE(!state_ ||
+                    first_glyph + static_cast<uint64_t>(count) >
+                        state_->num_glyphs)) {
+    return FONT_COMPRESSION_FAILURE();
+  }
+  State& state = *state_;
+  glyphs->clear();
+  if (!state.transformed) {
+    uint32_t start = state.loca_values[first_glyph];
+    uint32_t end = state.loca_values[first_glyph + count];
+    if (PREDICT_FALSE(start > end || end > state.glyf_data.size())) {
       return FONT_COMPRESSION_FAILURE();
     }
+    glyphs->assign(reinterpret_cast<const char*>(state.glyf_data.data()) +
+                   start, end - start);
+    return true;
   }
 
+  // The data of a glyph follows that of the one before it, so the glyphs
+  // are rebuilt one after the other from the positions of the first.
+  if (count == 0) {
+    return true;
+  }
+  GlyfStreams streams(state.glyf);
+  streams.SetPositions(state.positions[first_glyph]);
+  for (uint32_t i = first_glyph; i < first_glyph + count; ++i) {
+    size_t glyph_size;
+    if (PREDICT_FALSE(!state.RebuildGlyph(i, &streams, &glyph_size))) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    glyphs->append(reinterpret_cast<const char*>(state.scratch.glyph.data()),
+                   glyph_size);
+    glyphs->append(Round4(glyph_size) - glyph_size, '\0');
+  }
   return true;
 }
 
+
+struct Woff2Decoder::State {
+  explicit State(const WOFF2DecodeParams& params)
+      : params(params), own_context(params.context ? NULL : new DecodeContext),
+        scratch(&GetBuffers(params.context ? params.context
+                                            : own_context.get())->scratch),
+        recorder(params.stats) {
+    ResetScratch(scratch);
+    StartBudget(scratch, params.memory_limit);
+  }
+
+  ~State() {
+    if (brotli != NULL) {
+      BrotliDecoderDestroyInstance(brotli);
+    }
+  }
+
+  // Notes the failure, and reports it if there are stats.
+  Status Fail(WOFF2Failure reason, uint32_t tag = 0) {
+    if (status != Status::kError) {
+      recorder.Fail(reason, tag);
+      recorder.PeakMemory(scratch->budget.peak());
+      recorder.Report();
+      status = Status::kError;
+    }
+    return status;
+  }
+
+  // Reads the header from header_buf once it is all there.
+  bool ReadHeader() {
+    const std::span<const uint8_t> data(header_buf);
+    Buffer file(data);
+    uint32_t signature;
+    if (!file.ReadU32(&signature)) {
+      return true;
+    }
+    uint32_t reported_length;
+    if (PREDICT_FALSE(signature != kWoff2Signature)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (!file.Skip(4) || !file.ReadU32(&reported_length)) {
+      return true;
+    }
+    file_length = reported_length;
+    if (PREDICT_FALSE(received > file_length)) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+    ResetScratch(scratch);
+    if (!ReadWOFF2Header(data, file_length, &scratch->hdr)) {
+      // The directories may just not be all there yet.
+      return received < file_length;
+    }
+    const WOFF2Header& hdr = scratch->hdr;
+    if (PREDICT_FALSE(hdr.uncompressed_size < 1 ||
+                      static_cast<float>(hdr.uncompressed_size) / file_length >
+                          kMaxPlausibleCompressionRatio)) {
+      recorder.Fail(WOFF2Failure::kImplausibleSize);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    const WOFF2Dictionary* dictionary;
+    if (PREDICT_FALSE(!FindDictionary(hdr, params.dictionary, &dictionary))) {
+      recorder.Fail(WOFF2Failure::kDictionary);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    // All of the stream is held, for a single font too.
+    if (PREDICT_FALSE(!scratch->budget.Allows(MinDecodeMemory(hdr, true)) ||
+                      !scratch->budget.ChargeUpTo(
+                          hdr.uncompressed_size,
+                          &scratch->uncompressed_charged))) {
+      recorder.Fail(WOFF2Failure::kMemoryLimit);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    brotli = scratch->brotli_pool.CreateDecoder(dictionary);
+    if (PREDICT_FALSE(brotli == NULL)) {
+      recorder.Fail(BrotliFailure(scratch->budget));
+      return FONT_COMPRESSION_FAILURE();
+    }
+    std::vector<uint8_t>& stream = scratch->uncompressed_buf;
+    recorder.Grew(WOFF2Buffer::kStream, stream.size(), hdr.uncompressed_size);
+    stream.resize(hdr.uncompressed_size);
+    have_header = true;
+    return true;
+  }
+
+  // Decompresses what data, which starts at offset in the file, holds of the
+  // compressed data.
+  bool Consume(std::span<const uint8_t> data, size_t offset) {
+    const WOFF2Header& hdr = scratch->hdr;
+    const size_t begin = std::max(offset, hdr.compressed_offset);
+    const size_t end = std::min<uint64_t>(
+        offset + data.size(),
+        static_cast<uint64_t>(hdr.compressed_offset) + hdr.compressed_length);
+    if (begin >= end || stream_done) {
+      return true;
+    }
+    ScopedPhase phase(&recorder, WOFF2Phase::kBrotli);
+    std::vector<uint8_t>& stream = scratch->uncompressed_buf;
+    const uint8_t* next_in = data.data() + (begin - offset);
+    size_t available_in = end - begin;
+    uint8_t* next_out = stream.data() + decompressed;
+    size_t available_out = stream.size() - decompressed;
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(
+        brotli, &available_in, &next_in, &available_out, &next_out, NULL);
+    decompressed = stream.size() - available_out;
+    if (PREDICT_FALSE(result == BROTLI_DECODER_RESULT_ERROR ||
+                      result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT ||
+                      (result == BROTLI_DECODER_RESULT_SUCCESS &&
+                       available_out > 0))) {
+      recorder.Fail(BrotliFailure(scratch->budget));
+      return FONT_COMPRESSION_FAILURE();
+    }
+    if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+      stream_done = true;
+      BrotliDecoderDestroyInstance(brotli);
+      brotli = NULL;
+    }
+    return true;
+  }
+
+  // Whether the data of table has been decompressed. The tables of a single
+  // font are used in stream order, but those of a collection in any.
+  bool TableReady(const Table& table) const {
+    return stream_done ||
+           (!scratch->hdr.header_version &&
+            static_cast<uint64_t>(table.src_offset) + table.src_length <=
+                decompressed);
+  }
+
+  // Whether Drain() can write anything.
+  bool CanDrain() const {
+    if (!have_header || status != Status::kNeedsMoreInput) {
+      return false;
+    }
+    if (fonts_done) {
+      return received == file_length;
+    }
+    if (!wrote_headers || !font_started) {
+      return true;
+    }
+    if (rebuild.next_table < rebuild.tables.size()) {
+      return TableReady(*rebuild.tables[rebuild.next_table]);
+    }
+    return stream_done;
+  }
+
+  Status UpdateStatus() {
+    if (status == Status::kNeedsMoreInput && CanDrain()) {
+      return Status::kHasOutput;
+    }
+    return status;
+  }
+
+  WOFF2DecodeParams params;
+  std::unique_ptr<DecodeContext> own_context;
+  DecodeScratch* scratch;
+  StatsRecorder recorder;
+  // kNeedsMoreInput while the decode goes on; see UpdateStatus().
+  Status status = Status::kNeedsMoreInput;
+
+  // The start of the file, until the header can be read from it.
+  std::vector<uint8_t> header_buf;
+  // The length of the file according to its header, once that is known.
+  size_t file_length = 0;
+  size_t received = 0;
+  bool have_header = false;
+
+  // Decompresses into scratch->uncompressed_buf, of which decompressed bytes
+  // are done.
+  BrotliDecoderState* brotli = NULL;
+  size_t decompressed = 0;
+  bool stream_done = false;
+
+  bool wrote_headers = false;
+  // The font being reconstructed, if font_started.
+  size_t font_index = 0;
+  bool font_started = false;
+  FontRebuild rebuild;
+  // Whether all fonts have been written; the rest of the file, if any, only
+  // holds metadata.
+  bool fonts_done = false;
+};
+
+Woff2Decoder::Woff2Decoder(const WOFF2DecodeParams& params)
+    : state_(new State(params)) {}
+
+Woff2Decoder::~Woff2Decoder() {}
+
+Woff2Decoder::Status Woff2Decoder::status() const {
+  return state_->UpdateStatus();
+}
+
+Woff2Decoder::Status Woff2Decoder::Feed(const uint8_t* data, size_t length) {
+  State& s = *state_;
+  if (s.status != Status::kNeedsMoreInput) {
+    return length > 0 ? s.Fail(WOFF2Failure::kInvalidHeader) : s.status;
+  }
+  if (s.file_length > 0 && PREDICT_FALSE(length > s.file_length - s.received)) {
+    return s.Fail(WOFF2Failure::kInvalidHeader);
+  }
+  const size_t offset = s.received;
+  s.received += length;
+  if (!s.have_header) {
+    ScopedPhase phase(&s.recorder, WOFF2Phase::kHeader);
+    s.header_buf.insert(s.header_buf.end(), data, data + length);
+    if (PREDICT_FALSE(!s.ReadHeader())) {
+      return s.Fail(WOFF2Failure::kInvalidHeader);
+    }
+    if (s.have_header) {
+      // The start of the compressed data may have come with the header.
+      std::vector<uint8_t> header_buf;
+      header_buf.swap(s.header_buf);
+      if (PREDICT_FALSE(!s.Consume(header_buf, 0))) {
+        return s.Fail(WOFF2Failure::kBrotli);
+      }
+    }
+  } else if (PREDICT_FALSE(!s.Consume(std::span(data, length), offset))) {
+    return s.Fail(WOFF2Failure::kBrotli);
+  }
+  if (s.received == s.file_length) {
+    if (PREDICT_FALSE(!s.have_header)) {
+      return s.Fail(WOFF2Failure::kInvalidHeader);
+    }
+    // Whatever the compressed data didn't finish is lost.
+    if (PREDICT_FALSE(!s.stream_done)) {
+      return s.Fail(WOFF2Failure::kBrotli);
+    }
+  }
+  return s.UpdateStatus();
+}
+
+Woff2Decoder::Status Woff2Decoder::Drain(WOFF2Out* out) {
+  State& s = *state_;
+  if (s.status != Status::kNeedsMoreInput || !s.have_header) {
+    return s.status;
+  }
+  WOFF2Header* hdr = &s.scratch->hdr;
+  RebuildMetadata* metadata = &s.scratch->metadata;
+  if (!s.wrote_headers) {
+    ScopedPhase phase(&s.recorder, WOFF2Phase::kHeader);
+    const uint64_t decoded_size = ComputeDecodedSize(*hdr);
+    if (decoded_size <= kMaxPlausibleCompressionRatio * s.file_length) {
+      out->SizeHint(decoded_size);
+    }
+    if (PREDICT_FALSE(!WriteHeaders(metadata, hdr, s.scratch, out))) {
+      return s.Fail(WOFF2Failure::kOutput);
+    }
+    s.wrote_headers = true;
+  }
+  BufferedTableSource source(
+      std::span(s.scratch->uncompressed_buf).first(s.decompressed));
+  while (s.CanDrain()) {
+    if (s.fonts_done) {
+      s.status = Status::kDone;
+      if (s.params.stats != NULL) {
+        ReportTables(hdr, *metadata, s.params.stats);
+      }
+      s.recorder.PeakMemory(s.scratch->budget.peak());
+      s.recorder.Report();
+    } else if (!s.font_started) {
+      if (PREDICT_FALSE(!StartFont(*metadata, hdr, s.font_index, &s.recorder,
+                                   &s.rebuild))) {
+        return s.Fail(WOFF2Failure::kInvalidGlyf, kGlyfTableTag);
+      }
+      s.font_started = true;
+    } else if (s.rebuild.next_table < s.rebuild.tables.size()) {
+      if (PREDICT_FALSE(!ReconstructNextTable(&source, metadata,
+                                              &s.scratch->tables, &s.recorder,
+                                              &s.rebuild, out))) {
+        return s.Fail(WOFF2Failure::kInvalidTable);
+      }
+    } else {
+      if (PREDICT_FALSE(!FinishFont(&s.rebuild, &s.recorder, out))) {
+        return s.Fail(WOFF2Failure::kInvalidTable, kHeadTableTag);
+      }
+      s.font_started = false;
+      s.fonts_done = ++s.font_index == metadata->font_infos.size();
+    }
+  }
+  return s.status;
+}
+
 } // namespace woff2
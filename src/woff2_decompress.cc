@@ -7,35 +7,111 @@
 /* A very simple commandline tool for decompressing woff2 format files to true
    type font files. */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <limits>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "./batch.h"
 #include "./file.h"
 #include <woff2/decode.h>
+#include <woff2/output.h>
+
+namespace {
+
+const char kFlags[] =
+    "  --dictionary=FILE\n"
+    "                  the dictionary made by woff2_dictionary that the\n"
+    "                  inputs were compressed with, if they were\n"
+    "  --max-memory=BYTES\n"
+    "                  fail the files that need more memory than this to\n"
+    "                  decode, not counting the output\n";
+
+// What each worker keeps from one file to the next.
+struct Worker {
+  woff2::DecodeContext context;
+  woff2::FailureReason failure;
+};
 
+} // namespace
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "One argument, the input filename, must be provided.\n");
+  woff2::WOFF2Dictionary dictionary;
+  const woff2::WOFF2Dictionary* given_dictionary = NULL;
+  size_t memory_limit = 0;
+  woff2::BatchOptions options;
+  options.extension = ".ttf";
+  bool usable = woff2::ParseBatchArgs(argc, argv, [&](const char* arg) {
+    if (strncmp(arg, "--dictionary=", 13) == 0) {
+      if (!woff2::LoadDictionary(arg + 13, &dictionary)) {
+        exit(1);
+      }
+      given_dictionary = &dictionary;
+      return true;
+    }
+    if (strncmp(arg, "--max-memory=", 13) == 0) {
+      char* end;
+      unsigned long long bytes = strtoull(arg + 13, &end, 10);
+      if (*end != '\0' || end == arg + 13 || bytes == 0 ||
+          bytes > std::numeric_limits<size_t>::max()) {
+        return false;
+      }
+      memory_limit = static_cast<size_t>(bytes);
+      return true;
+    }
+    return false;
+  }, &options);
+  if (!usable) {
+    woff2::PrintBatchUsage(argv[0], kFlags);
     return 1;
   }
 
-  std::string filename(argv[1]);
-  std::string outfilename = filename.substr(0, filename.find_last_of(".")) + ".ttf";
+  std::vector<std::unique_ptr<Worker>> workers(options.jobs);
+  for (auto& worker : workers) {
+    worker.reset(new Worker);
+  }
 
-  // Note: update woff2_dec_fuzzer_new_entry.cc if this pattern changes.
-  std::string input = woff2::GetFileContent(filename);
-  const uint8_t* raw_input = reinterpret_cast<const uint8_t*>(input.data());
-  std::string output(
-      std::min(woff2::ComputeWOFF2FinalSize(raw_input, input.size()),
-               woff2::kDefaultMaxSize),
-      0);
-  woff2::WOFF2StringOut out(&output);
+  size_t failures = woff2::RunBatch(options,
+      [&](size_t index, const std::string& filename,
+          const std::string& outfilename, std::string* error) {
+    Worker& worker = *workers[index];
+    woff2::MappedFile input(filename);
+    if (!input.ok()) {
+      *error = "could not read file";
+      return false;
+    }
 
-  const bool ok = woff2::ConvertWOFF2ToTTF(raw_input, input.size(), &out);
+    // Decode straight into the mapped output file, which starts out at the
+    // size the table directory adds up to and grows if that turns out to be
+    // too small.
+    woff2::WOFF2MmapFileOut out(outfilename,
+        woff2::ComputeWOFF2DecodedSize(input.data(), input.size()));
+    if (!out.IsOpen()) {
+      *error = "could not create " + outfilename;
+      return false;
+    }
 
-  if (ok) {
-    woff2::SetFileContents(outfilename, output.begin(),
-        output.begin() + out.Size());
-  }
-  return ok ? 0 : 1;
+    woff2::WOFF2DecodeParams params;
+    params.context = &worker.context;
+    params.stats = &worker.failure;
+    params.dictionary = given_dictionary;
+    params.memory_limit = memory_limit;
+    worker.failure.Reset();
+    bool ok = woff2::ConvertWOFF2ToTTF(input.data(), input.size(), &out,
+                                       params);
+    // Unless it is closed, the output is dropped, and outfilename kept.
+    if (!ok) {
+      *error = "decompression failed: " + worker.failure.message();
+    } else if (!out.Close()) {
+      *error = "could not write " + outfilename;
+      ok = false;
+    }
+    return ok;
+  });
+
+  return failures == 0 ? 0 : 1;
 }
@@ -0,0 +1,105 @@
+/* Copyright 2026 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+/* A commandline tool for making a shared Brotli dictionary out of the fonts
+   of a family, for woff2_compress and woff2_decompress. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "./file.h"
+#include <woff2/dictionary.h>
+#include <woff2/encode.h>
+#include <woff2/output.h>
+
+namespace {
+
+// Parses the value of flag out of arg into *value, if arg is that flag.
+bool ParseIntFlag(const char* arg, const char* flag, long min, long max,
+                  long* value, bool* ok) {
+  size_t flag_length = strlen(flag);
+  if (strncmp(arg, flag, flag_length) != 0) {
+    return false;
+  }
+  char* end;
+  *value = strtol(arg + flag_length, &end, 10);
+  *ok = *end == '\0' && end != arg + flag_length && *value >= min &&
+        *value <= max;
+  return true;
+}
+
+void PrintUsage(const char* tool) {
+  fprintf(stderr,
+      "Usage: %s [options] <dictionary> <font>...\n"
+      "  --size=N        at most N bytes of dictionary (default 65536)\n"
+      "  --quality=N     Brotli quality the fonts will be compressed with,\n"
+      "                  0 to 11 (default 11)\n"
+      "  --window=N      Brotli window bits, 10 to 24 (default 22)\n", tool);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  long size = 64 * 1024;
+  long quality = 11;
+  long window = 22;
+  std::vector<std::string> filenames;
+  for (int i = 1; i < argc; ++i) {
+    bool ok = true;
+    if (ParseIntFlag(argv[i], "--size=", 1, 1 << 24, &size, &ok) ||
+        ParseIntFlag(argv[i], "--quality=", 0, 11, &quality, &ok) ||
+        ParseIntFlag(argv[i], "--window=", 10, 24, &window, &ok)) {
+      if (!ok) {
+        fprintf(stderr, "Invalid value for %s\n", argv[i]);
+        PrintUsage(argv[0]);
+        return 1;
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      PrintUsage(argv[0]);
+      return 1;
+    } else {
+      filenames.push_back(argv[i]);
+    }
+  }
+  if (filenames.size() < 3) {
+    fprintf(stderr, "A dictionary and at least two fonts must be given.\n");
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> fonts;
+  for (size_t i = 1; i < filenames.size(); ++i) {
+    fonts.push_back(woff2::GetFileContent(filenames[i]));
+    if (fonts.back().empty()) {
+      fprintf(stderr, "Could not read %s.\n", filenames[i].c_str());
+      return 1;
+    }
+  }
+
+  woff2::WOFF2Dictionary dictionary;
+  if (!woff2::BuildWOFF2Dictionary(fonts, size, quality, window,
+                                   &dictionary)) {
+    fprintf(stderr, "Could not make a dictionary out of these fonts.\n");
+    return 1;
+  }
+
+  std::string output;
+  woff2::WOFF2StringOut out(&output);
+  out.SetMaxSize(std::string::npos);
+  if (!woff2::WriteWOFF2Dictionary(dictionary, &out)) {
+    fprintf(stderr, "Could not write the dictionary.\n");
+    return 1;
+  }
+  woff2::SetFileContents(filenames[0], output.begin(), output.end());
+  fprintf(stdout, "Dictionary %04x of %zu bytes written to %s\n",
+          dictionary.id, dictionary.data.size(), filenames[0].c_str());
+  return 0;
+}
@@ -9,17 +9,27 @@
 #include <woff2/encode.h>
 
 #include <stdlib.h>
+#include <algorithm>
 #include <complex>
 #include <cstring>
 #include <limits>
+#include <map>
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <brotli/encode.h>
+#include <woff2/decode.h>
 #include "./buffer.h"
+#include "./decode_stream.h"
+#include "./dictionary_encoder.h"
+#include "./flat_map.h"
 #include "./font.h"
 #include "./normalize.h"
+#include "./parallel.h"
 #include "./round.h"
+#include "./stats.h"
 #include "./store_bytes.h"
 #include "./table_tags.h"
 #include "./transform.h"
@@ -28,35 +38,111 @@
 
 namespace woff2 {
 
+struct EncodeContext::Buffers {
+  // Buffers of the tables of the last font, by font index and tag.
+  std::map<std::pair<size_t, uint32_t>, std::vector<uint8_t>> table_buffers;
+  // Memory for the glyf transform, by font index.
+  std::vector<GlyfTransformBuffers> glyf_buffers;
+  std::vector<uint8_t> transform_buf;
+};
+
+EncodeContext::EncodeContext() : buffers_(new Buffers) {}
+
+EncodeContext::~EncodeContext() {}
+
+void EncodeContext::Clear() {
+  buffers_.reset(new Buffers);
+}
+
+EncodeContext::Buffers* GetBuffers(EncodeContext* context) {
+  return context->buffers_.get();
+}
 
 namespace {
 
 const size_t kWoff2HeaderSize = 48;
 const size_t kWoff2EntrySize = 20;
 
-bool Compress(const uint8_t* data, const size_t len, uint8_t* result,
-              uint32_t* result_len, BrotliEncoderMode mode, int quality) {
-  size_t compressed_len = *result_len;
-  if (BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, mode, len, data,
-                            &compressed_len, result) == 0) {
-    return false;
+// Index in the table directory of each table, by tag and offset in the font.
+typedef FlatMap<std::pair<uint32_t, uint32_t>, uint16_t> TableIndexMap;
+
+// Rough speed of Brotli on font data at each quality, in bytes per second.
+const double kBrotliSpeeds[] = {
+  200e6, 150e6, 90e6, 70e6, 45e6, 25e6, 20e6, 16e6, 16e6, 10e6, 0.6e6, 0.3e6
+};
+
+// Returns the smallest Brotli window, of at most max_window bits, that holds
+// length bytes.
+int FitBrotliWindow(size_t length, int max_window) {
+  if (max_window < BROTLI_MIN_WINDOW_BITS) {
+    return max_window;  // for Compress to reject
   }
-  *result_len = compressed_len;
-  return true;
+  int window = BROTLI_MIN_WINDOW_BITS;
+  while (window < max_window && (size_t{1} << window) - 16 < length) {
+    ++window;
+  }
+  return window;
 }
 
-bool Woff2Compress(const uint8_t* data, const size_t len,
-                   uint8_t* result, uint32_t* result_len,
-                   int quality) {
-  return Compress(data, len, result, result_len,
-                  BROTLI_MODE_FONT, quality);
-}
+// Compresses data into out at offset, taking the output of Brotli as it
+// comes instead of staging the whole stream in a buffer of its own. Sets
+// *result_len to the compressed length. With a dictionary, the settings of
+// the dictionary are used, and the output is what follows its primer.
+bool Compress(const uint8_t* data, const size_t len, WOFF2Out* out,
+              size_t offset, size_t* result_len, BrotliEncoderMode mode,
+              int quality, int window, const WOFF2Dictionary* dictionary,
+              StatsRecorder* recorder) {
+  BrotliEncoderPtr state(NULL, &BrotliEncoderDestroyInstance);
+  if (dictionary != NULL) {
+    // Decoders are primed with the primer that came with the dictionary, so
+    // this encoder has to have made the very same one.
+    std::string primer;
+    state = CreatePrimedEncoder(*dictionary, &primer);
+    if (state && primer != dictionary->primer) {
+#ifdef FONT_COMPRESSION_BIN
+      fprintf(stderr, "The dictionary was made by another Brotli.\n");
+#endif
+      recorder->Fail(WOFF2Failure::kDictionary);
+      return FONT_COMPRESSION_FAILURE();
+    }
+  } else if (window >= BROTLI_MIN_WINDOW_BITS &&
+             window <= BROTLI_MAX_WINDOW_BITS) {
+    state.reset(BrotliEncoderCreateInstance(NULL, NULL, NULL));
+    if (state) {
+      BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_QUALITY, quality);
+      BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_LGWIN, window);
+      BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_MODE, mode);
+      BrotliEncoderSetParameter(state.get(), BROTLI_PARAM_SIZE_HINT,
+          static_cast<uint32_t>(std::min<size_t>(
+              len, std::numeric_limits<uint32_t>::max())));
+    }
+  }
+  if (!state) {
+    recorder->Fail(WOFF2Failure::kBrotli);
+    return FONT_COMPRESSION_FAILURE();
+  }
 
-bool TextCompress(const uint8_t* data, const size_t len,
-                  uint8_t* result, uint32_t* result_len,
-                  int quality) {
-  return Compress(data, len, result, result_len,
-                  BROTLI_MODE_TEXT, quality);
+  size_t available_in = len;
+  const uint8_t* next_in = data;
+  size_t written = 0;
+  while (!BrotliEncoderIsFinished(state.get())) {
+    size_t available_out = 0;
+    if (!BrotliEncoderCompressStream(state.get(), BROTLI_OPERATION_FINISH,
+                                     &available_in, &next_in,
+                                     &available_out, NULL, NULL)) {
+      recorder->Fail(WOFF2Failure::kBrotli);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    size_t chunk_len = 0;
+    const uint8_t* chunk = BrotliEncoderTakeOutput(state.get(), &chunk_len);
+    if (chunk_len > 0 && !out->Write(chunk, offset + written, chunk_len)) {
+      recorder->Fail(WOFF2Failure::kOutput);
+      return FONT_COMPRESSION_FAILURE();
+    }
+    written += chunk_len;
+  }
+  *result_len = written;
+  return true;
 }
 
 int KnownTableIndex(uint32_t tag) {
@@ -91,12 +177,11 @@ size_t TableEntrySize(const Table& table) {
   return size;
 }
 
-size_t ComputeWoff2Length(const FontCollection& font_collection,
-                          const std::vector<Table>& tables,
-                          std::map<std::pair<uint32_t, uint32_t>, uint16_t>
-                            index_by_tag_offset,
-                          size_t compressed_data_length,
-                          size_t extended_metadata_length) {
+// Length of the WOFF2 header, table directory and collection directory,
+// which come before the compressed data.
+size_t ComputeDirectoryLength(const FontCollection& font_collection,
+                              const std::vector<Table>& tables,
+                              const TableIndexMap& index_by_tag_offset) {
   size_t size = kWoff2HeaderSize;
 
   for (const auto& table : tables) {
@@ -117,18 +202,13 @@ size_t ComputeWoff2Length(const FontCollection& font_collection,
         // no collection entry for xform table
         if (table.tag & 0x80808080) continue;
 
-        std::pair<uint32_t, uint32_t> tag_offset(table.tag, table.offset);
-        uint16_t table_index = index_by_tag_offset[tag_offset];
+        auto it = index_by_tag_offset.find({table.tag, table.offset});
+        uint16_t table_index = it == index_by_tag_offset.end() ? 0 : it->second;
         size += Size255UShort(table_index);  // 255UInt16 index entry
       }
     }
   }
 
-  // compressed data
-  size += compressed_data_length;
-  size = Round4(size);
-
-  size += extended_metadata_length;
   return size;
 }
 
@@ -172,6 +252,46 @@ size_t ComputeTotalTransformLength(const Font& font) {
   return total;
 }
 
+// Lends the table buffers kept by a context to the tables of a collection, and
+// takes them back when going out of scope, to be lent again next time.
+class TableBufferLoan {
+ public:
+  TableBufferLoan(EncodeContext::Buffers* buffers,
+                  FontCollection* font_collection)
+      : buffers_(buffers), font_collection_(font_collection) {
+    std::vector<Font>& fonts = font_collection_->fonts;
+    for (size_t i = 0; i < fonts.size(); ++i) {
+      for (auto& entry : fonts[i].tables) {
+        auto it = buffers_->table_buffers.find({i, entry.first});
+        if (it != buffers_->table_buffers.end()) {
+          entry.second.buffer.swap(it->second);
+          entry.second.buffer.clear();
+        }
+      }
+    }
+  }
+
+  ~TableBufferLoan() {
+    std::vector<Font>& fonts = font_collection_->fonts;
+    for (size_t i = 0; i < fonts.size(); ++i) {
+      for (auto& entry : fonts[i].tables) {
+        std::vector<uint8_t>& buffer = entry.second.buffer;
+        if (entry.first == (kGlyfTableTag ^ 0x80808080)) {
+          if (i < buffers_->glyf_buffers.size()) {
+            buffers_->glyf_buffers[i].glyf.swap(buffer);
+          }
+        } else if (!(entry.first & 0x80808080)) {
+          buffers_->table_buffers[{i, entry.first}].swap(buffer);
+        }
+      }
+    }
+  }
+
+ private:
+  EncodeContext::Buffers* buffers_;
+  FontCollection* font_collection_;
+};
+
 }  // namespace
 
 size_t MaxWOFF2CompressedSize(const uint8_t* data, size_t length) {
@@ -187,77 +307,196 @@ size_t MaxWOFF2CompressedSize(const uint8_t* data, size_t length,
   return length + 1024 + extended_metadata.length();
 }
 
-uint32_t CompressedBufferSize(uint32_t original_size) {
-  return 1.2 * original_size + 10240;
+namespace {
+
+// An earlier encode of the font, decoded to compare the new one with.
+struct PreviousEncode {
+  const uint8_t* data = NULL;
+  size_t length = 0;
+  Woff2Directory directory;
+  std::vector<uint8_t> stream;
+  // The decoded font, which fonts points into.
+  std::string ttf;
+  FontCollection fonts;
+};
+
+// Reads params.previous_woff2 into *previous. Returns false if there is none
+// or it can't be used.
+bool ReadPreviousEncode(const WOFF2Params& params, PreviousEncode* previous) {
+  if (params.previous_woff2 == NULL) {
+    return false;
+  }
+  previous->data = params.previous_woff2;
+  previous->length = params.previous_woff2_length;
+  uint16_t dictionary_id = params.dictionary != NULL ? params.dictionary->id : 0;
+  if (!ReadWOFF2Directory(previous->data, previous->length,
+                          &previous->directory) ||
+      previous->directory.reserved != dictionary_id ||
+      !DecompressWOFF2Stream(previous->data, previous->length,
+                             params.dictionary, &previous->stream)) {
+    return false;
+  }
+  WOFF2StringOut ttf_out(&previous->ttf);
+  ttf_out.SetMaxSize(std::max<size_t>(ttf_out.MaxSize(),
+                                      previous->directory.total_sfnt_size));
+  WOFF2DecodeParams decode_params;
+  decode_params.dictionary = params.dictionary;
+  return ConvertWOFF2ToTTFFromStream(previous->data, previous->length,
+                                     previous->stream, &ttf_out,
+                                     decode_params) &&
+         ReadFontCollection(
+             reinterpret_cast<const uint8_t*>(previous->ttf.data()),
+             previous->ttf.size(), &previous->fonts);
 }
 
-bool TransformFontCollection(FontCollection* font_collection) {
-  for (auto& font : font_collection->fonts) {
-    if (!TransformGlyfAndLocaTables(&font)) {
-#ifdef FONT_COMPRESSION_BIN
-      fprintf(stderr, "glyf/loca transformation failed.\n");
-#endif
-      return FONT_COMPRESSION_FAILURE();
-    }
+bool SameTable(const Font::Table* a, const Font::Table* b) {
+  return a != NULL && b != NULL && a->length == b->length &&
+         a->checksum == b->checksum &&
+         (a->length == 0 || memcmp(a->data, b->data, a->length) == 0);
+}
+
+// If the normalized glyf and loca tables of font font_index are those
+// previous decoded to, adds the transformed tables previous has for them to
+// the font, as TransformGlyfAndLocaTables() would, and returns true.
+bool ReusePreviousGlyf(const PreviousEncode& previous, size_t font_index,
+                       Font* font) {
+  if (font_index >= previous.fonts.fonts.size()) {
+    return false;
+  }
+  const Font& previous_font = previous.fonts.fonts[font_index];
+  const Font::Table* glyf_table = font->FindTable(kGlyfTableTag);
+  const Font::Table* head_table = font->FindTable(kHeadTableTag);
+  const Font::Table* previous_head = previous_font.FindTable(kHeadTableTag);
+  if (glyf_table == NULL || glyf_table->IsReused() || head_table == NULL ||
+      previous_head == NULL || head_table->length < 52 ||
+      previous_head->length < 52 ||
+      head_table->data[51] != previous_head->data[51] ||  // index_format
+      !SameTable(glyf_table, previous_font.FindTable(kGlyfTableTag)) ||
+      !SameTable(font->FindTable(kLocaTableTag),
+                 previous_font.FindTable(kLocaTableTag))) {
+    return false;
   }
 
-  return true;
+  const Woff2Directory& directory = previous.directory;
+  std::vector<uint16_t> table_indices;
+  if (directory.fonts.empty()) {
+    for (size_t i = 0; i < directory.tables.size(); ++i) {
+      table_indices.push_back(i);
+    }
+  } else if (font_index < directory.fonts.size()) {
+    table_indices = directory.fonts[font_index].table_indices;
+  }
+  for (uint16_t index : table_indices) {
+    const Woff2Directory::Table& entry = directory.tables[index];
+    if (entry.tag != kGlyfTableTag) continue;
+    if (!entry.transformed) {
+      return false;
+    }
+    Font::Table* transformed_glyf =
+        &font->tables[kGlyfTableTag ^ 0x80808080];
+    Font::Table* transformed_loca =
+        &font->tables[kLocaTableTag ^ 0x80808080];
+    transformed_glyf->tag = kGlyfTableTag ^ 0x80808080;
+    transformed_glyf->length = entry.stream_length;
+    transformed_glyf->data = &previous.stream[entry.stream_offset];
+    transformed_loca->tag = kLocaTableTag ^ 0x80808080;
+    transformed_loca->length = 0;
+    transformed_loca->data = NULL;
+    return true;
+  }
+  return false;
 }
 
-bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
-                       uint8_t *result, size_t *result_length) {
-  WOFF2Params params;
-  return ConvertTTFToWOFF2(data, length, result, result_length,
-                           params);
+// Transforms glyf and loca of the fonts normalized by NormalizeFontCollection,
+// taking the transformed tables from previous for the fonts where they have
+// not changed.
+bool TransformFontCollection(FontCollection* font_collection,
+                             const PreviousEncode& previous, int num_threads,
+                             std::vector<GlyfTransformBuffers>* buffers) {
+  std::vector<Font>& fonts = font_collection->fonts;
+  if (buffers->size() < fonts.size()) {
+    buffers->resize(fonts.size());
+  }
+  for (size_t i = 0; i < fonts.size(); ++i) {
+    if (!ReusePreviousGlyf(previous, i, &fonts[i]) &&
+        !TransformGlyfAndLocaTables(&fonts[i], num_threads, &(*buffers)[i])) {
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+  return true;
 }
 
-bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
-                       uint8_t *result, size_t *result_length,
-                       const WOFF2Params& params) {
+bool Encode(const uint8_t *data, size_t length, WOFF2Out* out,
+            const WOFF2Params& params, EncodeContext::Buffers* buffers,
+            StatsRecorder* recorder) {
   FontCollection font_collection;
+  ScopedPhase header_phase(recorder, WOFF2Phase::kHeader);
   if (!ReadFontCollection(data, length, &font_collection)) {
 #ifdef FONT_COMPRESSION_BIN
     fprintf(stderr, "Parsing of the input font failed.\n");
 #endif
+    recorder->Fail(WOFF2Failure::kInvalidFont);
     return FONT_COMPRESSION_FAILURE();
   }
 
-  if (!NormalizeFontCollection(&font_collection)) {
-    return FONT_COMPRESSION_FAILURE();
-  }
+  TableBufferLoan table_buffer_loan(buffers, &font_collection);
 
-  if (params.allow_transforms && !TransformFontCollection(&font_collection)) {
-    return FONT_COMPRESSION_FAILURE();
-  } else {
-    // glyf/loca use 11 to flag "not transformed"
-    for (auto& font : font_collection.fonts) {
-      Font::Table* glyf_table = font.FindTable(kGlyfTableTag);
-      Font::Table* loca_table = font.FindTable(kLocaTableTag);
-      if (glyf_table) {
-        glyf_table->flag_byte |= 0xc0;
-      }
-      if (loca_table) {
-        loca_table->flag_byte |= 0xc0;
+  if (params.glyph_subset != NULL) {
+    for (Font& font : font_collection.fonts) {
+      if (!RetainGlyphs(&font, *params.glyph_subset)) {
+        recorder->Fail(WOFF2Failure::kInvalidFont, kGlyfTableTag);
+        return FONT_COMPRESSION_FAILURE();
       }
     }
   }
 
-  // Although the compressed size of each table in the final woff2 file won't
-  // be larger than its transform_length, we have to allocate a large enough
-  // buffer for the compressor, since the compressor can potentially increase
-  // the size. If the compressor overflows this, it should return false and
-  // then this function will also return false.
+  PreviousEncode previous;
+  bool has_previous = ReadPreviousEncode(params, &previous);
+
+  // With transforms, glyf and loca are transformed as they are normalized, so
+  // that each glyph is read only once. Given a previous encode, they are
+  // normalized first to find out whether its transformed glyf can be reused.
+  ScopedPhase normalize_phase(recorder, WOFF2Phase::kNormalize);
+  bool normalized;
+  if (!params.allow_transforms) {
+    normalized = NormalizeFontCollection(&font_collection, params.num_threads);
+  } else if (has_previous) {
+    normalized =
+        NormalizeFontCollection(&font_collection, params.num_threads) &&
+        TransformFontCollection(&font_collection, previous, params.num_threads,
+                                &buffers->glyf_buffers);
+  } else {
+    normalized = NormalizeAndTransformFontCollection(
+        &font_collection, params.num_threads, &buffers->glyf_buffers);
+  }
+  if (!normalized) {
+    recorder->Fail(WOFF2Failure::kNormalize);
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  // glyf/loca use 11 to flag "not transformed"
+  for (auto& font : font_collection.fonts) {
+    Font::Table* glyf_table = font.FindTable(kGlyfTableTag);
+    Font::Table* loca_table = font.FindTable(kLocaTableTag);
+    if (glyf_table) {
+      glyf_table->flag_byte |= 0xc0;
+    }
+    if (loca_table) {
+      loca_table->flag_byte |= 0xc0;
+    }
+  }
 
   size_t total_transform_length = 0;
   for (const auto& font : font_collection.fonts) {
     total_transform_length += ComputeTotalTransformLength(font);
   }
-  size_t compression_buffer_size = CompressedBufferSize(total_transform_length);
-  std::vector<uint8_t> compression_buf(compression_buffer_size);
-  uint32_t total_compressed_length = compression_buffer_size;
 
   // Collect all transformed data into one place in output order.
-  std::vector<uint8_t> transform_buf(total_transform_length);
+  ScopedPhase collect_phase(recorder, WOFF2Phase::kOutput);
+  std::vector<uint8_t>& transform_buf = buffers->transform_buf;
+  recorder->Grew(WOFF2Buffer::kTransform, transform_buf.size(),
+                 total_transform_length);
+  transform_buf.resize(total_transform_length);
   size_t transform_offset = 0;
   for (const auto& font : font_collection.fonts) {
     for (const auto tag : font.OutputOrderedTags()) {
@@ -272,45 +511,8 @@ bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
     }
   }
 
-  // Compress all transformed data in one stream.
-  if (!Woff2Compress(transform_buf.data(), total_transform_length,
-                     &compression_buf[0],
-                     &total_compressed_length,
-                     params.brotli_quality)) {
-#ifdef FONT_COMPRESSION_BIN
-    fprintf(stderr, "Compression of combined table failed.\n");
-#endif
-    return FONT_COMPRESSION_FAILURE();
-  }
-
-#ifdef FONT_COMPRESSION_BIN
-  fprintf(stderr, "Compressed %zu to %u.\n", total_transform_length,
-          total_compressed_length);
-#endif
-
-  // Compress the extended metadata
-  // TODO(user): how does this apply to collections
-  uint32_t compressed_metadata_buf_length =
-    CompressedBufferSize(params.extended_metadata.length());
-  std::vector<uint8_t> compressed_metadata_buf(compressed_metadata_buf_length);
-
-  if (params.extended_metadata.length() > 0) {
-    if (!TextCompress((const uint8_t*)params.extended_metadata.data(),
-                      params.extended_metadata.length(),
-                      compressed_metadata_buf.data(),
-                      &compressed_metadata_buf_length,
-                      params.brotli_quality)) {
-#ifdef FONT_COMPRESSION_BIN
-      fprintf(stderr, "Compression of extended metadata failed.\n");
-#endif
-      return FONT_COMPRESSION_FAILURE();
-    }
-  } else {
-    compressed_metadata_buf_length = 0;
-  }
-
   std::vector<Table> tables;
-  std::map<std::pair<uint32_t, uint32_t>, uint16_t> index_by_tag_offset;
+  TableIndexMap index_by_tag_offset;
 
   for (const auto& font : font_collection.fonts) {
 
@@ -321,9 +523,10 @@ bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
       }
 
       std::pair<uint32_t, uint32_t> tag_offset(src_table.tag, src_table.offset);
-      if (index_by_tag_offset.find(tag_offset) == index_by_tag_offset.end()) {
+      if (!index_by_tag_offset.count(tag_offset)) {
         index_by_tag_offset[tag_offset] = tables.size();
       } else {
+        recorder->Fail(WOFF2Failure::kInvalidFont, src_table.tag);
         return false;
       }
 
@@ -332,65 +535,25 @@ bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
       table.flags = src_table.flag_byte;
       table.src_length = src_table.length;
       table.transform_length = src_table.length;
-      const uint8_t* transformed_data = src_table.data;
       const Font::Table* transformed_table =
           font.FindTable(src_table.tag ^ 0x80808080);
       if (transformed_table != NULL) {
         table.flags = transformed_table->flag_byte;
         table.flags |= kWoff2FlagsTransform;
         table.transform_length = transformed_table->length;
-        transformed_data = transformed_table->data;
-
       }
       tables.push_back(table);
     }
   }
 
-  size_t woff2_length = ComputeWoff2Length(font_collection, tables,
-      index_by_tag_offset, total_compressed_length,
-      compressed_metadata_buf_length);
-  if (woff2_length > *result_length) {
-#ifdef FONT_COMPRESSION_BIN
-    fprintf(stderr, "Result allocation was too small (%zd vs %zd bytes).\n",
-           *result_length, woff2_length);
-#endif
-    return FONT_COMPRESSION_FAILURE();
-  }
-  *result_length = woff2_length;
-
-  size_t offset = 0;
-
-  // start of woff2 header (http://www.w3.org/TR/WOFF2/#woff20Header)
-  StoreU32(kWoff2Signature, &offset, result);
-  if (font_collection.flavor != kTtcFontFlavor) {
-    StoreU32(font_collection.fonts[0].flavor, &offset, result);
-  } else {
-    StoreU32(kTtcFontFlavor, &offset, result);
-  }
-  StoreU32(woff2_length, &offset, result);
-  Store16(tables.size(), &offset, result);
-  Store16(0, &offset, result);  // reserved
-  // totalSfntSize
-  StoreU32(ComputeUncompressedLength(font_collection), &offset, result);
-  StoreU32(total_compressed_length, &offset, result);  // totalCompressedSize
-
-  // Let's just all be v1.0
-  Store16(1, &offset, result);  // majorVersion
-  Store16(0, &offset, result);  // minorVersion
-  if (compressed_metadata_buf_length > 0) {
-    StoreU32(woff2_length - compressed_metadata_buf_length,
-             &offset, result);  // metaOffset
-    StoreU32(compressed_metadata_buf_length, &offset, result);  // metaLength
-    StoreU32(params.extended_metadata.length(),
-             &offset, result);  // metaOrigLength
-  } else {
-    StoreU32(0, &offset, result);  // metaOffset
-    StoreU32(0, &offset, result);  // metaLength
-    StoreU32(0, &offset, result);  // metaOrigLength
-  }
-  StoreU32(0, &offset, result);  // privOffset
-  StoreU32(0, &offset, result);  // privLength
-  // end of woff2 header
+  // The directory goes out first, with the header left blank until the
+  // lengths it holds are known, and Brotli then writes the compressed data
+  // right behind it.
+  size_t directory_length = ComputeDirectoryLength(font_collection, tables,
+                                                   index_by_tag_offset);
+  std::vector<uint8_t> directory(directory_length);
+  uint8_t* result = directory.data();
+  size_t offset = kWoff2HeaderSize;
 
   // table directory (http://www.w3.org/TR/WOFF2/#table_dir_format)
   for (const auto& table : tables) {
@@ -419,40 +582,230 @@ bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
         // for reused tables, only the original has an updated offset
         uint32_t table_offset =
           table.IsReused() ? table.reuse_of->offset : table.offset;
-        uint32_t table_length =
-          table.IsReused() ? table.reuse_of->length : table.length;
         std::pair<uint32_t, uint32_t> tag_offset(table.tag, table_offset);
-        if (index_by_tag_offset.find(tag_offset) == index_by_tag_offset.end()) {
+        auto index = index_by_tag_offset.find(tag_offset);
+        if (index == index_by_tag_offset.end()) {
 #ifdef FONT_COMPRESSION_BIN
 fprintf(stderr, "Missing table index for offset 0x%08x\n",
                   table_offset);
 #endif
+          recorder->Fail(WOFF2Failure::kInvalidFont, table.tag);
           return FONT_COMPRESSION_FAILURE();
         }
-        uint16_t index = index_by_tag_offset[tag_offset];
-        Store255UShort(index, &offset, result);
+        Store255UShort(index->second, &offset, result);
 
       }
 
     }
   }
 
+  if (offset != directory_length) {
+#ifdef FONT_COMPRESSION_BIN
+    fprintf(stderr, "Mismatch between computed and actual directory length "
+            "(%zd vs %zd)\n", directory_length, offset);
+#endif
+    recorder->Fail(WOFF2Failure::kInvalidFont);
+    return FONT_COMPRESSION_FAILURE();
+  }
+  if (!out->Write(result, 0, directory_length)) {
+    recorder->Fail(WOFF2Failure::kOutput);
+    return FONT_COMPRESSION_FAILURE();
+  }
+
   // compressed data format (http://www.w3.org/TR/WOFF2/#table_format)
+  // Compress all transformed data in one stream.
+  ScopedPhase brotli_phase(recorder, WOFF2Phase::kBrotli);
+  const size_t metadata_length = params.extended_metadata.length();
+  int font_quality = params.brotli_quality;
+  int metadata_quality = params.brotli_quality;
+  int font_window = params.brotli_window;
+  int metadata_window = params.brotli_window;
+  if (params.time_budget > 0) {
+    // The metadata is small next to the font data, so it gets what the font
+    // data leaves of the budget, which is nearly always enough for the
+    // highest quality. A dictionary comes with its own settings, which the
+    // font data has to be compressed with for the primer to match.
+    double seconds = params.time_budget;
+    if (params.dictionary == NULL) {
+      font_quality = ChooseBrotliQuality(total_transform_length, seconds);
+      seconds -= total_transform_length / kBrotliSpeeds[font_quality];
+      font_window = FitBrotliWindow(total_transform_length,
+                                    params.brotli_window);
+    }
+    metadata_quality = ChooseBrotliQuality(metadata_length, seconds);
+    metadata_window = FitBrotliWindow(metadata_length, params.brotli_window);
+  }
+  size_t total_compressed_length = 0;
+  const Woff2Directory& previous_directory = previous.directory;
+  // Nothing in a WOFF2 file tells which Brotli settings made it, so its
+  // compressed data is only known to be what this encode would make when the
+  // settings are those of the dictionary both were made with.
+  if (has_previous && params.dictionary != NULL &&
+      previous_directory.compressed_offset == directory_length &&
+      previous_directory.flavor == (font_collection.flavor == kTtcFontFlavor
+                                        ? kTtcFontFlavor
+                                        : font_collection.fonts[0].flavor) &&
+      memcmp(previous.data + kWoff2HeaderSize, result + kWoff2HeaderSize,
+             directory_length - kWoff2HeaderSize) == 0 &&
+      previous.stream.size() == total_transform_length &&
+      memcmp(previous.stream.data(), transform_buf.data(),
+             total_transform_length) == 0) {
+    // The font data is what was compressed before, so is its compression.
+    total_compressed_length = previous_directory.total_compressed_size;
+    if (!out->Write(previous.data + directory_length, directory_length,
+                    total_compressed_length)) {
+      recorder->Fail(WOFF2Failure::kOutput);
+      return FONT_COMPRESSION_FAILURE();
+    }
+  } else if (!Compress(transform_buf.data(), total_transform_length, out,
+                directory_length, &total_compressed_length, BROTLI_MODE_FONT,
+                font_quality, font_window, params.dictionary,
+                recorder)) {
+#ifdef FONT_COMPRESSION_BIN
+    fprintf(stderr, "Compression of combined table failed.\n");
+#endif
+    return FONT_COMPRESSION_FAILURE();
+  }
 
-  StoreBytes(&compression_buf[0], total_compressed_length, &offset, result);
-  offset = Round4(offset);
+#ifdef FONT_COMPRESSION_BIN
+  fprintf(stderr, "Compressed %zu to %zu.\n", total_transform_length,
+          total_compressed_length);
+#endif
 
-  StoreBytes(compressed_metadata_buf.data(), compressed_metadata_buf_length,
-             &offset, result);
+  offset = directory_length + total_compressed_length;
+  const uint8_t kPadding[3] = {0};
+  size_t metadata_offset = Round4(offset);
+  if (!out->Write(kPadding, offset, metadata_offset - offset)) {
+    recorder->Fail(WOFF2Failure::kOutput);
+    return FONT_COMPRESSION_FAILURE();
+  }
 
-  if (*result_length != offset) {
+  // Compress the extended metadata
+  // TODO(user): how does this apply to collections
+  size_t compressed_metadata_length = 0;
+  if (params.extended_metadata.length() > 0) {
+    if (!Compress((const uint8_t*)params.extended_metadata.data(),
+                  params.extended_metadata.length(), out, metadata_offset,
+                  &compressed_metadata_length, BROTLI_MODE_TEXT,
+                  metadata_quality, metadata_window, NULL,
+                  recorder)) {
 #ifdef FONT_COMPRESSION_BIN
-    fprintf(stderr, "Mismatch between computed and actual length "
-            "(%zd vs %zd)\n", *result_length, offset);
+      fprintf(stderr, "Compression of extended metadata failed.\n");
 #endif
+      return FONT_COMPRESSION_FAILURE();
+    }
+  }
+
+  ScopedPhase header_out_phase(recorder, WOFF2Phase::kOutput);
+  size_t woff2_length = metadata_offset + compressed_metadata_length;
+  if (woff2_length > std::numeric_limits<uint32_t>::max()) {
+    recorder->Fail(WOFF2Failure::kOutput);
     return FONT_COMPRESSION_FAILURE();
   }
+  offset = 0;
+
+  // start of woff2 header (http://www.w3.org/TR/WOFF2/#woff20Header)
+  StoreU32(kWoff2Signature, &offset, result);
+  if (font_collection.flavor != kTtcFontFlavor) {
+    StoreU32(font_collection.fonts[0].flavor, &offset, result);
+  } else {
+    StoreU32(kTtcFontFlavor, &offset, result);
+  }
+  StoreU32(woff2_length, &offset, result);
+  Store16(tables.size(), &offset, result);
+  // reserved, unless the file needs a dictionary
+  Store16(params.dictionary != NULL ? params.dictionary->id : 0, &offset,
+          result);
+  // totalSfntSize
+  StoreU32(ComputeUncompressedLength(font_collection), &offset, result);
+  StoreU32(total_compressed_length, &offset, result);  // totalCompressedSize
+
+  // Let's just all be v1.0
+  Store16(1, &offset, result);  // majorVersion
+  Store16(0, &offset, result);  // minorVersion
+  if (compressed_metadata_length > 0) {
+    StoreU32(metadata_offset, &offset, result);  // metaOffset
+    StoreU32(compressed_metadata_length, &offset, result);  // metaLength
+    StoreU32(params.extended_metadata.length(),
+             &offset, result);  // metaOrigLength
+  } else {
+    StoreU32(0, &offset, result);  // metaOffset
+    StoreU32(0, &offset, result);  // metaLength
+    StoreU32(0, &offset, result);  // metaOrigLength
+  }
+  StoreU32(0, &offset, result);  // privOffset
+  StoreU32(0, &offset, result);  // privLength
+  // end of woff2 header
+
+  if (!out->Write(result, 0, kWoff2HeaderSize)) {
+    recorder->Fail(WOFF2Failure::kOutput);
+    return FONT_COMPRESSION_FAILURE();
+  }
+
+  if (recorder->enabled()) {
+    for (const auto& table : tables) {
+      recorder->stats()->OnTable(table.tag, table.transform_length,
+                                 table.src_length);
+    }
+    for (size_t i = 0; i < font_collection.fonts.size(); ++i) {
+      recorder->stats()->OnGlyphs(
+          i, std::max(0, NumGlyphs(font_collection.fonts[i])));
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int ChooseBrotliQuality(size_t length, double seconds) {
+  for (int quality = BROTLI_MAX_QUALITY; quality > BROTLI_MIN_QUALITY;
+       --quality) {
+    if (length <= seconds * kBrotliSpeeds[quality]) {
+      return quality;
+    }
+  }
+  return BROTLI_MIN_QUALITY;
+}
+
+bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
+                       uint8_t *result, size_t *result_length) {
+  WOFF2Params params;
+  return ConvertTTFToWOFF2(data, length, result, result_length,
+                           params);
+}
+
+bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
+                       uint8_t *result, size_t *result_length,
+                       const WOFF2Params& params) {
+  WOFF2MemoryOut out(result, *result_length);
+  if (!ConvertTTFToWOFF2(data, length, &out, params)) {
+    return false;
+  }
+  *result_length = out.Size();
   return true;
 }
 
+bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
+                       WOFF2Out* out) {
+  WOFF2Params params;
+  return ConvertTTFToWOFF2(data, length, out, params);
+}
+
+bool ConvertTTFToWOFF2(const uint8_t *data, size_t length,
+                       WOFF2Out* out, const WOFF2Params& params) {
+  std::unique_ptr<EncodeContext> own_context;
+  EncodeContext* context = params.context;
+  if (context == NULL) {
+    own_context.reset(new EncodeContext);
+    context = own_context.get();
+  }
+  StatsRecorder recorder(params.stats);
+  bool ok = Encode(data, length, out, params, GetBuffers(context), &recorder);
+  if (!ok && !recorder.failed()) {
+    recorder.Fail(WOFF2Failure::kInvalidFont);
+  }
+  recorder.Report();
+  return ok;
+}
+
 } // namespace woff2
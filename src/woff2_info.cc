@@ -6,14 +6,20 @@
 
 /* A commandline tool for dumping info about a woff2 file. */
 
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include <woff2/decode.h>
+#include "./batch.h"
 #include "file.h"
+#include "./parallel.h"
 #include "./woff2_common.h"
-#include "./buffer.h"
-#include "./font.h"
-#include "./table_tags.h"
-#include "./variable_length.h"
 
 std::string PrintTag(int tag) {
   if (tag & 0x80808080) {
@@ -28,115 +34,145 @@ std::string PrintTag(int tag) {
   return std::string(printable, 4);
 }
 
+// Checks that each of the files given after --validate decodes, on up to
+// --jobs threads, and prints what is wrong with the ones that don't.
+int Validate(int argc, char **argv) {
+  woff2::WOFF2Dictionary dictionary;
+  const woff2::WOFF2Dictionary* given_dictionary = NULL;
+  woff2::BatchOptions options;
+  bool usable = woff2::ParseBatchArgs(argc, argv, [&](const char* arg) {
+    if (strncmp(arg, "--dictionary=", 13) == 0) {
+      if (!woff2::LoadDictionary(arg + 13, &dictionary)) {
+        exit(1);
+      }
+      given_dictionary = &dictionary;
+      return true;
+    }
+    return false;
+  }, &options);
+  if (!usable || !options.out_dir.empty()) {
+    fprintf(stderr,
+        "Usage: woff2_info --validate [options] <file>...\n"
+        "  --list=FILE     also check the files named in FILE, one per line;\n"
+        "                  - reads the names from stdin\n"
+        "  --jobs=N        check N files at a time (default 1)\n"
+        "  --dictionary=FILE\n"
+        "                  the dictionary made by woff2_dictionary that the\n"
+        "                  inputs were compressed with, if they were\n");
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<woff2::DecodeContext>> contexts(options.jobs);
+  for (auto& context : contexts) {
+    context.reset(new woff2::DecodeContext);
+  }
+  std::mutex print_mutex;
+  std::atomic<size_t> failures(0);
+  woff2::ParallelForWorkers(options.inputs.size(), options.jobs,
+                            [&](size_t worker, size_t i) {
+    const std::string& input = options.inputs[i];
+    woff2::MappedFile file(input);
+    std::string message;
+    if (!file.ok()) {
+      message = "could not read file";
+    } else {
+      woff2::WOFF2DecodeParams params;
+      params.context = contexts[worker].get();
+      params.dictionary = given_dictionary;
+      woff2::WOFF2Validation validation;
+      if (!woff2::ValidateWOFF2(file.data(), file.size(), params,
+                                &validation)) {
+        message = woff2::FailureMessage(validation.failure, validation.tag);
+      }
+    }
+    std::lock_guard<std::mutex> lock(print_mutex);
+    if (message.empty()) {
+      fprintf(stdout, "%s: valid\n", input.c_str());
+    } else {
+      fprintf(stdout, "%s: %s\n", input.c_str(), message.c_str());
+      ++failures;
+    }
+    return true;
+  });
+  return failures == 0 ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "One argument, the input filename, must be provided.\n");
+  if (argc >= 2 && strcmp(argv[1], "--validate") == 0) {
+    return Validate(argc - 1, argv + 1);
+  }
+  // Takes no flags of its own, so that any is reported as unknown.
+  woff2::BatchOptions options;
+  bool usable = woff2::ParseBatchArgs(argc, argv, [](const char*) {
+    return false;
+  }, &options);
+  if (!usable || options.inputs.size() != 1 || !options.out_dir.empty()) {
+    fprintf(stderr,
+        "Usage: woff2_info <file>\n"
+        "       woff2_info --validate [options] <file>...\n");
     return 1;
   }
 
-  std::string filename(argv[1]);
+  std::string filename(options.inputs[0]);
   std::string outfilename = filename.substr(0, filename.find_last_of(".")) + ".woff2";
   fprintf(stdout, "Processing %s => %s\n",
     filename.c_str(), outfilename.c_str());
   std::string input = woff2::GetFileContent(filename);
 
-  woff2::Buffer file(reinterpret_cast<const uint8_t*>(input.data()),
-    input.size());
-
-  printf("WOFF2Header\n");
-  uint32_t signature, flavor, length, totalSfntSize, totalCompressedSize;
-  uint32_t metaOffset, metaLength, metaOrigLength, privOffset, privLength;
-  uint16_t num_tables, reserved, major, minor;
-  if (!file.ReadU32(&signature)) return 1;
-  if (!file.ReadU32(&flavor)) return 1;
-  if (!file.ReadU32(&length)) return 1;
-  if (!file.ReadU16(&num_tables)) return 1;
-  if (!file.ReadU16(&reserved)) return 1;
-  if (!file.ReadU32(&totalSfntSize)) return 1;
-  if (!file.ReadU32(&totalCompressedSize)) return 1;
-  if (!file.ReadU16(&major)) return 1;
-  if (!file.ReadU16(&minor)) return 1;
-  if (!file.ReadU32(&metaOffset)) return 1;
-  if (!file.ReadU32(&metaLength)) return 1;
-  if (!file.ReadU32(&metaOrigLength)) return 1;
-  if (!file.ReadU32(&privOffset)) return 1;
-  if (!file.ReadU32(&privLength)) return 1;
-
-  if (signature != 0x774F4632) {
-    printf("Invalid signature: %08x\n", signature);
+  woff2::Woff2Directory dir;
+  if (!woff2::ReadWOFF2Directory(
+          reinterpret_cast<const uint8_t*>(input.data()), input.size(),
+          &dir)) {
+    printf("Invalid WOFF2 directory\n");
     return 1;
   }
-  printf("signature           0x%08x\n", signature);
-  printf("flavor              0x%08x\n", flavor);
-  printf("length              %d\n", length);
-  printf("numTables           %d\n", num_tables);
-  printf("reserved            %d\n", reserved);
-  printf("totalSfntSize       %d\n", totalSfntSize);
-  printf("totalCompressedSize %d\n", totalCompressedSize);
-  printf("majorVersion        %d\n", major);
-  printf("minorVersion        %d\n", minor);
-  printf("metaOffset          %d\n", metaOffset);
-  printf("metaLength          %d\n", metaLength);
-  printf("metaOrigLength      %d\n", metaOrigLength);
-  printf("privOffset          %d\n", privOffset);
-  printf("privLength          %d\n", privLength);
-
-  std::vector<uint32_t> table_tags;
-  printf("TableDirectory starts at +%zu\n", file.offset());
-  printf("Entry offset flags tag  origLength txLength\n");
-  for (auto i = 0; i < num_tables; i++) {
-    size_t offset = file.offset();
-    uint8_t flags;
-    uint32_t tag, origLength, transformLength;
-    if (!file.ReadU8(&flags)) return 1;
-    if ((flags & 0x3f) == 0x3f) {
-      if (!file.ReadU32(&tag)) return 1;
-    } else {
-      tag = woff2::kKnownTags[flags & 0x3f];
-    }
-    table_tags.push_back(tag);
-    if (!ReadBase128(&file, &origLength)) return 1;
-
-    printf("%5d %6zu  0x%02x %s %10d", i, offset, flags,
-        PrintTag(tag).c_str(), origLength);
 
-    uint8_t xform_version = (flags >> 6) & 0x3;
-    if (tag == woff2::kGlyfTableTag || tag == woff2::kLocaTableTag) {
-      if (xform_version == 0) {
-        if (!ReadBase128(&file, &transformLength)) return 1;
-        printf(" %8d", transformLength);
-      }
-    } else if (xform_version > 0) {
-      if (!ReadBase128(&file, &transformLength)) return 1;
-      printf(" %8d", transformLength);
+  printf("WOFF2Header\n");
+  printf("signature           0x%08x\n", woff2::kWoff2Signature);
+  printf("flavor              0x%08x\n", dir.flavor);
+  printf("length              %d\n", dir.length);
+  printf("numTables           %d\n", dir.num_tables);
+  printf("reserved            %d\n", dir.reserved);
+  printf("totalSfntSize       %d\n", dir.total_sfnt_size);
+  printf("totalCompressedSize %d\n", dir.total_compressed_size);
+  printf("majorVersion        %d\n", dir.major_version);
+  printf("minorVersion        %d\n", dir.minor_version);
+  printf("metaOffset          %d\n", dir.meta_offset);
+  printf("metaLength          %d\n", dir.meta_length);
+  printf("metaOrigLength      %d\n", dir.meta_orig_length);
+  printf("privOffset          %d\n", dir.priv_offset);
+  printf("privLength          %d\n", dir.priv_length);
+
+  printf("TableDirectory starts at +%zu\n", dir.tables[0].entry_offset);
+  printf("Entry offset flags tag  origLength txLength\n");
+  for (size_t i = 0; i < dir.tables.size(); i++) {
+    const woff2::Woff2Directory::Table& table = dir.tables[i];
+    printf("%5zu %6zu  0x%02x %s %10d", i, table.entry_offset, table.flags,
+        PrintTag(table.tag).c_str(), table.orig_length);
+    if (table.transformed) {
+      printf(" %8d", table.stream_length);
     }
     printf("\n");
   }
 
   // Collection header
-  if (flavor == woff2::kTtcFontFlavor) {
-    uint32_t version, numFonts;
-    if (!file.ReadU32(&version)) return 1;
-    if (!woff2::Read255UShort(&file, &numFonts)) return 1;
-    printf("CollectionHeader 0x%08x %d fonts\n", version, numFonts);
-
-    for (auto i = 0; i < numFonts; i++) {
-      uint32_t numTables, flavor;
-      if (!woff2::Read255UShort(&file, &numTables)) return 1;
-      if (!file.ReadU32(&flavor)) return 1;
-      printf("CollectionFontEntry %d flavor 0x%08x %d tables\n", i, flavor,
-          numTables);
-      for (auto j = 0; j < numTables; j++) {
-        uint32_t table_idx;
-        if (!woff2::Read255UShort(&file, &table_idx)) return 1;
-        if (table_idx >= table_tags.size()) return 1;
-        printf("  %d %s (idx %d)\n", j,
-            PrintTag(table_tags[table_idx]).c_str(), table_idx);
+  if (dir.collection_version) {
+    printf("CollectionHeader 0x%08x %zu fonts\n", dir.collection_version,
+        dir.fonts.size());
+
+    for (size_t i = 0; i < dir.fonts.size(); i++) {
+      const woff2::Woff2Directory::CollectionFont& font = dir.fonts[i];
+      printf("CollectionFontEntry %zu flavor 0x%08x %zu tables\n", i,
+          font.flavor, font.table_indices.size());
+      for (size_t j = 0; j < font.table_indices.size(); j++) {
+        uint16_t table_idx = font.table_indices[j];
+        printf("  %zu %s (idx %d)\n", j,
+            PrintTag(dir.tables[table_idx].tag).c_str(), table_idx);
       }
     }
   }
 
-  printf("TableDirectory ends at +%zu\n", file.offset());
+  printf("TableDirectory ends at +%zu\n", dir.compressed_offset);
 
   return 0;
 }
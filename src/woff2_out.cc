@@ -4,12 +4,92 @@
    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
 */
 
-/* Output buffer for WOFF2 decompression. */
+/* Output buffers for WOFF2 compression and decompression. */
 
 #include <woff2/output.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <limits>
+#include <span>
+
+#include "./woff2_common.h"
+
 namespace woff2 {
 
+namespace {
+
+// Creates a file of a new name next to filename, to be renamed to it, and
+// sets *temp_filename to its name. Returns the descriptor, or -1.
+int CreateTempFile(const std::string& filename, std::string* temp_filename) {
+  static std::atomic<unsigned> counter(0);
+  for (int attempt = 0; attempt < 100; ++attempt) {
+#if defined(_WIN32)
+    *temp_filename = filename + "." + std::to_string(_getpid()) + "." +
+                     std::to_string(counter++) + ".tmp";
+    int fd = _open(temp_filename->c_str(),
+                   _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY,
+                   _S_IREAD | _S_IWRITE);
+#else
+    *temp_filename = filename + "." + std::to_string(getpid()) + "." +
+                     std::to_string(counter++) + ".tmp";
+    int fd = open(temp_filename->c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+#endif
+    if (fd >= 0 || errno != EEXIST) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+#if !defined(_WIN32)
+// Gives [offset, end) of the file its blocks, growing the file to end bytes.
+// Returns false if the disk is full.
+bool AllocateFile(int fd, size_t offset, size_t end) {
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+  int error = posix_fallocate(fd, offset, end - offset);
+  if (error != EINVAL && error != EOPNOTSUPP) {
+    return error == 0;
+  }
+#endif
+  // The file system can't allocate blocks by itself, but writing zeros does.
+  static const uint8_t kZeros[65536] = {0};
+  while (offset < end) {
+    ssize_t n = pwrite(fd, kZeros, std::min(end - offset, sizeof(kZeros)),
+                       offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    offset += n;
+  }
+  return true;
+}
+#endif
+
+}  // namespace
+
+bool WOFF2Out::WriteWithChecksum(const void *buf, size_t n,
+                                 uint32_t *checksum) {
+  *checksum += ComputeULongSum(
+      std::span(static_cast<const uint8_t*>(buf), n));
+  return Write(buf, n);
+}
+
 WOFF2StringOut::WOFF2StringOut(std::string *buf)
     : buf_(buf), max_size_(kDefaultMaxSize), offset_(0) {}
 
@@ -34,6 +114,10 @@ bool WOFF2StringOut::Write(const void *buf, size_t offset, size_t n) {
   return true;
 }
 
+void WOFF2StringOut::SizeHint(size_t size) {
+  buf_->reserve(std::min(size, max_size_));
+}
+
 void WOFF2StringOut::SetMaxSize(size_t max_size) {
   max_size_ = max_size;
   if (offset_ > max_size_) {
@@ -60,4 +144,215 @@ bool WOFF2MemoryOut::Write(const void *buf, size_t offset, size_t n) {
   return true;
 }
 
+bool WOFF2MemoryOut::WriteWithChecksum(const void *buf, size_t n,
+                                       uint32_t *checksum) {
+  if (n > buf_size_ - offset_) {
+    return false;
+  }
+  *checksum += CopyAndChecksum(
+      std::span(static_cast<const uint8_t*>(buf), n), buf_ + offset_);
+  offset_ += n;
+
+  return true;
+}
+
+WOFF2MmapFileOut::WOFF2MmapFileOut(const std::string& filename, size_t size)
+  : filename_(filename),
+    fd_(CreateTempFile(filename, &temp_filename_)),
+    buf_(NULL),
+    buf_size_(0),
+    max_size_(kDefaultMaxSize),
+    offset_(0) {
+  if (fd_ >= 0 && size > 0) {
+    Map(std::min(size, max_size_));
+  }
+}
+
+WOFF2MmapFileOut::~WOFF2MmapFileOut() {
+  if (fd_ >= 0) {
+    Unmap();
+#if defined(_WIN32)
+    _close(fd_);
+#else
+    close(fd_);
+#endif
+    remove(temp_filename_.c_str());
+  }
+}
+
+bool WOFF2MmapFileOut::Write(const void *buf, size_t n) {
+  return Write(buf, offset_, n);
+}
+
+bool WOFF2MmapFileOut::Write(const void *buf, size_t offset, size_t n) {
+  if (!Reserve(offset, n)) {
+    return false;
+  }
+  if (n > 0) {
+    std::memcpy(buf_ + offset, buf, n);
+  }
+  offset_ = std::max(offset_, offset + n);
+
+  return true;
+}
+
+bool WOFF2MmapFileOut::WriteWithChecksum(const void *buf, size_t n,
+                                         uint32_t *checksum) {
+  if (!Reserve(offset_, n)) {
+    return false;
+  }
+  if (n > 0) {
+    *checksum += CopyAndChecksum(
+        std::span(static_cast<const uint8_t*>(buf), n), buf_ + offset_);
+  }
+  offset_ += n;
+
+  return true;
+}
+
+// Make sure [offset, offset + n) is mapped.
+bool WOFF2MmapFileOut::Reserve(size_t offset, size_t n) {
+  if (fd_ < 0 || offset > max_size_ || n > max_size_ - offset) {
+    return false;
+  }
+  if (offset + n > buf_size_) {
+    // Grow geometrically so that a poor size estimate stays cheap.
+    size_t size = std::max(offset + n, std::min(2 * buf_size_, max_size_));
+    if (!Map(size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void WOFF2MmapFileOut::SizeHint(size_t size) {
+  size = std::min(size, max_size_);
+  if (fd_ >= 0 && size > buf_size_) {
+    Map(size);
+  }
+}
+
+void WOFF2MmapFileOut::SetMaxSize(size_t max_size) {
+  max_size_ = max_size;
+  if (offset_ > max_size_) {
+    offset_ = max_size_;
+  }
+}
+
+bool WOFF2MmapFileOut::Close() {
+  if (fd_ < 0) {
+    return false;
+  }
+  bool ok = true;
+#if defined(_WIN32)
+  // The data was kept in memory, and goes to the file now.
+  for (size_t written = 0; ok && written < offset_;) {
+    const unsigned int chunk = static_cast<unsigned int>(std::min<size_t>(
+        offset_ - written, std::numeric_limits<int>::max()));
+    const int n = _write(fd_, buf_ + written, chunk);
+    ok = n > 0;
+    written += ok ? n : 0;
+  }
+  Unmap();
+  ok = _close(fd_) == 0 && ok;
+  // rename() doesn't replace a file on Windows.
+  if (ok) {
+    remove(filename_.c_str());
+  }
+#else
+  ok = Unmap();
+  ok = ftruncate(fd_, offset_) == 0 && ok;
+  ok = close(fd_) == 0 && ok;
+#endif
+  fd_ = -1;
+  ok = ok && rename(temp_filename_.c_str(), filename_.c_str()) == 0;
+  if (!ok) {
+    remove(temp_filename_.c_str());
+  }
+  return ok;
+}
+
+// Map the first size bytes of the file, which must be more than are mapped.
+// What is mapped stays so if this fails.
+bool WOFF2MmapFileOut::Map(size_t size) {
+#if defined(_WIN32)
+  // Without mmap, the data is held in memory until Close().
+  void* buf = realloc(buf_, size);
+  if (buf == NULL) {
+    return false;
+  }
+  buf_ = static_cast<uint8_t*>(buf);
+  buf_size_ = size;
+  return true;
+#else
+  // A store to a page of a shared mapping that has no block of the file
+  // behind it raises SIGBUS once the disk is full, so the blocks are taken
+  // before anything is written to them, where running out is a failed write.
+  if (!AllocateFile(fd_, buf_size_, size)) {
+    return false;
+  }
+  void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (buf == MAP_FAILED) {
+    return false;
+  }
+  Unmap();
+  buf_ = static_cast<uint8_t*>(buf);
+  buf_size_ = size;
+  return true;
+#endif
+}
+
+bool WOFF2MmapFileOut::Unmap() {
+  bool ok = true;
+#if defined(_WIN32)
+  free(buf_);
+#else
+  if (buf_ != NULL) {
+    ok = munmap(buf_, buf_size_) == 0;
+  }
+#endif
+  buf_ = NULL;
+  buf_size_ = 0;
+  return ok;
+}
+
+WOFF2CallbackOut::WOFF2CallbackOut(Callback callback, size_t chunk_size)
+  : callback_(std::move(callback)),
+    chunk_size_(chunk_size),
+    offset_(0) {}
+
+bool WOFF2CallbackOut::Write(const void *buf, size_t n) {
+  const uint8_t* data = static_cast<const uint8_t*>(buf);
+  offset_ += n;
+  if (chunk_.size() + n < chunk_size_) {
+    chunk_.insert(chunk_.end(), data, data + n);
+    return true;
+  }
+  if (!Flush()) {
+    return false;
+  }
+  // Large writes are passed on as they are, without a copy.
+  if (n >= chunk_size_) {
+    return callback_(data, n);
+  }
+  chunk_.assign(data, data + n);
+  return true;
+}
+
+bool WOFF2CallbackOut::Write(const void *buf, size_t offset, size_t n) {
+  if (offset != offset_) {
+    return false;
+  }
+  return Write(buf, n);
+}
+
+bool WOFF2CallbackOut::Flush() {
+  if (chunk_.empty()) {
+    return true;
+  }
+  bool ok = callback_(chunk_.data(), chunk_.size());
+  chunk_.clear();
+  return ok;
+}
+
 } // namespace woff2